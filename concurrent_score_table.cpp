@@ -0,0 +1,68 @@
+#include "concurrent_score_table.h"
+
+#include <limits>
+
+using namespace std;
+
+ConcurrentScoreTable::ConcurrentScoreTable(size_t max_size) {
+    Reset(max_size);
+}
+
+void ConcurrentScoreTable::Reset(size_t max_size) {
+    // Load factor of at most 1/2 keeps linear probing chains short
+    size_t capacity = 16;
+    while (capacity < max_size * 2) {
+        capacity *= 2;
+    }
+    mask_ = capacity - 1;
+    if (capacity > allocated_slot_count_) {
+        slots_ = make_unique<Slot[]>(capacity);
+        allocated_slot_count_ = capacity;
+        return;
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        slots_[i].document_id.store(EMPTY, memory_order_relaxed);
+        slots_[i].relevance.store(0.0, memory_order_relaxed);
+    }
+}
+
+size_t ConcurrentScoreTable::GetStartSlot(int document_id) const {
+    // Fibonacci hashing spreads consecutive ids over the table
+    return (static_cast<uint64_t>(document_id) * 11400714819323198485ull >> 32) & mask_;
+}
+
+void ConcurrentScoreTable::Add(int document_id, double relevance) {
+    for (size_t i = GetStartSlot(document_id);; i = (i + 1) & mask_) {
+        Slot& slot = slots_[i];
+        int current = slot.document_id.load(memory_order_relaxed);
+        if (current == EMPTY) {
+            if (slot.document_id.compare_exchange_strong(current, document_id, memory_order_relaxed)) {
+                current = document_id;
+            }
+            // On failure current holds the id another thread has just put here
+        }
+        if (current == document_id) {
+            double expected = slot.relevance.load(memory_order_relaxed);
+            while (!slot.relevance.compare_exchange_weak(expected, expected + relevance, memory_order_relaxed)) {
+            }
+            return;
+        }
+    }
+}
+
+void ConcurrentScoreTable::Exclude(int document_id) {
+    for (size_t i = GetStartSlot(document_id);; i = (i + 1) & mask_) {
+        const int current = slots_[i].document_id.load(memory_order_relaxed);
+        if (current == EMPTY) {
+            return;
+        }
+        if (current == document_id) {
+            slots_[i].relevance.store(numeric_limits<double>::quiet_NaN(), memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+size_t ConcurrentScoreTable::GetSlotCount() const {
+    return mask_ + 1;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Fixed-size open-addressing table of document relevances shared by all threads
+// of one query. Inserting a key is a single CAS and adding to a value is a CAS
+// loop on the slot itself, so threads never wait on each other's locks.
+class ConcurrentScoreTable {
+public:
+    // max_size bounds the number of distinct documents that will be added
+    explicit ConcurrentScoreTable(size_t max_size);
+
+    // Empties the table for another query, reusing its slots when there are enough
+    void Reset(size_t max_size);
+
+    void Add(int document_id, double relevance);
+    // Drops an already added document from the results; must not overlap with Add
+    void Exclude(int document_id);
+
+    size_t GetSlotCount() const;
+
+    // Calls func(document_id, relevance) for every live document stored in slots [first, last)
+    template <typename Func>
+    void ForEachInRange(size_t first, size_t last, Func func) const;
+
+private:
+    static constexpr int EMPTY = -1;
+
+    struct Slot {
+        std::atomic<int> document_id{EMPTY};
+        std::atomic<double> relevance{0.0};
+    };
+
+    size_t mask_ = 0;
+    std::unique_ptr<Slot[]> slots_;
+    size_t allocated_slot_count_ = 0;
+
+    size_t GetStartSlot(int document_id) const;
+};
+
+template <typename Func>
+void ConcurrentScoreTable::ForEachInRange(size_t first, size_t last, Func func) const {
+    for (size_t i = first; i < last; ++i) {
+        const int document_id = slots_[i].document_id.load(std::memory_order_relaxed);
+        if (document_id == EMPTY) {
+            continue;
+        }
+        const double relevance = slots_[i].relevance.load(std::memory_order_relaxed);
+        // Excluded documents are marked with NaN
+        if (!std::isnan(relevance)) {
+            func(document_id, relevance);
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#include "impact_index.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+using namespace std;
+
+ImpactIndex::ImpactIndex(const InvertedIndex& index, size_t term_count) {
+    block_offsets_.reserve(term_count + 1);
+    block_offsets_.push_back(0);
+    vector<uint32_t> levels;
+    for (TermId term = 0; term < term_count; ++term) {
+        const PostingList* postings = index.FindPostings(term);
+        if (postings == nullptr || postings->empty()) {
+            block_offsets_.push_back(static_cast<uint32_t>(blocks_.size()));
+            continue;
+        }
+
+        // A counting sort by level keeps every block's ordinals ascending
+        levels.clear();
+        array<uint32_t, MAX_LEVEL + 1> level_counts{};
+        const double step = postings->max_term_freq / MAX_LEVEL;
+        for (PostingCursor cursor(*postings); !cursor.AtEnd(); cursor.Next()) {
+            const double level = step > 0.0 ? ceil(cursor.GetTermFreq() / step) : MAX_LEVEL;
+            levels.push_back(static_cast<uint32_t>(clamp(level, 1.0, static_cast<double>(MAX_LEVEL))));
+            ++level_counts[levels.back()];
+        }
+        const size_t first_ordinal = ordinals_.size();
+        ordinals_.resize(first_ordinal + levels.size());
+        array<uint32_t, MAX_LEVEL + 1> level_offsets{};
+        uint32_t offset = static_cast<uint32_t>(first_ordinal);
+        for (uint32_t level = MAX_LEVEL; level > 0; --level) {
+            if (level_counts[level] > 0) {
+                blocks_.push_back({ level, offset, offset + level_counts[level] });
+                level_offsets[level] = offset;
+                offset += level_counts[level];
+            }
+        }
+        size_t i = 0;
+        for (PostingCursor cursor(*postings); !cursor.AtEnd(); cursor.Next()) {
+            ordinals_[level_offsets[levels[i++]]++] = static_cast<uint32_t>(cursor.GetDocumentId());
+        }
+        block_offsets_.push_back(static_cast<uint32_t>(blocks_.size()));
+    }
+}
+
+size_t ImpactIndex::GetMemoryUsage() const {
+    return block_offsets_.capacity() * sizeof(uint32_t) + blocks_.capacity() * sizeof(Block)
+        + ordinals_.capacity() * sizeof(uint32_t);
+}
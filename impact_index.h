@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "inverted_index.h"
+#include "term_dictionary.h"
+
+// Postings of every term regrouped by how much they can add to a relevance. A term
+// frequency is quantised to a level in [1, MAX_LEVEL] relative to the list's
+// max_term_freq, rounding up, and the postings of one level form a block; blocks go
+// from the highest level down. A query can thus visit the postings of all its words
+// in decreasing contribution and stop once the rest cannot change its top.
+// With step = max_term_freq / MAX_LEVEL, a posting of level l has a term frequency
+// in ((l - 1) * step, l * step], so level * step overestimates it by less than step.
+class ImpactIndex {
+public:
+    static constexpr uint32_t MAX_LEVEL = 255;
+
+    struct Block {
+        uint32_t level;
+        // Ordinals [first, last) of GetOrdinals(), ascending
+        uint32_t first;
+        uint32_t last;
+    };
+
+    ImpactIndex(const InvertedIndex& index, size_t term_count);
+
+    // Blocks of the term from the highest level down, an empty range when it has no postings
+    const Block* GetBlocksBegin(TermId term) const {
+        return blocks_.data() + block_offsets_[term];
+    }
+    const Block* GetBlocksEnd(TermId term) const {
+        return blocks_.data() + block_offsets_[term + 1];
+    }
+    const uint32_t* GetOrdinals() const {
+        return ordinals_.data();
+    }
+
+    size_t GetMemoryUsage() const;
+
+private:
+    // Term t has blocks [block_offsets_[t], block_offsets_[t + 1])
+    std::vector<uint32_t> block_offsets_;
+    std::vector<Block> blocks_;
+    std::vector<uint32_t> ordinals_;
+};
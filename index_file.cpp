@@ -0,0 +1,86 @@
+#include "index_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+constexpr size_t ALIGNMENT = 8;
+
+size_t AlignUp(size_t offset) {
+    return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+}  // namespace
+
+IndexWriter::IndexWriter(ostream& output)
+    : output_(output) {
+}
+
+void IndexWriter::Align() {
+    static const char padding[ALIGNMENT] = {};
+    WriteBytes(padding, AlignUp(offset_) - offset_);
+}
+
+void IndexWriter::WriteBytes(const void* data, size_t size) {
+    output_.write(static_cast<const char*>(data), size);
+    offset_ += size;
+}
+
+IndexReader::IndexReader(const char* data, size_t size)
+    : data_(data)
+    , size_(size) {
+}
+
+void IndexReader::Align() {
+    offset_ = min(AlignUp(offset_), size_);
+}
+
+const char* IndexReader::Take(size_t size) {
+    if (size > size_ - offset_) {
+        throw invalid_argument("Index file is truncated");
+    }
+    const char* result = data_ + offset_;
+    offset_ += size;
+    return result;
+}
+
+MappedFile::MappedFile(const string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Cannot open index file "s + path);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        throw runtime_error("Cannot stat index file "s + path);
+    }
+    size_ = static_cast<size_t>(file_stat.st_size);
+    if (size_ > 0) {
+        void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            throw runtime_error("Cannot map index file "s + path);
+        }
+        data_ = static_cast<const char*>(mapping);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+}
+
+const char* MappedFile::data() const {
+    return data_;
+}
+
+size_t MappedFile::size() const {
+    return size_;
+}
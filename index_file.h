@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+// Building blocks of the binary index format. Values are written in host byte
+// order and arrays start at 8-byte aligned offsets, so a mapped file can be used
+// in place through plain pointers.
+
+constexpr char INDEX_FILE_MAGIC[8] = { 'S', 'R', 'C', 'H', 'I', 'D', 'X', '\0' };
+constexpr uint32_t INDEX_FILE_VERSION = 7;
+
+class IndexWriter {
+public:
+    explicit IndexWriter(std::ostream& output);
+
+    template <typename T>
+    void Write(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        WriteBytes(&value, sizeof(T));
+    }
+
+    template <typename T>
+    void WriteArray(const T* data, size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        Align();
+        WriteBytes(data, count * sizeof(T));
+    }
+
+    void Align();
+
+private:
+    std::ostream& output_;
+    size_t offset_ = 0;
+
+    void WriteBytes(const void* data, size_t size);
+};
+
+// Reads values in place from a mapped file; throws std::invalid_argument on a truncated file
+class IndexReader {
+public:
+    IndexReader(const char* data, size_t size);
+
+    template <typename T>
+    T Read() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, Take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    // The returned pointer points into the mapping
+    template <typename T>
+    const T* ReadArray(size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        Align();
+        if (count > (size_ - offset_) / sizeof(T)) {
+            throw std::invalid_argument("Index file is truncated");
+        }
+        return reinterpret_cast<const T*>(Take(count * sizeof(T)));
+    }
+
+    void Align();
+
+private:
+    const char* data_;
+    size_t size_;
+    size_t offset_ = 0;
+
+    const char* Take(size_t size);
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const;
+    size_t size() const;
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
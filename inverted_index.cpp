@@ -0,0 +1,345 @@
+#include "inverted_index.h"
+
+#include <numeric>
+#include <stdexcept>
+
+using namespace std;
+
+size_t PostingList::GetBlockCount() const {
+    return compressed ? compressed->GetBlockCount() : (size() + POSTING_BLOCK_SIZE - 1) / POSTING_BLOCK_SIZE;
+}
+
+void PostingList::InsertSorted(const int* new_document_ids, const double* new_term_freqs, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    Decompress();
+    auto& ids = document_ids.Mutable();
+    auto& freqs = term_freqs.Mutable();
+    max_term_freq = max(max_term_freq, *max_element(new_term_freqs, new_term_freqs + count));
+    if (ids.empty() || ids.back() < new_document_ids[0]) {
+        const size_t first_block = ids.size() / POSTING_BLOCK_SIZE;
+        ids.insert(ids.end(), new_document_ids, new_document_ids + count);
+        freqs.insert(freqs.end(), new_term_freqs, new_term_freqs + count);
+        UpdateBlockMaxTermFreqs(first_block);
+        return;
+    }
+    // Merge from the back, so each posting moves at most once
+    size_t old_pos = ids.size();
+    size_t new_pos = count;
+    ids.resize(ids.size() + count);
+    freqs.resize(freqs.size() + count);
+    for (size_t out = ids.size(); new_pos > 0; ) {
+        --out;
+        if (old_pos > 0 && ids[old_pos - 1] > new_document_ids[new_pos - 1]) {
+            --old_pos;
+            ids[out] = ids[old_pos];
+            freqs[out] = freqs[old_pos];
+        } else {
+            --new_pos;
+            ids[out] = new_document_ids[new_pos];
+            freqs[out] = new_term_freqs[new_pos];
+        }
+    }
+    UpdateBlockMaxTermFreqs(0);
+}
+
+void PostingList::UpdateBlockMaxTermFreqs(size_t first_block) {
+    auto& block_maxima = block_max_term_freqs.Mutable();
+    block_maxima.resize(GetBlockCount());
+    for (size_t block = first_block; block < block_maxima.size(); ++block) {
+        const double* first = term_freqs.begin() + block * POSTING_BLOCK_SIZE;
+        const double* last = term_freqs.begin() + min((block + 1) * POSTING_BLOCK_SIZE, term_freqs.size());
+        block_maxima[block] = *max_element(first, last);
+    }
+}
+
+void PostingList::Compress(PostingCodec codec, const vector<uint32_t>& word_counts, const vector<uint32_t>& document_lengths) {
+    if (codec == PostingCodec::RAW) {
+        Decompress();
+        return;
+    }
+    if (compressed) {
+        return;
+    }
+    compressed = make_shared<CompressedPostings>(codec, document_ids.data(), word_counts.data(),
+                                                 document_lengths.data(), size());
+    document_ids = {};
+    term_freqs = {};
+}
+
+void PostingList::Decompress() {
+    if (!compressed) {
+        return;
+    }
+    vector<int> ids;
+    vector<double> freqs;
+    ids.reserve(compressed->size());
+    freqs.reserve(compressed->size());
+    for (PostingCursor cursor(*this); !cursor.AtEnd(); cursor.Next()) {
+        ids.push_back(cursor.GetDocumentId());
+        freqs.push_back(cursor.GetTermFreq());
+    }
+    compressed.reset();
+    document_ids.Mutable() = move(ids);
+    term_freqs.Mutable() = move(freqs);
+}
+
+PostingCursor::PostingCursor(const PostingList& postings)
+    : PostingCursor(postings, 0, postings.GetBlockCount()) {
+}
+
+PostingCursor::PostingCursor(const PostingList& postings, size_t first_block, size_t last_block) {
+    Init(postings, first_block, last_block);
+}
+
+void PostingCursor::Reset(const PostingList& postings) {
+    Init(postings, 0, postings.GetBlockCount());
+}
+
+void PostingCursor::Reset(const PostingList& postings, size_t first_block, size_t last_block) {
+    Init(postings, first_block, last_block);
+}
+
+void PostingCursor::Init(const PostingList& postings, size_t first_block, size_t last_block) {
+    if (postings.compressed) {
+        compressed_ = postings.compressed.get();
+        block_max_term_freqs_ = postings.block_max_term_freqs.data();
+        if (decoded_ == nullptr) {
+            decoded_ = make_unique<DecodedBlock>();
+        }
+        last_block_ = min(last_block, compressed_->GetBlockCount());
+        LoadBlock(first_block);
+        return;
+    }
+    // A raw range is loaded whole, as if it were a single block
+    compressed_ = nullptr;
+    const size_t first = min(first_block * POSTING_BLOCK_SIZE, postings.size());
+    const size_t last = min(last_block * POSTING_BLOCK_SIZE, postings.size());
+    document_ids_ = postings.document_ids.data() + first;
+    term_freqs_ = postings.term_freqs.data() + first;
+    block_max_term_freqs_ = postings.block_max_term_freqs.data() + min(first_block, postings.block_max_term_freqs.size());
+    pos_ = 0;
+    end_ = last - first;
+    block_ = 0;
+    last_block_ = 0;
+}
+
+PostingCursor::PostingCursor(const PostingCursor& other) {
+    *this = other;
+}
+
+PostingCursor& PostingCursor::operator=(const PostingCursor& other) {
+    if (this == &other) {
+        return *this;
+    }
+    compressed_ = other.compressed_;
+    document_ids_ = other.document_ids_;
+    term_freqs_ = other.term_freqs_;
+    block_max_term_freqs_ = other.block_max_term_freqs_;
+    pos_ = other.pos_;
+    end_ = other.end_;
+    block_ = other.block_;
+    last_block_ = other.last_block_;
+    if (compressed_ != nullptr) {
+        decoded_ = make_unique<DecodedBlock>(*other.decoded_);
+        document_ids_ = decoded_->document_ids;
+        term_freqs_ = decoded_->term_freqs;
+    } else {
+        decoded_.reset();
+    }
+    return *this;
+}
+
+void PostingCursor::Seek(int document_id) {
+    if (AtEnd()) {
+        return;
+    }
+    if (compressed_ != nullptr && document_ids_[end_ - 1] < document_id) {
+        // Gallop over the blocks' last ids, then decode only the block that can hold document_id
+        size_t lo = block_ + 1;
+        size_t hi = lo;
+        size_t step = 1;
+        while (hi < last_block_ && compressed_->GetBlockLastDocumentId(hi) < document_id) {
+            lo = hi + 1;
+            hi += step;
+            step *= 2;
+        }
+        hi = min(hi, last_block_);
+        while (lo < hi) {
+            const size_t mid = (lo + hi) / 2;
+            if (compressed_->GetBlockLastDocumentId(mid) < document_id) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        LoadBlock(lo);
+        if (AtEnd()) {
+            return;
+        }
+    }
+    // Gallop forward first: cursors usually move a short distance
+    size_t step = 1;
+    size_t from = pos_;
+    size_t hi = pos_;
+    while (hi < end_ && document_ids_[hi] < document_id) {
+        from = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    hi = min(hi, end_);
+    pos_ = lower_bound(document_ids_ + from, document_ids_ + hi, document_id) - document_ids_;
+}
+
+void PostingCursor::LoadBlock(size_t block) {
+    block_ = block;
+    pos_ = 0;
+    if (block >= last_block_) {
+        end_ = 0;
+        return;
+    }
+    end_ = compressed_->DecodeBlock(block, decoded_->document_ids, decoded_->term_freqs);
+    document_ids_ = decoded_->document_ids;
+    term_freqs_ = decoded_->term_freqs;
+}
+
+void InvertedIndex::AddDocuments(ThreadPool& thread_pool, const vector<int>& document_ids,
+                                 const vector<vector<TermFrequency>>& term_freqs) {
+    vector<size_t> order(document_ids.size());
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&document_ids](size_t lhs, size_t rhs) {
+        return document_ids[lhs] < document_ids[rhs];
+    });
+
+    // Counting sort by term: offsets[term] is where the term's postings start, and
+    // taking documents in id order leaves every term's run sorted by id
+    vector<size_t> offsets(postings_.size() + 1, 0);
+    for (const auto& document_term_freqs : term_freqs) {
+        if (!document_term_freqs.empty() && document_term_freqs.back().term >= postings_.size()) {
+            postings_.resize(document_term_freqs.back().term + 1);
+            offsets.resize(postings_.size() + 1, 0);
+        }
+        for (const TermFrequency& item : document_term_freqs) {
+            ++offsets[item.term + 1];
+        }
+    }
+    partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    vector<int> grouped_ids(offsets.back());
+    vector<double> grouped_freqs(offsets.back());
+    vector<size_t> next = offsets;
+    for (const size_t index : order) {
+        for (const TermFrequency& item : term_freqs[index]) {
+            const size_t pos = next[item.term]++;
+            grouped_ids[pos] = document_ids[index];
+            grouped_freqs[pos] = item.frequency;
+        }
+    }
+
+    // Lists are independent, so each task merges a range of terms
+    constexpr size_t TERMS_PER_TASK = 256;
+    thread_pool.ParallelFor((postings_.size() + TERMS_PER_TASK - 1) / TERMS_PER_TASK, [&](size_t task) {
+        const size_t last_term = min(postings_.size(), (task + 1) * TERMS_PER_TASK);
+        for (size_t term = task * TERMS_PER_TASK; term < last_term; ++term) {
+            postings_[term].InsertSorted(grouped_ids.data() + offsets[term], grouped_freqs.data() + offsets[term],
+                                         offsets[term + 1] - offsets[term]);
+        }
+    });
+}
+
+const PostingList* InvertedIndex::FindPostings(TermId term) const {
+    if (term >= postings_.size() || postings_[term].empty()) {
+        return nullptr;
+    }
+    return &postings_[term];
+}
+
+void InvertedIndex::Compress(PostingCodec codec, const vector<vector<uint32_t>>& word_counts,
+                             const vector<uint32_t>& document_lengths) {
+    vector<uint32_t> posting_lengths;
+    for (TermId term = 0; term < postings_.size(); ++term) {
+        PostingList& postings = postings_[term];
+        postings.Decompress();
+        if (codec == PostingCodec::RAW || postings.empty()) {
+            continue;
+        }
+        posting_lengths.clear();
+        for (const int document_id : postings.document_ids) {
+            posting_lengths.push_back(document_lengths[document_id]);
+        }
+        postings.Compress(codec, word_counts[term], posting_lengths);
+    }
+}
+
+size_t InvertedIndex::GetMemoryUsage() const {
+    size_t bytes = postings_.capacity() * sizeof(PostingList);
+    for (const auto& postings : postings_) {
+        bytes += postings.document_ids.GetOwnedBytes();
+        bytes += postings.term_freqs.GetOwnedBytes();
+        bytes += postings.block_max_term_freqs.GetOwnedBytes();
+        if (postings.compressed) {
+            bytes += postings.compressed->GetMemoryUsage();
+        }
+    }
+    return bytes;
+}
+
+namespace {
+
+struct PostingsHeader {
+    uint64_t size;
+    double max_term_freq;
+};
+
+}  // namespace
+
+void InvertedIndex::Save(IndexWriter& writer) const {
+    vector<PostingsHeader> headers;
+    headers.reserve(postings_.size());
+    vector<int> document_ids;
+    vector<double> term_freqs;
+    vector<double> block_max_term_freqs;
+    for (const auto& postings : postings_) {
+        headers.push_back({ postings.size(), postings.max_term_freq });
+        block_max_term_freqs.insert(block_max_term_freqs.end(), postings.block_max_term_freqs.begin(), postings.block_max_term_freqs.end());
+        // The file keeps postings raw so they can be read in place
+        for (PostingCursor cursor(postings); !cursor.AtEnd(); cursor.Next()) {
+            document_ids.push_back(cursor.GetDocumentId());
+            term_freqs.push_back(cursor.GetTermFreq());
+        }
+    }
+    writer.Write<uint64_t>(headers.size());
+    writer.WriteArray(headers.data(), headers.size());
+    writer.Write<uint64_t>(document_ids.size());
+    writer.WriteArray(document_ids.data(), document_ids.size());
+    writer.WriteArray(term_freqs.data(), term_freqs.size());
+    writer.Write<uint64_t>(block_max_term_freqs.size());
+    writer.WriteArray(block_max_term_freqs.data(), block_max_term_freqs.size());
+}
+
+void InvertedIndex::Load(IndexReader& reader) {
+    const auto list_count = reader.Read<uint64_t>();
+    const auto* headers = reader.ReadArray<PostingsHeader>(list_count);
+    const auto posting_count = reader.Read<uint64_t>();
+    const auto* document_ids = reader.ReadArray<int>(posting_count);
+    const auto* term_freqs = reader.ReadArray<double>(posting_count);
+    const auto block_count = reader.Read<uint64_t>();
+    const auto* block_max_term_freqs = reader.ReadArray<double>(block_count);
+
+    postings_.clear();
+    postings_.resize(list_count);
+    uint64_t offset = 0;
+    uint64_t block_offset = 0;
+    for (size_t i = 0; i < list_count; ++i) {
+        const uint64_t list_block_count = (headers[i].size + POSTING_BLOCK_SIZE - 1) / POSTING_BLOCK_SIZE;
+        if (headers[i].size > posting_count - offset || list_block_count > block_count - block_offset) {
+            throw invalid_argument("Index file has broken posting lists");
+        }
+        postings_[i].document_ids = MappedVector<int>::Borrow(document_ids + offset, headers[i].size);
+        postings_[i].term_freqs = MappedVector<double>::Borrow(term_freqs + offset, headers[i].size);
+        postings_[i].block_max_term_freqs = MappedVector<double>::Borrow(block_max_term_freqs + block_offset, list_block_count);
+        postings_[i].max_term_freq = headers[i].max_term_freq;
+        offset += headers[i].size;
+        block_offset += list_block_count;
+    }
+}
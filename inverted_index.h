@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "index_file.h"
+#include "mapped_vector.h"
+#include "posting_codec.h"
+#include "term_dictionary.h"
+#include "thread_pool.h"
+
+// Entry of a document's forward index: how many times the document has the word
+struct TermCount {
+    TermId term;
+    uint32_t count;
+};
+
+// A document's frequency of a term, as the postings hold it
+struct TermFrequency {
+    TermId term;
+    double frequency;
+};
+
+// Postings of a single term: document ids sorted ascending and term frequencies
+// stored in parallel arrays, so a scan touches two contiguous blocks of memory.
+// A compressed list keeps its postings in compressed instead and is read through
+// PostingCursor; it is decompressed before new postings are merged in.
+struct PostingList {
+    MappedVector<int> document_ids;
+    MappedVector<double> term_freqs;
+    // Upper bound of term_freqs
+    double max_term_freq = 0.0;
+    // Upper bound of term_freqs in every block of POSTING_BLOCK_SIZE postings, by which
+    // block-max WAND skips blocks that cannot reach the top
+    MappedVector<double> block_max_term_freqs;
+    std::shared_ptr<const CompressedPostings> compressed;
+
+    size_t size() const {
+        return compressed ? compressed->size() : document_ids.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Blocks of POSTING_BLOCK_SIZE postings, the unit PostingCursor ranges are given in
+    size_t GetBlockCount() const;
+    // Merges postings sorted by document id whose ids are not in the list yet
+    void InsertSorted(const int* new_document_ids, const double* new_term_freqs, size_t count);
+    // word_counts and document_lengths hold how many times every posting's document has
+    // the word and how many words it has in all
+    void Compress(PostingCodec codec, const std::vector<uint32_t>& word_counts, const std::vector<uint32_t>& document_lengths);
+    void Decompress();
+
+private:
+    // Recomputes the block maxima of a raw list from first_block on
+    void UpdateBlockMaxTermFreqs(size_t first_block);
+};
+
+// Walks a posting list in document id order whether it is compressed or not.
+// A compressed list is decoded one block at a time, and Seek skips the blocks
+// whose last document id is too small without decoding them.
+class PostingCursor {
+public:
+    // At the end of an empty list, until Reset
+    PostingCursor() = default;
+    explicit PostingCursor(const PostingList& postings);
+    // Covers only the postings of blocks [first_block, last_block)
+    PostingCursor(const PostingList& postings, size_t first_block, size_t last_block);
+    PostingCursor(const PostingCursor& other);
+    PostingCursor& operator=(const PostingCursor& other);
+    PostingCursor(PostingCursor&& other) = default;
+    PostingCursor& operator=(PostingCursor&& other) = default;
+
+    bool AtEnd() const {
+        return pos_ == end_;
+    }
+
+    int GetDocumentId() const {
+        return document_ids_[pos_];
+    }
+
+    double GetTermFreq() const {
+        return term_freqs_[pos_];
+    }
+
+    // Upper bound of the term frequencies in the block of the current posting
+    double GetBlockMaxTermFreq() const {
+        return block_max_term_freqs_[compressed_ != nullptr ? block_ : pos_ / POSTING_BLOCK_SIZE];
+    }
+
+    // Document id of the last posting in the block of the current one
+    int GetBlockLastDocumentId() const {
+        if (compressed_ != nullptr) {
+            return document_ids_[end_ - 1];
+        }
+        return document_ids_[std::min((pos_ / POSTING_BLOCK_SIZE + 1) * POSTING_BLOCK_SIZE, end_) - 1];
+    }
+
+    void Next() {
+        if (++pos_ == end_ && compressed_ != nullptr) {
+            LoadBlock(block_ + 1);
+        }
+    }
+
+    // Moves forward to the first posting whose document id is not less than document_id
+    void Seek(int document_id);
+    // Starts over on the whole of another list, keeping the decode buffer, so a reused
+    // cursor does not allocate
+    void Reset(const PostingList& postings);
+    // The same over blocks [first_block, last_block) only
+    void Reset(const PostingList& postings, size_t first_block, size_t last_block);
+
+private:
+    // Kept apart from the cursor, so cursors stay small and moving one leaves the pointers valid
+    struct DecodedBlock {
+        int document_ids[POSTING_BLOCK_SIZE];
+        double term_freqs[POSTING_BLOCK_SIZE];
+    };
+
+    const CompressedPostings* compressed_ = nullptr;
+    const int* document_ids_ = nullptr;
+    const double* term_freqs_ = nullptr;
+    // Of the block at block_ when compressed; of the first block of the range when raw,
+    // whose blocks are counted from it
+    const double* block_max_term_freqs_ = nullptr;
+    size_t pos_ = 0;
+    size_t end_ = 0;
+    size_t block_ = 0;
+    size_t last_block_ = 0;
+    std::unique_ptr<DecodedBlock> decoded_;
+
+    void Init(const PostingList& postings, size_t first_block, size_t last_block);
+    void LoadBlock(size_t block);
+};
+
+class InvertedIndex {
+public:
+    // Adds a batch at once: postings are grouped by term, then every list takes its
+    // new postings in a single merge. term_freqs[i] belongs to document_ids[i] and
+    // must be sorted by term; the ids may come in any order
+    void AddDocuments(ThreadPool& thread_pool, const std::vector<int>& document_ids,
+                      const std::vector<std::vector<TermFrequency>>& term_freqs);
+
+    // nullptr when the term has no postings
+    const PostingList* FindPostings(TermId term) const;
+
+    // Compresses every list; a list modified later is stored raw again until the next call.
+    // word_counts[term] holds the count of the term in every posting of its list, in list
+    // order, and document_lengths[document_id] the number of words the document was indexed with
+    void Compress(PostingCodec codec, const std::vector<std::vector<uint32_t>>& word_counts,
+                  const std::vector<uint32_t>& document_lengths);
+
+    // Approximate heap footprint in bytes; mapped postings are not counted
+    size_t GetMemoryUsage() const;
+
+    void Save(IndexWriter& writer) const;
+    // Postings keep pointing into the reader's memory until they are modified
+    void Load(IndexReader& reader);
+
+private:
+    // Indexed by TermId
+    std::vector<PostingList> postings_;
+};
@@ -1,13 +1,21 @@
 #include "search_server.h"
 #include "log_duration.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <execution>
+#include <filesystem>
 #include <iostream>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 #include "process_queries.h"
 
 using namespace std;
+
+// Benchmarks of the server; its tests are the programs in tests/
+
 string GenerateWord(mt19937& generator, int max_length) {
     const int length = uniform_int_distribution(1, max_length)(generator);
     string word;
@@ -59,82 +67,394 @@ void Test(string_view mark, const SearchServer& search_server, const vector<stri
     cout << total_relevance << endl;
 }
 #define TEST(policy) Test(#policy, search_server, queries, execution::policy)
+// Partitioned queries against sequential ones on pools of 1, 2, 4 and all hardware threads.
+// Shards only pay off on idle cores: with fewer cores than workers they add their overhead
+void BenchmarkPartitioned(SearchServer& search_server, const vector<string>& queries) {
+    const size_t hardware_threads = max(1u, thread::hardware_concurrency());
+    cout << "hardware threads: "s << hardware_threads << endl;
+    Test("partitioned seq"s, search_server, queries, execution::seq);
+    vector<size_t> thread_counts = { 1, 2, 4, hardware_threads };
+    sort(thread_counts.begin(), thread_counts.end());
+    thread_counts.erase(unique(thread_counts.begin(), thread_counts.end()), thread_counts.end());
+    for (const size_t thread_count : thread_counts) {
+        search_server.SetThreadPool(make_shared<ThreadPool>(thread_count));
+        Test("partitioned "s + to_string(thread_count) + " threads"s, search_server, queries, PartitionedExecution{ thread_count });
+    }
+    search_server.SetThreadPool(ThreadPool::GetDefault());
+}
+void BenchmarkPruning(string_view mark, const SearchServer& search_server, const vector<string>& queries, bool dynamic_pruning) {
+    SearchOptions options;
+    options.dynamic_pruning = dynamic_pruning;
+    LOG_DURATION(mark);
+    double total_relevance = 0;
+    for (const string_view query : queries) {
+        for (const auto& document : search_server.FindTopDocuments(query, options)) {
+            total_relevance += document.relevance;
+        }
+    }
+    cout << total_relevance << endl;
+}
+// Word frequencies of real texts follow Zipf's law: a few words are in most documents and most
+// words are rare. WAND needs that skew to skip postings; in the uniform corpus of main every word
+// is about as common, and it loses to the exhaustive loop there
+void BenchmarkSkewedPruning(mt19937& generator) {
+    // Every rank needs a word of its own, or short words would take the weight of many ranks
+    auto dictionary = GenerateDictionary(generator, 50'000, 10);
+    sort(dictionary.begin(), dictionary.end());
+    dictionary.erase(unique(dictionary.begin(), dictionary.end()), dictionary.end());
+    shuffle(dictionary.begin(), dictionary.end(), generator);
+    vector<double> weights(dictionary.size());
+    for (size_t i = 0; i < weights.size(); ++i) {
+        weights[i] = 1.0 / (i + 1);
+    }
+    discrete_distribution<size_t> word_distribution(weights.begin(), weights.end());
+    const auto generate_text = [&](size_t word_count, size_t rank_limit) {
+        string text;
+        for (size_t i = 0; i < word_count; ++i) {
+            text += dictionary[word_distribution(generator) % rank_limit] + ' ';
+        }
+        return text;
+    };
+    SearchServer search_server(dictionary[0]);
+    for (int document_id = 0; document_id < 100'000; ++document_id) {
+        search_server.AddDocument(document_id, generate_text(uniform_int_distribution(20, 200)(generator), dictionary.size()),
+                                  DocumentStatus::ACTUAL, { 1, 2, 3 });
+    }
+    search_server.WaitForMerges();
+    // Short queries of words that are neither very rare nor stop words, as people type them
+    vector<string> queries;
+    for (int i = 0; i < 500; ++i) {
+        queries.push_back(generate_text(uniform_int_distribution(2, 5)(generator), 5'000));
+    }
+    BenchmarkPruning("skewed exhaustive"s, search_server, queries, false);
+    BenchmarkPruning("skewed wand"s, search_server, queries, true);
+}
+void BenchmarkImpactOrdering(SearchServer& search_server, const vector<string>& queries, const vector<string>& short_queries) {
+    {
+        LOG_DURATION("impact ordering"s);
+        search_server.SetImpactOrdering(true);
+    }
+    cout << "impact-ordered index memory: "s << search_server.GetIndexMemoryUsage() / 1024 << " KiB"s << endl;
+    SearchOptions options;
+    options.impact_ordered = true;
+    for (const bool is_short : {false, true}) {
+        if (is_short) {
+            BenchmarkPruning("short exhaustive"s, search_server, short_queries, false);
+            BenchmarkPruning("short wand"s, search_server, short_queries, true);
+        }
+        LOG_DURATION(is_short ? "short impact ordered"s : "impact ordered"s);
+        double total_relevance = 0;
+        for (const string_view query : is_short ? short_queries : queries) {
+            for (const auto& document : search_server.FindTopDocuments(query, options)) {
+                total_relevance += document.relevance;
+            }
+        }
+        cout << total_relevance << endl;
+    }
+    search_server.SetImpactOrdering(false);
+}
+void BenchmarkFilters(const SearchServer& search_server, const vector<string>& queries) {
+    SearchOptions options;
+    options.dynamic_pruning = false;
+    for (const bool by_status : {true, false}) {
+        LOG_DURATION(by_status ? "status filter"s : "predicate filter"s);
+        double total_relevance = 0;
+        for (const string_view query : queries) {
+            const auto documents = by_status
+                ? search_server.FindTopDocuments(query, DocumentStatus::ACTUAL, options)
+                : search_server.FindTopDocuments(query, [](int, DocumentStatus status, int) { return status == DocumentStatus::ACTUAL; }, options);
+            for (const auto& document : documents) {
+                total_relevance += document.relevance;
+            }
+        }
+        cout << total_relevance << endl;
+    }
+}
+void BenchmarkResultCache(SearchServer& search_server, mt19937& generator, const vector<string>& queries) {
+    // Popular queries repeat: the i-th most popular one is asked about twice as often as the 2i-th
+    vector<double> weights;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        weights.push_back(1.0 / (i + 1));
+    }
+    discrete_distribution<size_t> popularity(weights.begin(), weights.end());
+    vector<string_view> stream;
+    for (int i = 0; i < 500; ++i) {
+        stream.push_back(queries[popularity(generator)]);
+    }
+    for (const bool is_cached : {false, true}) {
+        search_server.SetResultCacheCapacity(is_cached ? queries.size() / 4 : 0);
+        LOG_DURATION(is_cached ? "cached"s : "uncached"s);
+        double total_relevance = 0;
+        for (const string_view query : stream) {
+            for (const auto& document : search_server.FindTopDocuments(query)) {
+                total_relevance += document.relevance;
+            }
+        }
+        cout << total_relevance << endl;
+    }
+    const auto stats = search_server.GetResultCacheStats();
+    cout << "result cache hit rate: "s << stats.GetHitRate() << ", hit "s << stats.mean_hit_latency.count() << " ns, miss "s
+         << stats.mean_miss_latency.count() / 1000 << " us"s << endl;
+    search_server.SetResultCacheCapacity(0);
+}
+void BenchmarkPhrases(SearchServer& search_server, mt19937& generator, const vector<string>& documents) {
+    {
+        LOG_DURATION("positional index"s);
+        search_server.SetPositionalIndex(true);
+    }
+    cout << "positional index memory: "s << search_server.GetPositionalIndexMemoryUsage() / 1024 << " KiB"s << endl;
+    // Word pairs and triples taken from the documents, so every phrase occurs at least once
+    vector<string> queries;
+    for (int i = 0; i < 1'000; ++i) {
+        const auto words = SplitIntoWords(documents[uniform_int_distribution<size_t>(0, documents.size() - 1)(generator)]);
+        const size_t length = uniform_int_distribution<size_t>(2, 3)(generator);
+        const size_t first = uniform_int_distribution<size_t>(0, words.size() - length)(generator);
+        string query = "\""s;
+        for (size_t j = first; j < first + length; ++j) {
+            query += (j > first ? " "s : ""s) + words[j];
+        }
+        queries.push_back(query + (i % 2 == 0 ? "\""s : "\"~2"s));
+    }
+    LOG_DURATION("phrase queries"s);
+    size_t found = 0;
+    for (const string_view query : queries) {
+        found += search_server.FindTopDocuments(query).size();
+    }
+    cout << found << endl;
+    search_server.SetPositionalIndex(false);
+}
+void BenchmarkConjunctive(const SearchServer& search_server, mt19937& generator, const vector<string>& documents) {
+    // Words taken from one document, so every query has an AND match
+    vector<string> queries;
+    for (int i = 0; i < 1'000; ++i) {
+        const auto words = SplitIntoWords(documents[uniform_int_distribution<size_t>(0, documents.size() - 1)(generator)]);
+        string query;
+        for (int j = uniform_int_distribution(2, 3)(generator); j > 0; --j) {
+            query += (query.empty() ? ""s : " "s) + words[uniform_int_distribution<size_t>(0, words.size() - 1)(generator)];
+        }
+        queries.push_back(move(query));
+    }
+    for (const bool conjunctive : { false, true }) {
+        SearchOptions options;
+        options.conjunctive = conjunctive;
+        LOG_DURATION(conjunctive ? "and queries"s : "or queries"s);
+        size_t found = 0;
+        for (const auto& documents_found : ProcessQueries(search_server, queries, options)) {
+            found += documents_found.size();
+        }
+        cout << found << endl;
+    }
+}
+void BenchmarkMatch(const SearchServer& search_server, const vector<string>& queries) {
+    const vector<int> document_ids(search_server.begin(), search_server.end());
+    const vector<string> match_queries(queries.begin(), queries.begin() + min<size_t>(queries.size(), 10));
+    size_t matched = 0;
+    {
+        LOG_DURATION("match seq"s);
+        for (const string& query : match_queries) {
+            for (const int document_id : document_ids) {
+                matched += get<0>(search_server.MatchDocument(query, document_id)).size();
+            }
+        }
+    }
+    {
+        LOG_DURATION("match par"s);
+        for (const string& query : match_queries) {
+            for (const int document_id : document_ids) {
+                matched += get<0>(search_server.MatchDocument(execution::par, query, document_id)).size();
+            }
+        }
+    }
+    {
+        LOG_DURATION("match batch"s);
+        for (const string& query : match_queries) {
+            for (const auto& [words, status] : search_server.MatchDocuments(query, document_ids)) {
+                matched += words.size();
+            }
+        }
+    }
+    cout << matched << endl;
+}
+void BenchmarkCompiledQueries(const SearchServer& search_server, const vector<string>& queries) {
+    // Every query runs with every status and page size, as a results page with filters would
+    vector<SearchOptions> option_sets;
+    for (const size_t max_result_count : { 1, 5, 20 }) {
+        SearchOptions options;
+        options.max_result_count = max_result_count;
+        option_sets.push_back(options);
+    }
+    const DocumentStatus statuses[] = { DocumentStatus::ACTUAL, DocumentStatus::IRRELEVANT, DocumentStatus::BANNED };
+    size_t found = 0;
+    {
+        LOG_DURATION("raw queries"s);
+        for (const string& query : queries) {
+            for (const DocumentStatus status : statuses) {
+                for (const SearchOptions& options : option_sets) {
+                    found += search_server.FindTopDocuments(query, status, options).size();
+                }
+            }
+        }
+    }
+    {
+        LOG_DURATION("compiled queries"s);
+        CompiledQuery compiled;
+        for (const string& query : queries) {
+            search_server.CompileQuery(query, compiled);
+            for (const DocumentStatus status : statuses) {
+                for (const SearchOptions& options : option_sets) {
+                    found += search_server.FindTopDocuments(compiled, status, options).size();
+                }
+            }
+        }
+    }
+    cout << found << endl;
+}
+void BenchmarkColdStart(const SearchServer& search_server, const vector<string>& queries) {
+    const string path = (filesystem::temp_directory_path() / "search_server_index.bin"s).string();
+    {
+        LOG_DURATION("save index"s);
+        search_server.SaveIndex(path);
+    }
+    const SearchServer mapped_server = [&path] {
+        LOG_DURATION("open index"s);
+        return SearchServer::OpenIndex(path);
+    }();
+    Test("mapped seq"s, mapped_server, queries, execution::seq);
+    filesystem::remove(path);
+}
+void BenchmarkCodecs(SearchServer& search_server, const vector<string>& queries) {
+    const pair<string, PostingCodec> codecs[] = {
+        { "varint"s, PostingCodec::VARINT },
+        { "bit-packed"s, PostingCodec::BIT_PACKED },
+        { "raw"s, PostingCodec::RAW },
+    };
+    for (const auto& [name, codec] : codecs) {
+        {
+            LOG_DURATION(name + " compress"s);
+            search_server.CompressIndex(codec);
+        }
+        cout << name << " index memory: "s << search_server.GetIndexMemoryUsage() / 1024 << " KiB"s << endl;
+        Test(name + " seq"s, search_server, queries, execution::seq);
+        Test(name + " par"s, search_server, queries, execution::par);
+        BenchmarkPruning(name + " wand"s, search_server, queries, true);
+    }
+}
+void BenchmarkTokenizer(const vector<string>& documents) {
+    LOG_DURATION("tokenize"s);
+    vector<string_view> words;
+    size_t word_count = 0;
+    for (int i = 0; i < 10; ++i) {
+        for (const string& document : documents) {
+            SplitIntoValidWords(document, words);
+            word_count += words.size();
+        }
+    }
+    cout << word_count << endl;
+}
+void BenchmarkBuild(const string& stop_words, const vector<string>& documents) {
+    const auto report = [&documents](string_view mark, chrono::steady_clock::duration duration) {
+        const double seconds = chrono::duration<double>(duration).count();
+        cout << mark << ": "s << static_cast<int64_t>(documents.size() / seconds) << " documents/s"s << endl;
+    };
+    auto start = chrono::steady_clock::now();
+    {
+        SearchServer search_server(stop_words);
+        for (size_t i = 0; i < documents.size(); ++i) {
+            search_server.AddDocument(i, documents[i], DocumentStatus::ACTUAL, {1, 2, 3});
+        }
+        report("one by one"s, chrono::steady_clock::now() - start);
+        search_server.WaitForMerges();
+    }
+    report("one by one, merged"s, chrono::steady_clock::now() - start);
+    start = chrono::steady_clock::now();
+    {
+        SearchServer search_server(stop_words);
+        vector<DocumentToAdd> batch;
+        batch.reserve(documents.size());
+        for (size_t i = 0; i < documents.size(); ++i) {
+            batch.push_back({ static_cast<int>(i), documents[i], DocumentStatus::ACTUAL, {1, 2, 3} });
+        }
+        search_server.AddDocuments(batch);
+    }
+    report("batch"s, chrono::steady_clock::now() - start);
+}
+void BenchmarkConcurrentUpdates(SearchServer& search_server, const vector<string>& queries, const vector<string>& documents) {
+    Test("queries alone"s, search_server, queries, execution::seq);
+    // A writer keeps adding documents and removing the ones it added a little earlier
+    atomic_bool stop = false;
+    int update_count = 0;
+    thread writer([&] {
+        const int first_id = static_cast<int>(documents.size());
+        for (int id = first_id; !stop; ++id) {
+            search_server.AddDocument(id, documents[id % documents.size()], DocumentStatus::ACTUAL, {1, 2, 3});
+            if (id - first_id >= 16) {
+                search_server.RemoveDocument(id - 16);
+            }
+            ++update_count;
+        }
+    });
+    Test("queries during updates"s, search_server, queries, execution::seq);
+    stop = true;
+    writer.join();
+    cout << update_count << " updates"s << endl;
+}
+void BenchmarkRemove(const string& stop_words, const vector<string>& documents) {
+    SearchServer search_server(stop_words);
+    vector<DocumentToAdd> batch;
+    batch.reserve(documents.size());
+    for (size_t i = 0; i < documents.size(); ++i) {
+        batch.push_back({ static_cast<int>(i), documents[i], DocumentStatus::ACTUAL, {1, 2, 3} });
+    }
+    search_server.AddDocuments(batch);
+    {
+        LOG_DURATION("remove one by one"s);
+        for (size_t i = 0; i < documents.size(); i += 4) {
+            search_server.RemoveDocument(i);
+        }
+    }
+    {
+        LOG_DURATION("remove in bulk"s);
+        vector<int> document_ids;
+        for (size_t i = 1; i < documents.size(); i += 4) {
+            document_ids.push_back(i);
+        }
+        search_server.RemoveDocuments(document_ids);
+    }
+    {
+        LOG_DURATION("purge"s);
+        search_server.WaitForMerges();
+        search_server.PurgeDeletedDocuments();
+    }
+    cout << search_server.GetDocumentCount() << " documents left"s << endl;
+}
 int main() {
     mt19937 generator;
     const auto dictionary = GenerateDictionary(generator, 1000, 10);
     const auto documents = GenerateQueries(generator, dictionary, 10'000, 70);
+    BenchmarkTokenizer(documents);
+    BenchmarkBuild(dictionary[0], documents);
+    BenchmarkRemove(dictionary[0], documents);
     SearchServer search_server(dictionary[0]);
     for (size_t i = 0; i < documents.size(); ++i) {
         search_server.AddDocument(i, documents[i], DocumentStatus::ACTUAL, {1, 2, 3});
     }
+    search_server.WaitForMerges();
+    cout << "index memory: "s << search_server.GetIndexMemoryUsage() / 1024 << " KiB"s << endl;
     const auto queries = GenerateQueries(generator, dictionary, 100, 70);
     TEST(seq);
     TEST(par);
+    BenchmarkPartitioned(search_server, queries);
+    BenchmarkPruning("exhaustive"s, search_server, queries, false);
+    BenchmarkPruning("wand"s, search_server, queries, true);
+    BenchmarkFilters(search_server, queries);
+    BenchmarkImpactOrdering(search_server, queries, GenerateQueries(generator, dictionary, 1000, 3));
+    BenchmarkResultCache(search_server, generator, queries);
+    BenchmarkPhrases(search_server, generator, documents);
+    BenchmarkConjunctive(search_server, generator, documents);
+    BenchmarkMatch(search_server, queries);
+    BenchmarkColdStart(search_server, queries);
+    BenchmarkCodecs(search_server, queries);
+    BenchmarkCompiledQueries(search_server, GenerateQueries(generator, dictionary, 2000, 3));
+    BenchmarkConcurrentUpdates(search_server, queries, documents);
+    BenchmarkSkewedPruning(generator);
 }
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-/*
-
-#include "process_queries.h"
-#include "search_server.h"
-#include <execution>
-#include <iostream>
-#include <string>
-#include <vector>
-using namespace std;
-void PrintDocument(const Document& document) {
-    cout << "{ "s
-         << "document_id = "s << document.id << ", "s
-         << "relevance = "s << document.relevance << ", "s
-         << "rating = "s << document.rating << " }"s << endl;
-}
-int main() {
-    SearchServer search_server("and with"s);
-    int id = 0;
-    for (
-        const string& text : {
-            "white cat and yellow hat"s,
-            "curly cat curly tail"s,
-            "nasty dog with big eyes"s,
-            "nasty pigeon john"s,
-        }
-    ) {
-        search_server.AddDocument(++id, text, DocumentStatus::ACTUAL, {1, 2});
-    }
-    cout << "ACTUAL by default:"s << endl;
-    // последовательная версия
-    for (const Document& document : search_server.FindTopDocuments("curly nasty cat"s)) {
-        PrintDocument(document);
-    }
-    
-    cout << "BANNED:"s << endl;
-    // последовательная версия
-    for (const Document& document : search_server.FindTopDocuments(execution::seq, "curly nasty cat"s, DocumentStatus::BANNED)) {
-        PrintDocument(document);
-    }
-    cout << "Even ids:"s << endl;
-    // параллельная версия
-    for (const Document& document : search_server.FindTopDocuments(execution::par, "curly nasty cat"s, [](int document_id, DocumentStatus status, int rating) { return document_id % 2 == 0; })) {
-        PrintDocument(document);
-    }
-    
-    return 0;
-}
-
-*/
\ No newline at end of file
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Read-only array that either owns its elements or borrows them from memory it
+// does not manage, such as a mapped index file. A borrowed array is copied into
+// owned storage the first time it is modified.
+template <typename T>
+class MappedVector {
+public:
+    MappedVector() = default;
+
+    static MappedVector Borrow(const T* data, size_t size) {
+        MappedVector result;
+        result.borrowed_data_ = data;
+        result.borrowed_size_ = size;
+        result.is_borrowed_ = true;
+        return result;
+    }
+
+    const T* data() const {
+        return is_borrowed_ ? borrowed_data_ : owned_.data();
+    }
+
+    size_t size() const {
+        return is_borrowed_ ? borrowed_size_ : owned_.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    const T& operator[](size_t index) const {
+        return data()[index];
+    }
+
+    const T& back() const {
+        return data()[size() - 1];
+    }
+
+    const T* begin() const {
+        return data();
+    }
+
+    const T* end() const {
+        return data() + size();
+    }
+
+    bool IsBorrowed() const {
+        return is_borrowed_;
+    }
+
+    // Heap bytes held by this array; borrowed memory is not counted
+    size_t GetOwnedBytes() const {
+        return owned_.capacity() * sizeof(T);
+    }
+
+    std::vector<T>& Mutable() {
+        if (is_borrowed_) {
+            owned_.assign(borrowed_data_, borrowed_data_ + borrowed_size_);
+            is_borrowed_ = false;
+        }
+        return owned_;
+    }
+
+private:
+    std::vector<T> owned_;
+    const T* borrowed_data_ = nullptr;
+    size_t borrowed_size_ = 0;
+    bool is_borrowed_ = false;
+};
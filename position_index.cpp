@@ -0,0 +1,159 @@
+#include "position_index.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+namespace {
+
+void WriteVarint(uint32_t value, vector<uint8_t>& output) {
+    while (value >= 0x80) {
+        output.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    output.push_back(static_cast<uint8_t>(value));
+}
+
+// Stops at end, so a broken file cannot make it read past the document
+const uint8_t* ReadVarint(const uint8_t* input, const uint8_t* end, uint32_t& value) {
+    value = 0;
+    for (uint32_t shift = 0; input != end && shift < 32; shift += 7) {
+        const uint8_t byte = *input++;
+        value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    return input;
+}
+
+}  // namespace
+
+PositionIndex::PositionIndex() {
+    document_offsets_.Mutable().push_back(0);
+}
+
+void PositionIndex::EncodeDocument(vector<pair<TermId, uint32_t>>& term_positions, vector<uint8_t>& encoded) {
+    sort(term_positions.begin(), term_positions.end());
+    encoded.clear();
+    for (size_t i = 0; i < term_positions.size(); ++i) {
+        const bool is_first = i == 0 || term_positions[i - 1].first != term_positions[i].first;
+        WriteVarint(term_positions[i].second - (is_first ? 0 : term_positions[i - 1].second), encoded);
+    }
+}
+
+void PositionIndex::AddDocument(const vector<uint8_t>& encoded) {
+    auto& data = data_.Mutable();
+    data.insert(data.end(), encoded.begin(), encoded.end());
+    document_offsets_.Mutable().push_back(data.size());
+}
+
+void PositionIndex::Decode(uint32_t ordinal, const MappedVector<TermCount>& term_counts, const TermId* terms, size_t term_count,
+                           vector<uint32_t>* positions) const {
+    for (size_t i = 0; i < term_count; ++i) {
+        positions[i].clear();
+    }
+    const uint8_t* input = data_.data() + document_offsets_[ordinal];
+    const uint8_t* const end = data_.data() + document_offsets_[ordinal + 1];
+    size_t next = 0;
+    for (const TermCount& item : term_counts) {
+        while (next < term_count && terms[next] < item.term) {
+            ++next;
+        }
+        if (next == term_count) {
+            break;
+        }
+        if (terms[next] != item.term) {
+            // Skipping a varint only needs its last byte, the one without the high bit
+            for (uint32_t j = 0; j < item.count && input != end; ++j) {
+                while (input != end && (*input & 0x80) != 0) {
+                    ++input;
+                }
+                input += input != end ? 1 : 0;
+            }
+            continue;
+        }
+        vector<uint32_t>& term_positions = positions[next++];
+        uint32_t position = 0;
+        for (uint32_t j = 0; j < item.count && input != end; ++j) {
+            uint32_t delta;
+            input = ReadVarint(input, end, delta);
+            position += delta;
+            term_positions.push_back(position);
+        }
+    }
+}
+
+void PositionIndex::DecodeDocument(uint32_t ordinal, const MappedVector<TermCount>& term_counts,
+                                   vector<pair<TermId, uint32_t>>& term_positions) const {
+    term_positions.clear();
+    const uint8_t* input = data_.data() + document_offsets_[ordinal];
+    const uint8_t* const end = data_.data() + document_offsets_[ordinal + 1];
+    for (const TermCount& item : term_counts) {
+        uint32_t position = 0;
+        for (uint32_t j = 0; j < item.count && input != end; ++j) {
+            uint32_t delta;
+            input = ReadVarint(input, end, delta);
+            position += delta;
+            term_positions.push_back({ item.term, position });
+        }
+    }
+}
+
+size_t PositionIndex::GetMemoryUsage() const {
+    return data_.GetOwnedBytes() + document_offsets_.GetOwnedBytes();
+}
+
+void PositionIndex::Save(IndexWriter& writer) const {
+    writer.Write<uint64_t>(data_.size());
+    writer.WriteArray(data_.data(), data_.size());
+    writer.WriteArray(document_offsets_.data(), document_offsets_.size());
+}
+
+void PositionIndex::Load(IndexReader& reader, size_t document_count) {
+    const auto data_size = reader.Read<uint64_t>();
+    const auto* data = reader.ReadArray<uint8_t>(data_size);
+    const auto* document_offsets = reader.ReadArray<uint64_t>(document_count + 1);
+    if (document_offsets[0] != 0 || document_offsets[document_count] != data_size
+        || !is_sorted(document_offsets, document_offsets + document_count + 1)) {
+        throw invalid_argument("Index file has broken positions"s);
+    }
+    data_ = MappedVector<uint8_t>::Borrow(data, data_size);
+    document_offsets_ = MappedVector<uint64_t>::Borrow(document_offsets, document_count + 1);
+}
+
+double CountPhraseOccurrences(const vector<uint32_t>* const* positions, const uint32_t* offsets, size_t word_count,
+                              uint32_t slop, vector<size_t>& cursors) {
+    cursors.assign(word_count, 0);
+    double occurrences = 0.0;
+    // Every word takes its first position far enough after the previous word's. That ends an
+    // occurrence as early as possible, so its extra is the least possible; and as the first
+    // word moves on, so do all the others, so every cursor only ever moves forward
+    for (const uint32_t first_position : *positions[0]) {
+        uint64_t previous = first_position;
+        uint64_t extra = 0;
+        size_t i = 1;
+        for (; i < word_count; ++i) {
+            const uint64_t needed = previous + (offsets[i] - offsets[i - 1]);
+            const vector<uint32_t>& word_positions = *positions[i];
+            size_t& cursor = cursors[i];
+            while (cursor < word_positions.size() && word_positions[cursor] < needed) {
+                ++cursor;
+            }
+            if (cursor == word_positions.size()) {
+                return occurrences;
+            }
+            extra += word_positions[cursor] - needed;
+            if (extra > slop) {
+                break;
+            }
+            previous = word_positions[cursor];
+        }
+        if (i == word_count) {
+            occurrences += 1.0 / (1.0 + static_cast<double>(extra));
+        }
+    }
+    return occurrences;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "index_file.h"
+#include "inverted_index.h"
+#include "mapped_vector.h"
+#include "term_dictionary.h"
+
+// Where every word of a segment's documents occurs. A position counts every word of
+// the text, stop words included, so a phrase with a stop word in it keeps its gap.
+// A document's positions follow the order of its forward index: for each of its word
+// counts, the ascending positions of that word delta-coded as LEB128 varints. The
+// word count says how many there are, so only every document's byte offset is stored.
+class PositionIndex {
+public:
+    PositionIndex();
+
+    // Sorts the document's (term, position) pairs and encodes them for AddDocument; the
+    // pairs must have the same words and counts as the document's forward index
+    static void EncodeDocument(std::vector<std::pair<TermId, uint32_t>>& term_positions, std::vector<uint8_t>& encoded);
+    // Documents are added in ordinal order
+    void AddDocument(const std::vector<uint8_t>& encoded);
+
+    // term_counts is the document's forward index; terms must be sorted and distinct.
+    // positions[i] gets the positions of terms[i], none when the document lacks it
+    void Decode(uint32_t ordinal, const MappedVector<TermCount>& term_counts, const TermId* terms, size_t term_count,
+                std::vector<uint32_t>* positions) const;
+    // Every (term, position) pair of the document, grouped by term
+    void DecodeDocument(uint32_t ordinal, const MappedVector<TermCount>& term_counts,
+                        std::vector<std::pair<TermId, uint32_t>>& term_positions) const;
+
+    size_t GetMemoryUsage() const;
+
+    void Save(IndexWriter& writer) const;
+    // The reader's memory has to outlive the index
+    void Load(IndexReader& reader, size_t document_count);
+
+private:
+    MappedVector<uint8_t> data_;
+    // Document o has bytes [document_offsets_[o], document_offsets_[o + 1]) of data_
+    MappedVector<uint64_t> document_offsets_;
+};
+
+// Occurrences of a phrase in a document, each weighted by 1 / (1 + extra), where extra is how
+// many more positions its words span than in the phrase; occurrences with extra above slop do
+// not count. positions[i] are the ascending positions of the phrase's i-th word in the document
+// and offsets[i] its position in the phrase. cursors is scratch space
+double CountPhraseOccurrences(const std::vector<uint32_t>* const* positions, const uint32_t* offsets, size_t word_count,
+                              uint32_t slop, std::vector<size_t>& cursors);
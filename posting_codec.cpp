@@ -0,0 +1,272 @@
+#include "posting_codec.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+// In the bit-packed stream of a full block posting i sits in lane i % LANE_COUNT, and each
+// lane packs its postings into 32-bit words of its own, word w of lane l being word
+// w * LANE_COUNT + l of the stream, so one SSE2 shift and mask unpack four postings. The
+// last block of a list is usually short, often a single posting, so its values are packed
+// one after the other instead, which needs no whole words per lane
+constexpr size_t LANE_COUNT = 4;
+
+uint32_t BitWidth(uint32_t value) {
+    uint32_t width = 0;
+    while (value != 0) {
+        ++width;
+        value >>= 1;
+    }
+    return width;
+}
+
+void PackLanes(const uint32_t* values, uint32_t width, vector<uint8_t>& output) {
+    uint32_t words[POSTING_BLOCK_SIZE] = {};
+    for (size_t i = 0; i < POSTING_BLOCK_SIZE; ++i) {
+        const size_t bit = i / LANE_COUNT * width;
+        const size_t word = bit / 32 * LANE_COUNT + i % LANE_COUNT;
+        const uint64_t shifted = uint64_t{values[i]} << (bit % 32);
+        words[word] |= static_cast<uint32_t>(shifted);
+        if (bit % 32 + width > 32) {
+            words[word + LANE_COUNT] |= static_cast<uint32_t>(shifted >> 32);
+        }
+    }
+    const auto* bytes = reinterpret_cast<const uint8_t*>(words);
+    output.insert(output.end(), bytes, bytes + width * LANE_COUNT * sizeof(uint32_t));
+}
+
+void PackSequential(const uint32_t* values, size_t count, uint32_t width, vector<uint8_t>& output) {
+    uint64_t pending = 0;
+    uint32_t pending_bits = 0;
+    for (size_t i = 0; i < count; ++i) {
+        pending |= uint64_t{values[i]} << pending_bits;
+        pending_bits += width;
+        while (pending_bits >= 8) {
+            output.push_back(static_cast<uint8_t>(pending));
+            pending >>= 8;
+            pending_bits -= 8;
+        }
+    }
+    if (pending_bits > 0) {
+        output.push_back(static_cast<uint8_t>(pending));
+    }
+}
+
+// Reads the values a byte at a time, so nothing past the stream is touched
+const uint8_t* UnpackSequential(const uint8_t* input, uint32_t width, uint32_t* values, size_t count) {
+    const uint64_t mask = (uint64_t{1} << width) - 1;
+    uint64_t pending = 0;
+    uint32_t pending_bits = 0;
+    for (size_t i = 0; i < count; ++i) {
+        while (pending_bits < width) {
+            pending |= uint64_t{*input++} << pending_bits;
+            pending_bits += 8;
+        }
+        values[i] = static_cast<uint32_t>(pending & mask);
+        pending >>= width;
+        pending_bits -= width;
+    }
+    return input;
+}
+
+#if defined(__SSE2__)
+template <uint32_t Width>
+void UnpackLanes(const uint8_t* input, uint32_t* values) {
+    if constexpr (Width == 0) {
+        fill(values, values + POSTING_BLOCK_SIZE, 0u);
+    } else {
+        const __m128i mask = _mm_set1_epi32(static_cast<int>(Width == 32 ? ~0u : (1u << Width) - 1));
+        const auto* words = reinterpret_cast<const __m128i*>(input);
+        __m128i word = _mm_loadu_si128(words++);
+        uint32_t shift = 0;
+        for (size_t i = 0; i < POSTING_BLOCK_SIZE; i += LANE_COUNT) {
+            __m128i value = _mm_srl_epi32(word, _mm_cvtsi32_si128(static_cast<int>(shift)));
+            shift += Width;
+            if (shift >= 32 && i + LANE_COUNT < POSTING_BLOCK_SIZE) {
+                // The high bits of a value that straddles two words come from the next one
+                shift -= 32;
+                word = _mm_loadu_si128(words++);
+                value = _mm_or_si128(value, _mm_sll_epi32(word, _mm_cvtsi32_si128(static_cast<int>(Width - shift))));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(values + i), _mm_and_si128(value, mask));
+        }
+    }
+}
+#else
+template <uint32_t Width>
+void UnpackLanes(const uint8_t* input, uint32_t* values) {
+    if constexpr (Width == 0) {
+        fill(values, values + POSTING_BLOCK_SIZE, 0u);
+    } else {
+        constexpr uint64_t mask = (uint64_t{1} << Width) - 1;
+        for (size_t i = 0; i < POSTING_BLOCK_SIZE; ++i) {
+            const size_t bit = i / LANE_COUNT * Width;
+            const size_t word = bit / 32 * LANE_COUNT + i % LANE_COUNT;
+            uint32_t low;
+            uint32_t high = 0;
+            memcpy(&low, input + word * sizeof(uint32_t), sizeof(low));
+            if (bit % 32 + Width > 32) {
+                memcpy(&high, input + (word + LANE_COUNT) * sizeof(uint32_t), sizeof(high));
+            }
+            values[i] = static_cast<uint32_t>(((uint64_t{high} << 32 | low) >> (bit % 32)) & mask);
+        }
+    }
+}
+#endif
+
+using UnpackFunction = void (*)(const uint8_t*, uint32_t*);
+
+template <uint32_t... Widths>
+constexpr array<UnpackFunction, sizeof...(Widths)> MakeUnpackTable(integer_sequence<uint32_t, Widths...>) {
+    return { &UnpackLanes<Widths>... };
+}
+
+// With the width known at compile time the shifts and masks are constants
+constexpr auto UNPACK_BY_WIDTH = MakeUnpackTable(make_integer_sequence<uint32_t, 33>{});
+
+// Turns the deltas at ids into ids in place, each one more than the previous id and its delta
+void SumDeltas(int previous_id, int* ids, size_t count) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    // A prefix sum of four lanes in two shifted adds, carrying the last id to the next four
+    const __m128i one = _mm_set1_epi32(1);
+    __m128i carry = _mm_set1_epi32(previous_id);
+    for (; i + LANE_COUNT <= count; i += LANE_COUNT) {
+        __m128i sums = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ids + i)), one);
+        sums = _mm_add_epi32(sums, _mm_slli_si128(sums, 4));
+        sums = _mm_add_epi32(sums, _mm_slli_si128(sums, 8));
+        sums = _mm_add_epi32(sums, carry);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(ids + i), sums);
+        carry = _mm_shuffle_epi32(sums, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    previous_id = i > 0 ? ids[i - 1] : previous_id;
+#endif
+    for (; i < count; ++i) {
+        previous_id += ids[i] + 1;
+        ids[i] = previous_id;
+    }
+}
+
+}  // namespace
+
+CompressedPostings::CompressedPostings(PostingCodec codec, const int* document_ids, const uint32_t* word_counts,
+                                       const uint32_t* document_lengths, size_t size)
+    : codec_(codec)
+    , size_(size) {
+    uint32_t deltas[POSTING_BLOCK_SIZE];
+    int previous_id = -1;
+    for (size_t first = 0; first < size; first += POSTING_BLOCK_SIZE) {
+        const size_t count = min(POSTING_BLOCK_SIZE, size - first);
+        for (size_t i = 0; i < count; ++i) {
+            deltas[i] = static_cast<uint32_t>(document_ids[first + i] - previous_id - 1);
+            previous_id = document_ids[first + i];
+        }
+        blocks_.push_back({ previous_id, static_cast<uint32_t>(data_.size()) });
+        EncodeStream(deltas, count);
+        EncodeStream(word_counts + first, count);
+        EncodeStream(document_lengths + first, count);
+    }
+    data_.shrink_to_fit();
+    blocks_.shrink_to_fit();
+}
+
+size_t CompressedPostings::size() const {
+    return size_;
+}
+
+size_t CompressedPostings::GetBlockCount() const {
+    return blocks_.size();
+}
+
+int CompressedPostings::GetBlockLastDocumentId(size_t block) const {
+    return blocks_[block].last_document_id;
+}
+
+size_t CompressedPostings::DecodeBlock(size_t block, int* document_ids, double* term_freqs) const {
+    const size_t count = min(POSTING_BLOCK_SIZE, size_ - block * POSTING_BLOCK_SIZE);
+    uint32_t word_counts[POSTING_BLOCK_SIZE];
+    uint32_t document_lengths[POSTING_BLOCK_SIZE];
+    const uint8_t* input = data_.data() + blocks_[block].offset;
+    // The deltas go straight into the ids, which are summed up in place
+    input = DecodeStream(input, reinterpret_cast<uint32_t*>(document_ids), count);
+    input = DecodeStream(input, word_counts, count);
+    DecodeStream(input, document_lengths, count);
+
+    SumDeltas(block == 0 ? -1 : blocks_[block - 1].last_document_id, document_ids, count);
+    // AddDocument sums 1 / length once per word. Doubling is exact, so for one or two words
+    // the product is the same double, which leaves the loop free of branches; more words
+    // are summed as AddDocument does, so decoded values match the unencoded ones bit for bit
+    for (size_t i = 0; i < count; ++i) {
+        term_freqs[i] = 1.0 / static_cast<int>(document_lengths[i]) * static_cast<int>(word_counts[i]);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (word_counts[i] > 2) {
+            const double inv_word_count = 1.0 / document_lengths[i];
+            double term_freq = 0.0;
+            for (uint32_t j = 0; j < word_counts[i]; ++j) {
+                term_freq += inv_word_count;
+            }
+            term_freqs[i] = term_freq;
+        }
+    }
+    return count;
+}
+
+size_t CompressedPostings::GetMemoryUsage() const {
+    return sizeof(*this) + blocks_.capacity() * sizeof(Block) + data_.capacity();
+}
+
+void CompressedPostings::EncodeStream(const uint32_t* values, size_t count) {
+    if (codec_ == PostingCodec::VARINT) {
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t value = values[i];
+            while (value >= 0x80) {
+                data_.push_back(static_cast<uint8_t>(value | 0x80));
+                value >>= 7;
+            }
+            data_.push_back(static_cast<uint8_t>(value));
+        }
+        return;
+    }
+
+    const uint32_t width = BitWidth(*max_element(values, values + count));
+    data_.push_back(static_cast<uint8_t>(width));
+    if (count == POSTING_BLOCK_SIZE) {
+        PackLanes(values, width, data_);
+    } else {
+        PackSequential(values, count, width, data_);
+    }
+}
+
+const uint8_t* CompressedPostings::DecodeStream(const uint8_t* input, uint32_t* values, size_t count) const {
+    if (codec_ == PostingCodec::VARINT) {
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t value = 0;
+            for (uint32_t shift = 0;; shift += 7) {
+                const uint8_t byte = *input++;
+                value |= uint32_t{byte & 0x7Fu} << shift;
+                if (byte < 0x80) {
+                    break;
+                }
+            }
+            values[i] = value;
+        }
+        return input;
+    }
+
+    const uint32_t width = *input++;
+    if (count < POSTING_BLOCK_SIZE) {
+        return UnpackSequential(input, width, values, count);
+    }
+    UNPACK_BY_WIDTH[width](input, values);
+    return input + width * LANE_COUNT * sizeof(uint32_t);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum class PostingCodec {
+    RAW,
+    // Delta-coded ids, word counts and document lengths as LEB128 varints
+    VARINT,
+    // The same three streams bit-packed per block at the width of their largest value;
+    // a full block interleaves them, so SSE2 unpacks four at a time
+    BIT_PACKED,
+};
+
+constexpr size_t POSTING_BLOCK_SIZE = 128;
+
+// Posting list compressed in blocks of POSTING_BLOCK_SIZE postings. A term frequency
+// is stored as the word count and the length of its document, and decoded by the
+// same summation AddDocument uses, so decoded values are bit-identical to the raw
+// ones. Every block keeps its last document id and byte offset, so a seek can skip
+// blocks without decoding them.
+class CompressedPostings {
+public:
+    CompressedPostings(PostingCodec codec, const int* document_ids, const uint32_t* word_counts,
+                       const uint32_t* document_lengths, size_t size);
+
+    size_t size() const;
+    size_t GetBlockCount() const;
+    int GetBlockLastDocumentId(size_t block) const;
+
+    // Fills POSTING_BLOCK_SIZE-long arrays with the block's postings and returns their number
+    size_t DecodeBlock(size_t block, int* document_ids, double* term_freqs) const;
+
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Block {
+        int last_document_id;
+        uint32_t offset;
+    };
+
+    PostingCodec codec_;
+    size_t size_;
+    std::vector<Block> blocks_;
+    std::vector<uint8_t> data_;
+
+    void EncodeStream(const uint32_t* values, size_t count);
+    const uint8_t* DecodeStream(const uint8_t* input, uint32_t* values, size_t count) const;
+};
@@ -1,32 +1,129 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <condition_variable>
 #include <execution>
+#include <map>
+#include <mutex>
+#include "process_queries.h"
 #include "search_server.h"
 #include "document.h"
 #include <iostream>
 
 using namespace std;
 
-std::vector<std::vector<Document>> ProcessQueries(const SearchServer& search_server, const std::vector<std::string> &queries) {
+std::vector<std::vector<Document>> ProcessQueries(const SearchServer& search_server, const std::vector<std::string> &queries,
+                                                  const SearchOptions& options) {
     std::vector<std::vector<Document>> result_vector(queries.size());
-    std::transform(std::execution::par, queries.begin(), 
-                   queries.end(), 
-                   result_vector.begin(), 
-                   [&search_server](const auto &query){return search_server.FindTopDocuments(query);});
+    search_server.GetThreadPool()->ParallelFor(queries.size(), [&](size_t i) {
+        result_vector[i] = search_server.FindTopDocuments(queries[i], options);
+    });
     
     return result_vector;
 }
 
+std::vector<std::vector<Document>> ProcessQueries(const SearchServer& search_server, const std::vector<CompiledQuery>& queries,
+                                                  const SearchOptions& options) {
+    std::vector<std::vector<Document>> result_vector(queries.size());
+    search_server.GetThreadPool()->ParallelFor(queries.size(), [&](size_t i) {
+        result_vector[i] = search_server.FindTopDocuments(queries[i], options);
+    });
+    return result_vector;
+}
+
 
-std::vector<Document> ProcessQueriesJoined(const SearchServer& search_server, const std::vector<std::string> &queries) {
-    auto vec = ProcessQueries(search_server, queries);
+std::vector<Document> ProcessQueriesJoined(const SearchServer& search_server, const std::vector<std::string> &queries,
+                                           const SearchOptions& options) {
+    auto vec = ProcessQueries(search_server, queries, options);
+    size_t total_size = 0;
+    for (const auto &item : vec) {
+        total_size += item.size();
+    }
     std::vector<Document> res_vec;
-    res_vec.reserve(sizeof(vec));
+    res_vec.reserve(total_size);
     for (const auto &item : vec) {
         std::move(item.begin(), item.end(), std::back_inserter(res_vec));
     }
-    //std::cout <<  res_vec.size() << " = size"s << endl;
-    //std::cout <<  res_vec.capacity() << " = capacity"s << endl;
     return res_vec;
-}
\ No newline at end of file
+}
+
+void ProcessQueriesStream(const SearchServer& search_server, const QuerySource& source, const ResultSink& sink,
+                          const StreamOptions& options) {
+    const size_t max_in_flight = max<size_t>(options.max_in_flight, 1);
+
+    mutex input_mutex;
+    condition_variable slot_released;
+    bool source_exhausted = false;
+    size_t next_index = 0;
+    size_t in_flight = 0;
+
+    mutex output_mutex;
+    size_t next_to_emit = 0;
+    // Finished results waiting for an earlier query in ordered mode
+    map<size_t, vector<Document>> reorder_buffer;
+
+    const auto release_slots = [&](size_t count) {
+        {
+            lock_guard lock(input_mutex);
+            in_flight -= count;
+        }
+        slot_released.notify_all();
+    };
+
+    // Every participant of the pool runs this loop until the source is drained
+    const auto run_stream = [&](size_t) {
+        while (true) {
+            size_t index;
+            optional<string> query;
+            {
+                unique_lock lock(input_mutex);
+                slot_released.wait(lock, [&] { return source_exhausted || in_flight < max_in_flight; });
+                if (source_exhausted) {
+                    return;
+                }
+                query = source();
+                if (!query) {
+                    source_exhausted = true;
+                    slot_released.notify_all();
+                    return;
+                }
+                index = next_index++;
+                ++in_flight;
+            }
+
+            vector<Document> result;
+            try {
+                result = search_server.FindTopDocuments(*query, options.search);
+            } catch (...) {
+                // The query's slot is never released and ordered results would wait for it
+                // forever, so the stream stops; ParallelFor rethrows the exception
+                {
+                    lock_guard lock(input_mutex);
+                    source_exhausted = true;
+                }
+                slot_released.notify_all();
+                throw;
+            }
+
+            lock_guard lock(output_mutex);
+            if (!options.ordered) {
+                sink(index, move(result));
+                release_slots(1);
+                continue;
+            }
+            reorder_buffer.emplace(index, move(result));
+            size_t emitted = 0;
+            for (auto it = reorder_buffer.begin(); it != reorder_buffer.end() && it->first == next_to_emit; it = reorder_buffer.erase(it)) {
+                sink(it->first, move(it->second));
+                ++next_to_emit;
+                ++emitted;
+            }
+            if (emitted > 0) {
+                release_slots(emitted);
+            }
+        }
+    };
+
+    const auto thread_pool = search_server.GetThreadPool();
+    thread_pool->ParallelFor(thread_pool->GetThreadCount() + 1, run_stream);
+}
@@ -1,12 +1,51 @@
 #pragma once
 
+#include <functional>
+#include <optional>
 #include <vector>
 #include <string>
 #include "search_server.h"
 #include "document.h"
 
+// Every query is searched with the same options, e.g. SearchOptions::conjunctive for AND queries
 std::vector<std::vector<Document>> ProcessQueries(
     const SearchServer& search_server, 
-    const std::vector<std::string> &queries);
+    const std::vector<std::string> &queries,
+    const SearchOptions& options = {});
 
-std::vector<Document> ProcessQueriesJoined(const SearchServer& search_server, const std::vector<std::string> &queries);
\ No newline at end of file
+std::vector<Document> ProcessQueriesJoined(const SearchServer& search_server, const std::vector<std::string> &queries,
+                                           const SearchOptions& options = {});
+// Queries compiled once (SearchServer::CompileQuery), e.g. to run them with several options
+std::vector<std::vector<Document>> ProcessQueries(const SearchServer& search_server, const std::vector<CompiledQuery>& queries,
+                                                  const SearchOptions& options = {});
+
+struct StreamOptions {
+    // Queries pulled from the source but not yet handed to the sink
+    size_t max_in_flight = 1024;
+    // Deliver results in source order; otherwise as soon as each one is ready
+    bool ordered = true;
+    // Options of every query's FindTopDocuments
+    SearchOptions search;
+};
+
+// Returns std::nullopt when the stream is over
+using QuerySource = std::function<std::optional<std::string>()>;
+// Receives the position of the query in the stream and its result
+using ResultSink = std::function<void(size_t, std::vector<Document>)>;
+
+// Runs queries on the server's thread pool while keeping at most max_in_flight of
+// them in memory, so peak memory does not depend on the stream length.
+// The source and the sink are never called concurrently with themselves
+void ProcessQueriesStream(const SearchServer& search_server, const QuerySource& source, const ResultSink& sink,
+                          const StreamOptions& options = {});
+
+template <typename InputIt>
+void ProcessQueriesStream(const SearchServer& search_server, InputIt first, InputIt last, const ResultSink& sink,
+                          const StreamOptions& options = {}) {
+    ProcessQueriesStream(search_server, [&first, last]() -> std::optional<std::string> {
+        if (first == last) {
+            return std::nullopt;
+        }
+        return std::string(*first++);
+    }, sink, options);
+}
@@ -0,0 +1,68 @@
+#include "query_result_cache.h"
+
+#include <algorithm>
+#include <functional>
+
+using namespace std;
+
+QueryResultCache::QueryResultCache(size_t capacity)
+    : shard_capacity_(max<size_t>(1, (capacity + SHARD_COUNT - 1) / SHARD_COUNT)) {
+}
+
+size_t QueryResultCache::GetCapacity() const {
+    return shard_capacity_ * SHARD_COUNT;
+}
+
+QueryResultCache::Stats QueryResultCache::GetStats() const {
+    Stats stats;
+    stats.hits = hit_stats_.count.load(memory_order_relaxed);
+    stats.misses = miss_stats_.count.load(memory_order_relaxed);
+    if (stats.hits > 0) {
+        stats.mean_hit_latency = chrono::nanoseconds(hit_stats_.total_nanoseconds.load(memory_order_relaxed) / stats.hits);
+    }
+    if (stats.misses > 0) {
+        stats.mean_miss_latency = chrono::nanoseconds(miss_stats_.total_nanoseconds.load(memory_order_relaxed) / stats.misses);
+    }
+    return stats;
+}
+
+QueryResultCache::Shard& QueryResultCache::GetShard(string_view key) {
+    return shards_[hash<string_view>{}(key) % SHARD_COUNT];
+}
+
+bool QueryResultCache::Find(string_view key, uint64_t version, vector<Document>& result) {
+    Shard& shard = GetShard(key);
+    lock_guard lock(shard.mutex);
+    const auto it = shard.index.find(key);
+    if (it == shard.index.end() || it->second->version != version) {
+        return false;
+    }
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    result.assign(it->second->documents.begin(), it->second->documents.end());
+    return true;
+}
+
+void QueryResultCache::Insert(string_view key, uint64_t version, const vector<Document>& documents) {
+    Shard& shard = GetShard(key);
+    lock_guard lock(shard.mutex);
+    if (const auto it = shard.index.find(key); it != shard.index.end()) {
+        // A concurrent miss may have computed a result of a newer version already
+        if (it->second->version < version) {
+            it->second->version = version;
+            it->second->documents = documents;
+        }
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        return;
+    }
+    if (shard.entries.size() >= shard_capacity_) {
+        shard.index.erase(shard.entries.back().key);
+        shard.entries.pop_back();
+    }
+    shard.entries.push_front({ string(key), version, documents });
+    shard.index.emplace(shard.entries.front().key, shard.entries.begin());
+}
+
+void QueryResultCache::Record(LatencyStats& stats, chrono::nanoseconds latency) {
+    stats.count.fetch_add(1, memory_order_relaxed);
+    stats.total_nanoseconds.fetch_add(static_cast<uint64_t>(latency.count()), memory_order_relaxed);
+}
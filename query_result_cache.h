@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "document.h"
+
+// Results of recent queries, each tagged with the corpus version it was computed on;
+// an entry of an older version counts as a miss and is replaced. The cache is split
+// into shards with a lock and an LRU list each, so concurrent queries seldom wait for
+// one another, and a miss is computed without holding any lock
+class QueryResultCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        // Mean duration of a lookup served from the cache and of one that had to run the query
+        std::chrono::nanoseconds mean_hit_latency{ 0 };
+        std::chrono::nanoseconds mean_miss_latency{ 0 };
+
+        double GetHitRate() const {
+            return hits + misses == 0 ? 0.0 : static_cast<double>(hits) / (hits + misses);
+        }
+    };
+
+    explicit QueryResultCache(size_t capacity);
+
+    // Puts into result the cached result for the key if it was computed on this version,
+    // otherwise what search(result) puts there, which is cached. A hit copies into the
+    // buffer of result, so it allocates nothing once that buffer has grown
+    template <typename Search>
+    void GetOrCompute(std::string_view key, uint64_t version, std::vector<Document>& result, Search search) {
+        const auto start = std::chrono::steady_clock::now();
+        if (Find(key, version, result)) {
+            Record(hit_stats_, std::chrono::steady_clock::now() - start);
+            return;
+        }
+        search(result);
+        Insert(key, version, result);
+        Record(miss_stats_, std::chrono::steady_clock::now() - start);
+    }
+
+    size_t GetCapacity() const;
+    Stats GetStats() const;
+
+private:
+    static constexpr size_t SHARD_COUNT = 16;
+
+    struct Entry {
+        std::string key;
+        uint64_t version;
+        std::vector<Document> documents;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        // Most recently used first
+        std::list<Entry> entries;
+        // Keys are views of the entries' own keys
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+    };
+
+    struct LatencyStats {
+        std::atomic<uint64_t> count{ 0 };
+        std::atomic<uint64_t> total_nanoseconds{ 0 };
+    };
+
+    size_t shard_capacity_;
+    std::array<Shard, SHARD_COUNT> shards_;
+    LatencyStats hit_stats_;
+    LatencyStats miss_stats_;
+
+    Shard& GetShard(std::string_view key);
+    // Whether the shard has the key computed on this version, copied into result then
+    bool Find(std::string_view key, uint64_t version, std::vector<Document>& result);
+    void Insert(std::string_view key, uint64_t version, const std::vector<Document>& documents);
+    static void Record(LatencyStats& stats, std::chrono::nanoseconds latency);
+};
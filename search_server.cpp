@@ -1,92 +1,685 @@
 #include "search_server.h"
+#include <charconv>
+#include <fstream>
 #include <numeric>
+#include <unordered_map>
+#include <unordered_set>
+#include "sorted_sets.h"
 
 using namespace std;
 
 void SearchServer::AddDocument(int document_id, const std::string_view document, DocumentStatus status, const std::vector<int>& ratings) {
-	if ((document_id < 0) || (documents_.count(document_id) > 0)) {
+	AddDocumentText(document_id, document, status, ratings, false);
+}
+
+void SearchServer::AddExternalDocument(int document_id, const std::string_view document, DocumentStatus status, const std::vector<int>& ratings) {
+	AddDocumentText(document_id, document, status, ratings, true);
+}
+
+void SearchServer::AddDocuments(const vector<DocumentToAdd>& documents) {
+	unique_lock lock(state_->update_mutex);
+	const auto snapshot = GetSnapshot();
+	set<int> batch_ids;
+	for (const auto& document : documents) {
+		if (document.id < 0 || FindDocument(*snapshot, document.id).segment != nullptr || !batch_ids.insert(document.id).second) {
+			throw invalid_argument("Invalid document_id"s);
+		}
+	}
+	if (documents.empty()) {
+		return;
+	}
+
+	// Every chunk numbers its distinct words itself, so the dictionary is only
+	// consulted once per distinct word of a chunk instead of once per word
+	struct Chunk {
+		vector<string_view> words;
+		vector<TermId> terms;
+		// Local word numbers of every document in the chunk
+		vector<vector<uint32_t>> document_words;
+		bool is_valid = true;
+	};
+	constexpr size_t DOCUMENTS_PER_TASK = 64;
+	vector<Chunk> chunks((documents.size() + DOCUMENTS_PER_TASK - 1) / DOCUMENTS_PER_TASK);
+	const auto thread_pool = GetThreadPool();
+	thread_pool->ParallelFor(chunks.size(), [&](size_t chunk_index) {
+		Chunk& chunk = chunks[chunk_index];
+		unordered_map<string_view, uint32_t> local_ids;
+		vector<string_view> tokens;
+		const size_t first = chunk_index * DOCUMENTS_PER_TASK;
+		const size_t last = min(first + DOCUMENTS_PER_TASK, documents.size());
+		for (size_t i = first; i < last; ++i) {
+			if (!SplitIntoValidWords(documents[i].text, tokens)) {
+				chunk.is_valid = false;
+				return;
+			}
+			auto& document_words = chunk.document_words.emplace_back();
+			document_words.reserve(tokens.size());
+			for (const string_view token : tokens) {
+				const auto [it, inserted] = local_ids.emplace(token, static_cast<uint32_t>(chunk.words.size()));
+				if (inserted) {
+					chunk.words.push_back(token);
+				}
+				document_words.push_back(it->second);
+			}
+		}
+	});
+	if (any_of(chunks.begin(), chunks.end(), [](const Chunk& chunk) { return !chunk.is_valid; })) {
+		throw invalid_argument("Word is invalid"s);
+	}
+
+	{
+		lock_guard terms_lock(state_->terms_mutex);
+		for (Chunk& chunk : chunks) {
+			chunk.terms.reserve(chunk.words.size());
+			for (const string_view word : chunk.words) {
+				chunk.terms.push_back(state_->terms.Intern(word));
+			}
+		}
+	}
+
+	vector<SegmentDocument> segment_documents(documents.size());
+	thread_pool->ParallelFor(chunks.size(), [&](size_t chunk_index) {
+		const Chunk& chunk = chunks[chunk_index];
+		vector<TermId> words;
+		for (size_t j = 0; j < chunk.document_words.size(); ++j) {
+			words.clear();
+			for (const uint32_t local_id : chunk.document_words[j]) {
+				if (const TermId term = chunk.terms[local_id]; !IsStopWord(term)) {
+					words.push_back(term);
+				}
+			}
+			sort(words.begin(), words.end());
+			const DocumentToAdd& document = documents[chunk_index * DOCUMENTS_PER_TASK + j];
+			SegmentDocument& segment_document = segment_documents[chunk_index * DOCUMENTS_PER_TASK + j];
+			segment_document = { document.id, ComputeAverageRating(document.ratings), document.status, document.text, false, {} };
+			for (size_t first = 0, last = 0; first < words.size(); first = last) {
+				while (last < words.size() && words[last] == words[first]) {
+					++last;
+				}
+				segment_document.word_counts.push_back({ state_->terms.GetTerm(words[first]), words[first], static_cast<uint32_t>(last - first) });
+			}
+		}
+	});
+
+	auto segments = snapshot->segments;
+	segments.push_back({ Segment::Build(*thread_pool, segment_documents, PostingCodec::RAW, state_->positional), nullptr });
+	++state_->corpus_version;
+	PublishUpdate(lock, move(segments));
+}
+
+void SearchServer::AddDocumentText(int document_id, const std::string_view document, DocumentStatus status, const std::vector<int>& ratings, bool is_external) {
+	unique_lock lock(state_->update_mutex);
+	const auto snapshot = GetSnapshot();
+	if ((document_id < 0) || FindDocument(*snapshot, document_id).segment != nullptr) {
 		throw std::invalid_argument("Invalid document_id"s);
 	}
-    
-    documents_.emplace(document_id, DocumentData{ ComputeAverageRating(ratings), status, string(move(document))});
-    
-    const auto words = SplitIntoWordsNoStop(documents_.at(document_id).document_text);
-	const double inv_word_count = 1.0 / words.size();
-	
-    for (const auto word : words) {
-		word_to_document_freqs_[word][document_id] += inv_word_count;
-		(docs_term_freqs_[document_id])[word] += 1;
+
+	// The text is parsed before anything is built, so an invalid document leaves the server untouched
+	const SegmentDocument segment_document{ document_id, ComputeAverageRating(ratings), status, document, is_external,
+	                                        CountWordsNoStop(document) };
+	auto segments = snapshot->segments;
+	segments.push_back({ Segment::Build(*GetThreadPool(), { segment_document }, PostingCodec::RAW, state_->positional), nullptr });
+	++state_->corpus_version;
+	PublishUpdate(lock, move(segments));
+}
+
+shared_ptr<const SearchServer::Snapshot> SearchServer::GetSnapshot() const {
+	return atomic_load(&state_->snapshot);
+}
+
+SearchServer::State::~State() {
+	{
+		lock_guard lock(update_mutex);
+		stopping = true;
+	}
+	merge_state_changed.notify_all();
+	if (merge_thread.joinable()) {
+		merge_thread.join();
 	}
-	document_ids_.push_back(document_id);
 }
-// #1
-vector<Document> SearchServer::FindTopDocuments(const string_view raw_query, DocumentStatus status) const {
-	return FindTopDocuments(raw_query, [status](int document_id, DocumentStatus document_status, int rating) {
-			return document_status == status;
+
+void SearchServer::Publish(State& state, vector<PublishedSegment> segments, const vector<int>& removed_ids) {
+	const auto [merge_first, merge_last] = FindMerge(segments);
+	const auto previous = atomic_load(&state.snapshot);
+	auto snapshot = make_shared<Snapshot>();
+	for (const PublishedSegment& segment : segments) {
+		snapshot->document_count += segment.GetLiveDocumentCount();
+	}
+
+	auto recent_locations = make_shared<DocumentLocations>(*previous->recent_locations);
+	const DocumentLocations& locations = *previous->locations;
+	for (const int document_id : removed_ids) {
+		if (locations.count(document_id) > 0) {
+			(*recent_locations)[document_id] = {};
+		} else {
+			recent_locations->erase(document_id);
+		}
+	}
+	// Segments published before keep their locations
+	unordered_map<const Segment*, size_t> previous_segments;
+	for (size_t i = 0; i < previous->segments.size(); ++i) {
+		previous_segments.emplace(previous->segments[i].segment.get(), i);
+	}
+	for (const PublishedSegment& segment : segments) {
+		if (previous_segments.count(segment.segment.get()) > 0) {
+			continue;
+		}
+		const auto& document_ids = segment.segment->GetDocumentIds();
+		for (uint32_t ordinal = 0; ordinal < document_ids.size(); ++ordinal) {
+			if (!segment.IsDeleted(ordinal)) {
+				(*recent_locations)[document_ids[ordinal]] = { segment.segment.get(), ordinal };
+			}
+		}
+	}
+	if (recent_locations->size() * recent_locations->size() > locations.size() && recent_locations->size() > MIN_RECENT_LOCATIONS) {
+		auto folded = make_shared<DocumentLocations>(locations);
+		for (const auto& [document_id, location] : *recent_locations) {
+			if (location.segment == nullptr) {
+				folded->erase(document_id);
+			} else {
+				(*folded)[document_id] = location;
+			}
+		}
+		snapshot->locations = move(folded);
+	} else {
+		snapshot->locations = previous->locations;
+		snapshot->recent_locations = move(recent_locations);
+	}
+	snapshot->segments = move(segments);
+	snapshot->corpus_version = state.corpus_version;
+	atomic_store(&state.snapshot, shared_ptr<const Snapshot>(move(snapshot)));
+
+	if (merge_first != merge_last) {
+		state.merge_requested = true;
+		if (!state.merge_thread.joinable()) {
+			state.merge_thread = thread(RunMerges, ref(state));
+		}
+		state.merge_state_changed.notify_all();
+	}
+}
+
+void SearchServer::PublishUpdate(unique_lock<mutex>& lock, vector<PublishedSegment> segments, const vector<int>& removed_ids) {
+	Publish(*state_, move(segments), removed_ids);
+	// A writer faster than the merges would pile up segments and slow every query down
+	state_->merge_state_changed.wait(lock, [this] {
+		return GetSnapshot()->segments.size() < MAX_SEGMENT_COUNT || (!state_->merge_requested && !state_->merging);
+	});
+}
+
+pair<size_t, size_t> SearchServer::FindMerge(const vector<PublishedSegment>& segments) {
+	// Tiered merging: a segment of tier t holds [MERGE_FACTOR^t, MERGE_FACTOR^(t+1)) documents.
+	// MERGE_FACTOR segments of one group are merged into one of a higher tier, so a document
+	// is rewritten O(log N) times and a query visits O(log N) segments.
+	// Only neighbours are merged, which keeps the documents in the order they were added
+	vector<size_t> tiers;
+	tiers.reserve(segments.size());
+	for (const auto& [segment, _] : segments) {
+		size_t tier = 0;
+		for (size_t count = segment->GetDocumentCount(); count >= MERGE_FACTOR; count /= MERGE_FACTOR) {
+			++tier;
+		}
+		tiers.push_back(tier);
+	}
+	// A group runs from the oldest remaining segment up to the last one of the highest remaining
+	// tier, so small segments stranded between big ones are merged together with them
+	pair<size_t, size_t> merge{ 0, 0 };
+	for (size_t first = 0; first < segments.size();) {
+		const size_t tier = *max_element(tiers.begin() + first, tiers.end());
+		size_t last = first;
+		for (size_t i = first; i < segments.size(); ++i) {
+			if (tiers[i] == tier) {
+				last = i + 1;
+			}
+		}
+		// The newest groups hold the smallest segments, so the last full one is the cheapest to
+		// merge; within it the run with the fewest documents is taken
+		size_t min_document_count = numeric_limits<size_t>::max();
+		for (size_t run = first; run + MERGE_FACTOR <= last; ++run) {
+			size_t document_count = 0;
+			for (size_t i = run; i < run + MERGE_FACTOR; ++i) {
+				document_count += segments[i].segment->GetDocumentCount();
+			}
+			if (document_count < min_document_count) {
+				min_document_count = document_count;
+				merge = { run, run + MERGE_FACTOR };
+			}
+		}
+		first = last;
+	}
+	if (merge.first != merge.second) {
+		return merge;
+	}
+
+	// With nothing to merge, a segment where deleted documents take too much room is purged alone
+	for (size_t i = 0; i < segments.size(); ++i) {
+		const auto& [segment, deleted] = segments[i];
+		if (deleted != nullptr && deleted->GetCount() >= MAX_DELETED_SHARE * segment->GetDocumentCount()) {
+			return { i, i + 1 };
+		}
+	}
+	return { 0, 0 };
+}
+
+void SearchServer::RunMerges(State& state) {
+	unique_lock lock(state.update_mutex);
+	while (true) {
+		state.merge_state_changed.wait(lock, [&state] { return state.stopping || state.merge_requested; });
+		if (state.stopping) {
+			return;
+		}
+		state.merge_requested = false;
+		const auto segments = atomic_load(&state.snapshot)->segments;
+		const auto [first, last] = FindMerge(segments);
+		if (first == last) {
+			state.merge_state_changed.notify_all();
+			continue;
+		}
+
+		// Queries and updates go on while the merge runs. Documents deleted by then are left out
+		const vector<PublishedSegment> inputs(segments.begin() + first, segments.begin() + last);
+		vector<shared_ptr<const Segment>> input_segments;
+		vector<const DeletedDocuments*> input_deleted;
+		for (const auto& [segment, deleted] : inputs) {
+			input_segments.push_back(segment);
+			input_deleted.push_back(deleted.get());
+		}
+		const auto thread_pool = atomic_load(&state.thread_pool);
+		const PostingCodec codec = state.codec;
+		const bool impact_ordered = state.impact_ordered;
+		const bool positional = state.positional;
+		state.merging = true;
+		lock.unlock();
+		PublishedSegment merged{ Segment::Merge(*thread_pool, input_segments, input_deleted, codec, impact_ordered, positional), nullptr };
+		lock.lock();
+		state.merging = false;
+		if (state.stopping) {
+			return;
+		}
+
+		// Updates may have replaced some of the inputs meanwhile; the merge is then redone
+		auto current = atomic_load(&state.snapshot)->segments;
+		const auto it = search(current.begin(), current.end(), inputs.begin(), inputs.end(), [](const PublishedSegment& lhs, const PublishedSegment& rhs) {
+			return lhs.segment == rhs.segment;
 		});
+		if (it == current.end()) {
+			state.merge_requested = true;
+			continue;
+		}
+		// Documents deleted from the inputs during the merge stay deleted in the merged segment,
+		// where the documents the merge kept follow each other in order
+		shared_ptr<DeletedDocuments> merged_deleted;
+		uint32_t merged_ordinal = 0;
+		for (size_t i = 0; i < inputs.size(); ++i) {
+			const PublishedSegment& input = inputs[i];
+			const auto& deleted = it[i].deleted;
+			if (deleted == input.deleted) {
+				merged_ordinal += input.GetLiveDocumentCount();
+				continue;
+			}
+			for (uint32_t ordinal = 0; ordinal < input.segment->GetDocumentCount(); ++ordinal) {
+				if (input.IsDeleted(ordinal)) {
+					continue;
+				}
+				if (deleted->IsDeleted(ordinal)) {
+					if (merged_deleted == nullptr) {
+						merged_deleted = make_shared<DeletedDocuments>(*merged.segment);
+					}
+					merged_deleted->Delete(*merged.segment, merged_ordinal);
+				}
+				++merged_ordinal;
+			}
+		}
+		merged.deleted = move(merged_deleted);
+		if (merged.GetLiveDocumentCount() == 0) {
+			current.erase(it, it + inputs.size());
+		} else {
+			*it = move(merged);
+			current.erase(it + 1, it + inputs.size());
+		}
+		Publish(state, move(current));
+		state.merge_state_changed.notify_all();
+	}
+}
+
+SearchServer::DocumentLocation SearchServer::FindDocument(const Snapshot& snapshot, int document_id) {
+	if (const auto it = snapshot.recent_locations->find(document_id); it != snapshot.recent_locations->end()) {
+		return it->second;
+	}
+	if (const auto it = snapshot.locations->find(document_id); it != snapshot.locations->end()) {
+		return it->second;
+	}
+	return {};
+}
+
+shared_ptr<const Segment> SearchServer::Purge(State& state, const PublishedSegment& segment) {
+	return Segment::Merge(*atomic_load(&state.thread_pool), { segment.segment }, { segment.deleted.get() }, state.codec, state.impact_ordered,
+	                      state.positional);
+}
+
+// #1
+vector<Document> SearchServer::FindTopDocuments(const string_view raw_query, DocumentStatus status, const SearchOptions& options) const {
+	vector<Document> result;
+	FindTopDocuments(raw_query, status, options, result);
+	return result;
+}
+
+void SearchServer::FindTopDocuments(const string_view raw_query, DocumentStatus status, const SearchOptions& options, vector<Document>& result) const {
+	FindTopDocumentsFiltered(raw_query, StatusFilter{ status }, options, result);
 }
 
 // #2
-std::vector<Document> SearchServer::FindTopDocuments(const std::execution::sequenced_policy&, const std::string_view raw_query, DocumentStatus status) const {
-    return FindTopDocuments(raw_query, [status](int document_id, DocumentStatus document_status, int rating) {
-			return document_status == status;
-		});
-    
+vector<Document> SearchServer::FindTopDocuments(const execution::sequenced_policy&, const string_view raw_query, DocumentStatus status, const SearchOptions& options) const {
+	vector<Document> result;
+	FindTopDocuments(execution::seq, raw_query, status, options, result);
+	return result;
+}
+
+void SearchServer::FindTopDocuments(const execution::sequenced_policy&, const string_view raw_query, DocumentStatus status, const SearchOptions& options, vector<Document>& result) const {
+	FindTopDocumentsFiltered(raw_query, StatusFilter{ status }, options, result);
 }
 
 // #3
-std::vector<Document> SearchServer::FindTopDocuments(const std::execution::parallel_policy&, const std::string_view raw_query, DocumentStatus status) const noexcept {
-    return FindTopDocuments(execution::par, raw_query, [status](int document_id, DocumentStatus document_status, int rating) {
-			return document_status == status;
-		});
-} 
+vector<Document> SearchServer::FindTopDocuments(const execution::parallel_policy&, const string_view raw_query, DocumentStatus status, const SearchOptions& options) const {
+	vector<Document> result;
+	FindTopDocuments(execution::par, raw_query, status, options, result);
+	return result;
+}
+
+void SearchServer::FindTopDocuments(const execution::parallel_policy&, const string_view raw_query, DocumentStatus status, const SearchOptions& options, vector<Document>& result) const {
+	FindTopDocumentsFiltered(execution::par, raw_query, StatusFilter{ status }, options, result);
+}
+
+vector<Document> SearchServer::FindTopDocuments(const PartitionedExecution& execution, const string_view raw_query, DocumentStatus status, const SearchOptions& options) const {
+	vector<Document> result;
+	FindTopDocuments(execution, raw_query, status, options, result);
+	return result;
+}
+
+void SearchServer::FindTopDocuments(const PartitionedExecution& execution, const string_view raw_query, DocumentStatus status, const SearchOptions& options, vector<Document>& result) const {
+	FindTopDocumentsFiltered(execution, raw_query, StatusFilter{ status }, options, result);
+}
 
 // #4
-vector<Document> SearchServer::FindTopDocuments(const string_view raw_query) const {
-	return FindTopDocuments(raw_query, DocumentStatus::ACTUAL);
+vector<Document> SearchServer::FindTopDocuments(const string_view raw_query, const SearchOptions& options) const {
+	return FindTopDocuments(raw_query, DocumentStatus::ACTUAL, options);
 }
 
 // #5
-std::vector<Document> SearchServer::FindTopDocuments(const std::execution::sequenced_policy&, const std::string_view raw_query) const {
-    return FindTopDocuments(raw_query, DocumentStatus::ACTUAL);
+std::vector<Document> SearchServer::FindTopDocuments(const std::execution::sequenced_policy&, const std::string_view raw_query, const SearchOptions& options) const {
+    return FindTopDocuments(raw_query, DocumentStatus::ACTUAL, options);
 }
 
 
 // #6
-std::vector<Document> SearchServer::FindTopDocuments(const std::execution::parallel_policy&, const std::string_view raw_query) const noexcept{
-    return FindTopDocuments(execution::par, raw_query, DocumentStatus::ACTUAL);
+std::vector<Document> SearchServer::FindTopDocuments(const std::execution::parallel_policy&, const std::string_view raw_query, const SearchOptions& options) const {
+    return FindTopDocuments(execution::par, raw_query, DocumentStatus::ACTUAL, options);
+}
+
+std::vector<Document> SearchServer::FindTopDocuments(const PartitionedExecution& execution, const std::string_view raw_query, const SearchOptions& options) const {
+    return FindTopDocuments(execution, raw_query, DocumentStatus::ACTUAL, options);
+}
+
+SearchServer::CompiledQuery SearchServer::CompileQuery(const string_view raw_query) const {
+	CompiledQuery query;
+	CompileQuery(raw_query, query);
+	return query;
+}
+
+void SearchServer::CompileQuery(const string_view raw_query, CompiledQuery& query) const {
+	query.text_.assign(raw_query.begin(), raw_query.end());
+	query.snapshot_ = GetSnapshot();
+	ParseQuery(true, string_view(query.text_.data(), query.text_.size()), query.query_);
+	ResolveQuery(*query.snapshot_, query.query_, query.segment_queries_);
+}
+
+const SearchServer::Query& SearchServer::GetCurrentQuery(const CompiledQuery& query, const Snapshot& snapshot, Query& scratch) const {
+	if (!query.query_.has_unknown_words || (query.snapshot_ != nullptr && query.snapshot_->corpus_version == snapshot.corpus_version)) {
+		return query.query_;
+	}
+	ParseQuery(true, string_view(query.text_.data(), query.text_.size()), scratch);
+	return scratch;
+}
+
+vector<Document> SearchServer::FindTopDocuments(const CompiledQuery& query, DocumentStatus status, const SearchOptions& options) const {
+	vector<Document> result;
+	FindTopDocuments(query, status, options, result);
+	return result;
+}
+
+void SearchServer::FindTopDocuments(const CompiledQuery& query, DocumentStatus status, const SearchOptions& options, vector<Document>& result) const {
+	FindTopDocumentsFiltered(query, StatusFilter{ status }, options, result);
+}
+
+vector<Document> SearchServer::FindTopDocuments(const execution::sequenced_policy&, const CompiledQuery& query, DocumentStatus status, const SearchOptions& options) const {
+	vector<Document> result;
+	FindTopDocuments(execution::seq, query, status, options, result);
+	return result;
+}
+
+void SearchServer::FindTopDocuments(const execution::sequenced_policy&, const CompiledQuery& query, DocumentStatus status, const SearchOptions& options, vector<Document>& result) const {
+	FindTopDocumentsFiltered(query, StatusFilter{ status }, options, result);
+}
+
+vector<Document> SearchServer::FindTopDocuments(const execution::parallel_policy&, const CompiledQuery& query, DocumentStatus status, const SearchOptions& options) const {
+	vector<Document> result;
+	FindTopDocuments(execution::par, query, status, options, result);
+	return result;
+}
+
+void SearchServer::FindTopDocuments(const execution::parallel_policy&, const CompiledQuery& query, DocumentStatus status, const SearchOptions& options, vector<Document>& result) const {
+	FindTopDocumentsFiltered(execution::par, query, StatusFilter{ status }, options, result);
+}
+
+vector<Document> SearchServer::FindTopDocuments(const PartitionedExecution& execution, const CompiledQuery& query, DocumentStatus status, const SearchOptions& options) const {
+	vector<Document> result;
+	FindTopDocuments(execution, query, status, options, result);
+	return result;
+}
+
+void SearchServer::FindTopDocuments(const PartitionedExecution& execution, const CompiledQuery& query, DocumentStatus status, const SearchOptions& options, vector<Document>& result) const {
+	FindTopDocumentsFiltered(execution, query, StatusFilter{ status }, options, result);
+}
+
+vector<Document> SearchServer::FindTopDocuments(const CompiledQuery& query, const SearchOptions& options) const {
+	return FindTopDocuments(query, DocumentStatus::ACTUAL, options);
+}
+
+vector<Document> SearchServer::FindTopDocuments(const execution::sequenced_policy&, const CompiledQuery& query, const SearchOptions& options) const {
+	return FindTopDocuments(query, DocumentStatus::ACTUAL, options);
+}
+
+vector<Document> SearchServer::FindTopDocuments(const execution::parallel_policy&, const CompiledQuery& query, const SearchOptions& options) const {
+	return FindTopDocuments(execution::par, query, DocumentStatus::ACTUAL, options);
+}
+
+vector<Document> SearchServer::FindTopDocuments(const PartitionedExecution& execution, const CompiledQuery& query, const SearchOptions& options) const {
+	return FindTopDocuments(execution, query, DocumentStatus::ACTUAL, options);
 }
 
+void SearchServer::SetThreadPool(std::shared_ptr<ThreadPool> thread_pool) {
+	atomic_store(&state_->thread_pool, move(thread_pool));
+}
+
+shared_ptr<ThreadPool> SearchServer::GetThreadPool() const {
+	return atomic_load(&state_->thread_pool);
+}
+
+
 int SearchServer::GetDocumentCount() const {
-	return documents_.size();
+	return GetSnapshot()->document_count;
 }
 
 int SearchServer::GetDocumentId(int index) const {
-	return document_ids_.at(index);
+	const auto snapshot = GetSnapshot();
+	if (index >= 0) {
+		size_t position = index;
+		for (const auto& [segment, deleted] : snapshot->segments) {
+			const size_t live_count = segment->GetDocumentCount() - (deleted != nullptr ? deleted->GetCount() : 0);
+			if (position >= live_count) {
+				position -= live_count;
+				continue;
+			}
+			const auto& document_ids = segment->GetDocumentIds();
+			if (deleted == nullptr) {
+				return document_ids[position];
+			}
+			for (uint32_t i = 0;; ++i) {
+				if (!deleted->IsDeleted(i) && position-- == 0) {
+					return document_ids[i];
+				}
+			}
+		}
+	}
+	throw out_of_range("Invalid document index"s);
+}
+
+void SearchServer::CompressIndex(PostingCodec codec) {
+	unique_lock lock(state_->update_mutex);
+	state_->codec = codec;
+	const auto snapshot = GetSnapshot();
+	vector<PublishedSegment> segments;
+	for (const auto& [segment, deleted] : snapshot->segments) {
+		// Compression keeps the documents where they are, so the tombstones still apply
+		segments.push_back({ segment->Compress(codec), deleted });
+	}
+	PublishUpdate(lock, move(segments));
+}
+
+void SearchServer::SetImpactOrdering(bool impact_ordered) {
+	unique_lock lock(state_->update_mutex);
+	state_->impact_ordered = impact_ordered;
+	const auto snapshot = GetSnapshot();
+	vector<PublishedSegment> segments;
+	for (const auto& [segment, deleted] : snapshot->segments) {
+		segments.push_back({ segment->SetImpactOrdered(impact_ordered), deleted });
+	}
+	// Impact ordered queries are approximate, their cached results may not hold any more
+	++state_->corpus_version;
+	PublishUpdate(lock, move(segments));
+}
+
+void SearchServer::SetPositionalIndex(bool positional) {
+	unique_lock lock(state_->update_mutex);
+	state_->positional = positional;
+	const auto snapshot = GetSnapshot();
+	const auto thread_pool = GetThreadPool();
+	vector<PublishedSegment> segments;
+	for (const auto& [segment, deleted] : snapshot->segments) {
+		segments.push_back({ segment->SetPositional(*thread_pool, positional), deleted });
+	}
+	// Phrase queries cached before may now have to throw, or no longer
+	++state_->corpus_version;
+	PublishUpdate(lock, move(segments));
+}
+
+size_t SearchServer::GetPositionalIndexMemoryUsage() const {
+	const auto snapshot = GetSnapshot();
+	size_t memory_usage = 0;
+	for (const auto& [segment, _] : snapshot->segments) {
+		if (const PositionIndex* positions = segment->GetPositions()) {
+			memory_usage += positions->GetMemoryUsage();
+		}
+	}
+	return memory_usage;
 }
 
-bool SearchServer::IsStopWord(const string_view word) const {
-	return stop_words_.count(word) > 0;
+void SearchServer::SetResultCacheCapacity(size_t capacity) {
+	atomic_store(&result_cache_, capacity > 0 ? make_shared<QueryResultCache>(capacity) : nullptr);
+}
+
+QueryResultCache::Stats SearchServer::GetResultCacheStats() const {
+	const auto result_cache = atomic_load(&result_cache_);
+	return result_cache != nullptr ? result_cache->GetStats() : QueryResultCache::Stats{};
+}
+
+void SearchServer::AppendCacheKeyNumber(uint64_t value, string& key) {
+	// to_chars writes into the stack, so a key buffer that has grown takes it without allocating
+	char digits[20];
+	key.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr);
+}
+
+void SearchServer::AppendResultCacheKey(const Query& query, const SearchOptions& options, string& key) {
+	// Words are keyed by their ids, which stay the same for the life of the server
+	key.push_back('\x01');
+	for (const TermId term : query.plus_terms) {
+		AppendCacheKeyNumber(term, key);
+		key.push_back(' ');
+	}
+	key.push_back('\x01');
+	for (const TermId term : query.minus_terms) {
+		AppendCacheKeyNumber(term, key);
+		key.push_back(' ');
+	}
+	key.push_back('\x01');
+	for (const Phrase& phrase : query.phrases) {
+		for (size_t i = 0; i < phrase.terms.size(); ++i) {
+			AppendCacheKeyNumber(phrase.offsets[i], key);
+			key.push_back(':');
+			AppendCacheKeyNumber(phrase.terms[i], key);
+			key.push_back(' ');
+		}
+		key.push_back('~');
+		AppendCacheKeyNumber(phrase.slop, key);
+		key.push_back('\x01');
+	}
+	key.push_back('\x01');
+	AppendCacheKeyNumber(options.max_result_count, key);
+	key += options.impact_ordered ? " i" : "";
+	key += options.conjunctive ? " c" : "";
+}
+
+size_t SearchServer::GetIndexMemoryUsage() const {
+	// The snapshot has to outlive the loop, it is what keeps the segments alive
+	const auto snapshot = GetSnapshot();
+	size_t memory_usage = 0;
+	for (const auto& [segment, _] : snapshot->segments) {
+		memory_usage += segment->GetMemoryUsage();
+	}
+	// A hash node holds the pair and a next pointer
+	for (const DocumentLocations* locations : { snapshot->locations.get(), snapshot->recent_locations.get() }) {
+		memory_usage += locations->bucket_count() * sizeof(void*)
+			+ locations->size() * (sizeof(DocumentLocations::value_type) + sizeof(void*));
+	}
+	lock_guard lock(state_->update_mutex);
+	return memory_usage + state_->terms.GetMemoryUsage();
+}
+
+void SearchServer::WaitForMerges() const {
+	unique_lock lock(state_->update_mutex);
+	state_->merge_state_changed.wait(lock, [this] { return !state_->merge_requested && !state_->merging; });
+}
+
+bool SearchServer::IsStopWord(TermId term) const {
+	return term < stop_word_count_;
 }
 
 bool SearchServer::IsValidWord(const string_view word) {
 	// A valid word must not contain special characters
-	return none_of(word.begin(), word.end(), [](char c) {
-		return c >= '\0' && c < ' ';
-		});
+	return !HasControlCharacters(word);
 }
 
-vector<string_view> SearchServer::SplitIntoWordsNoStop(const string_view text) const {
-	vector<string_view> words;
-	for (const auto word : SplitIntoWordsView(text)) {
-		if (!IsValidWord(word)) {
-			throw invalid_argument("Word is invalid"s);
-		}
-		if (!IsStopWord(word)) {
-			words.push_back(word);
+vector<WordCount> SearchServer::CountWordsNoStop(const string_view text) {
+	// Reused between calls, so splitting a document does not allocate
+	thread_local vector<string_view> tokens;
+	if (!SplitIntoValidWords(text, tokens)) {
+		throw invalid_argument("Word is invalid"s);
+	}
+	map<TermId, uint32_t> counts;
+	{
+		lock_guard terms_lock(state_->terms_mutex);
+		for (const auto word : tokens) {
+			const TermId term = state_->terms.Intern(word);
+			if (!IsStopWord(term)) {
+				++counts[term];
+			}
 		}
 	}
-	return words;
+	vector<WordCount> word_counts;
+	word_counts.reserve(counts.size());
+	for (const auto [term, count] : counts) {
+		word_counts.push_back({ state_->terms.GetTerm(term), term, count });
+	}
+	return word_counts;
 }
 
 int SearchServer::ComputeAverageRating(const vector<int>& ratings) {
@@ -97,65 +690,215 @@ int SearchServer::ComputeAverageRating(const vector<int>& ratings) {
 	return rating_sum / static_cast<int>(ratings.size());
 }
 
-double SearchServer::ComputeWordInverseDocumentFreq(const string_view word) const {
-	return log(GetDocumentCount() * 1.0 / word_to_document_freqs_.at(word).size());
+SearchServer::DocumentIdIterator SearchServer::begin() const {
+	return DocumentIdIterator(GetSnapshot());
+}
+SearchServer::DocumentIdIterator SearchServer::end() const {
+	return DocumentIdIterator();
 }
 
-vector<int>::const_iterator SearchServer::begin() const {
-	return document_ids_.begin();
+SearchServer::DocumentIdIterator::DocumentIdIterator(shared_ptr<const Snapshot> snapshot)
+	: snapshot_(move(snapshot)) {
+	SkipDeleted();
 }
-vector<int>::const_iterator SearchServer::end() const {
-	return document_ids_.end();
+
+SearchServer::DocumentIdIterator& SearchServer::DocumentIdIterator::operator++() {
+	++position_;
+	SkipDeleted();
+	return *this;
+}
+
+SearchServer::DocumentIdIterator SearchServer::DocumentIdIterator::operator++(int) {
+	DocumentIdIterator previous = *this;
+	++*this;
+	return previous;
+}
+
+bool SearchServer::DocumentIdIterator::operator==(const DocumentIdIterator& other) const {
+	if (AtEnd() || other.AtEnd()) {
+		return AtEnd() == other.AtEnd();
+	}
+	return snapshot_ == other.snapshot_ && segment_index_ == other.segment_index_ && position_ == other.position_;
 }
 
-const map<string_view, double>& SearchServer::GetWordFrequencies(int document_id) const {
-	if (docs_term_freqs_.count(document_id)) {
-		return docs_term_freqs_.at(document_id);
+bool SearchServer::DocumentIdIterator::AtEnd() const {
+	return snapshot_ == nullptr || segment_index_ == snapshot_->segments.size();
+}
+
+void SearchServer::DocumentIdIterator::SkipDeleted() {
+	while (!AtEnd()) {
+		const auto& [segment, deleted] = snapshot_->segments[segment_index_];
+		if (position_ == segment->GetDocumentCount()) {
+			++segment_index_;
+			position_ = 0;
+		} else if (deleted != nullptr && deleted->IsDeleted(position_)) {
+			++position_;
+		} else {
+			break;
+		}
 	}
-	else {
-		return empty_map_;
+}
+
+map<string_view, double> SearchServer::GetWordFrequencies(int document_id) const {
+	map<string_view, double> word_freqs;
+	const auto snapshot = GetSnapshot();
+	if (const auto [segment, ordinal] = FindDocument(*snapshot, document_id); segment != nullptr) {
+		for (const auto [term, count] : segment->GetTermCounts(ordinal)) {
+			word_freqs.emplace(segment->GetTerm(term), count);
+		}
 	}
+	return word_freqs;
 }
 
 void SearchServer::RemoveDocument(int document_id) {
-	if (documents_.count(document_id)) {
-           const auto cnt_to_erase = docs_term_freqs_.at(document_id).size();
-            std::vector<std::string_view> words_to_erase(cnt_to_erase);
-        transform(std::execution::seq,
-                  docs_term_freqs_.at(document_id).begin(), docs_term_freqs_.at(document_id).end(),
-                  words_to_erase.begin(),
-                  [](const auto& item) { return item.first; }
-        );
-        for_each(std::execution::seq,
-                 words_to_erase.begin(), words_to_erase.end(),
-                 [this, document_id](const auto &word) {word_to_document_freqs_.at(word).erase(document_id);});
-        }
-		documents_.erase(document_id);
-		document_ids_.erase(find(document_ids_.begin(), document_ids_.end(), document_id));
-		docs_term_freqs_.erase(document_id);
-
-	}
-       void SearchServer::RemoveDocument(const execution::parallel_policy&, int document_id) {
-           	if (documents_.count(document_id)) { 
-           const auto cnt_to_erase = docs_term_freqs_.at(document_id).size();
-            std::vector<std::string_view> words_to_erase(cnt_to_erase);
-        transform(std::execution::par,
-                  docs_term_freqs_.at(document_id).begin(), docs_term_freqs_.at(document_id).end(),
-                  words_to_erase.begin(),
-                  [](const auto& item) { return item.first; }
-        );
-        for_each(std::execution::par,
-                 words_to_erase.begin(), words_to_erase.end(),
-                 [this, document_id](const auto &word) {word_to_document_freqs_.at(word).erase(document_id);});
-        }
-		documents_.erase(document_id);
-		document_ids_.erase(find(document_ids_.begin(), document_ids_.end(), document_id));
-		docs_term_freqs_.erase(document_id);
-       }
-    
-    
+	RemoveDocument(execution::seq, document_id);
+}
+
+void SearchServer::RemoveDocument(const execution::parallel_policy&, int document_id) {
+	// Marking a document deleted is too little work to split
+	RemoveDocument(execution::seq, document_id);
+}
+
 void SearchServer::RemoveDocument(const execution::sequenced_policy&, int document_id) {
-    RemoveDocument(document_id);
+	RemoveDocuments({ document_id });
+}
+
+void SearchServer::RemoveDocuments(const vector<int>& document_ids) {
+	unique_lock lock(state_->update_mutex);
+	const auto snapshot = GetSnapshot();
+	auto segments = snapshot->segments;
+	unordered_map<const Segment*, size_t> segment_indexes;
+	for (size_t i = 0; i < segments.size(); ++i) {
+		segment_indexes.emplace(segments[i].segment.get(), i);
+	}
+	// Queries may be reading the published tombstones, so every segment the batch touches
+	// gets a single new copy of them
+	vector<shared_ptr<DeletedDocuments>> new_deleted(segments.size());
+	vector<int> removed_ids;
+	for (const int document_id : document_ids) {
+		const auto [segment, ordinal] = FindDocument(*snapshot, document_id);
+		if (segment == nullptr) {
+			continue;
+		}
+		const size_t i = segment_indexes.at(segment);
+		if (new_deleted[i] == nullptr) {
+			new_deleted[i] = segments[i].deleted != nullptr ? make_shared<DeletedDocuments>(*segments[i].deleted)
+			                                                : make_shared<DeletedDocuments>(*segment);
+			segments[i].deleted = new_deleted[i];
+		}
+		// An id given twice is only removed once
+		if (new_deleted[i]->Delete(*segment, ordinal)) {
+			removed_ids.push_back(document_id);
+		}
+	}
+	if (removed_ids.empty()) {
+		return;
+	}
+	++state_->corpus_version;
+	segments.erase(remove_if(segments.begin(), segments.end(), [](const PublishedSegment& segment) {
+		return segment.GetLiveDocumentCount() == 0;
+	}), segments.end());
+	PublishUpdate(lock, move(segments), removed_ids);
+}
+
+void SearchServer::PurgeDeletedDocuments() {
+	unique_lock lock(state_->update_mutex);
+	auto segments = GetSnapshot()->segments;
+	bool is_purged = false;
+	for (PublishedSegment& segment : segments) {
+		if (segment.deleted != nullptr) {
+			segment = { Purge(*state_, segment), nullptr };
+			is_purged = true;
+		}
+	}
+	if (is_purged) {
+		PublishUpdate(lock, move(segments));
+	}
+}
+
+
+void SearchServer::SaveIndex(const string& path) const {
+	const auto snapshot = GetSnapshot();
+	ofstream output(path, ios::binary | ios::trunc);
+	if (!output) {
+		throw runtime_error("Cannot create index file "s + path);
+	}
+	IndexWriter writer(output);
+	writer.WriteArray(INDEX_FILE_MAGIC, sizeof(INDEX_FILE_MAGIC));
+	writer.Write(INDEX_FILE_VERSION);
+	stop_words_.Save(writer);
+	{
+		// The terms only grow, so they have every word of the snapshot
+		shared_lock terms_lock(state_->terms_mutex);
+		state_->terms.Save(writer);
+	}
+	writer.Write<uint64_t>(snapshot->segments.size());
+	for (const PublishedSegment& segment : snapshot->segments) {
+		// The format has no tombstones, deleted documents are left out instead
+		if (segment.deleted != nullptr) {
+			Purge(*state_, segment)->Save(writer);
+		} else {
+			segment.segment->Save(writer);
+		}
+	}
+
+	if (!output.flush()) {
+		throw runtime_error("Cannot write index file "s + path);
+	}
+}
+
+SearchServer SearchServer::OpenIndex(const string& path) {
+	auto mapped_file = make_shared<const MappedFile>(path);
+	IndexReader reader(mapped_file->data(), mapped_file->size());
+	if (char_traits<char>::compare(reader.ReadArray<char>(sizeof(INDEX_FILE_MAGIC)), INDEX_FILE_MAGIC, sizeof(INDEX_FILE_MAGIC)) != 0) {
+		throw invalid_argument("Not an index file: "s + path);
+	}
+	if (reader.Read<uint32_t>() != INDEX_FILE_VERSION) {
+		throw invalid_argument("Unsupported index file version: "s + path);
+	}
+
+	SearchServer search_server{ string_view{} };
+	search_server.stop_words_.Load(reader);
+	TermDictionary& terms = search_server.state_->terms;
+	terms.Load(reader);
+	// Stop words are interned first, see State::terms
+	for (TermId term = 0; term < search_server.stop_words_.size(); ++term) {
+		if (term >= terms.size() || terms.GetTerm(term) != search_server.stop_words_.GetTerm(term)) {
+			throw invalid_argument("Index file has a broken term table"s);
+		}
+	}
+	search_server.stop_word_count_ = search_server.stop_words_.size();
+
+	const auto segment_count = reader.Read<uint64_t>();
+	vector<PublishedSegment> segments;
+	unordered_set<int> document_ids;
+	for (uint64_t i = 0; i < segment_count; ++i) {
+		auto segment = Segment::Load(reader);
+		if (segment->GetDocumentCount() == 0) {
+			throw invalid_argument("Index file has an empty segment"s);
+		}
+		// Global ids ascend, so the last one is the largest
+		if (segment->GetTermCount() > 0 && segment->GetGlobalTerm(static_cast<TermId>(segment->GetTermCount() - 1)) >= terms.size()) {
+			throw invalid_argument("Index file has a broken term table"s);
+		}
+		for (const int document_id : segment->GetDocumentIds()) {
+			if (!document_ids.insert(document_id).second) {
+				throw invalid_argument("Index file has a duplicate document"s);
+			}
+		}
+		segments.push_back({ move(segment), nullptr });
+	}
+
+	search_server.state_->mapped_file = move(mapped_file);
+	// Segments of a file saved without positions cannot get them
+	search_server.state_->positional = !segments.empty() && all_of(segments.begin(), segments.end(), [](const PublishedSegment& segment) {
+		return segment.segment->GetPositions() != nullptr;
+	});
+	{
+		lock_guard lock(search_server.state_->update_mutex);
+		Publish(*search_server.state_, move(segments));
+	}
+	return search_server;
 }
 
 
@@ -171,50 +914,420 @@ SearchServer::QueryWord SearchServer::ParseQueryWord(const string_view text) con
 		is_minus = true;
 		word = word.substr(1);
 	}
-	if (word.empty() || word[0] == '-' || !IsValidWord(word)) {
+	// Control characters were already rejected by ParseQuery
+	if (word.empty() || word[0] == '-') {
 		throw invalid_argument("Query word is invalid");
 	}
 
-	return { word, is_minus, IsStopWord(word) };
+	const TermId term = state_->terms.Find(word);
+	return { term, is_minus, IsStopWord(term) };
 }
 
 
 SearchServer::Query SearchServer::ParseQuery(bool flag, const string_view text) const {
 	Query result;
-	for (const auto word : SplitIntoWordsView(text)) {
-		const auto query_word = ParseQueryWord(word);
-		if (!query_word.is_stop) {
+	ParseQuery(flag, text, result);
+	return result;
+}
+
+void SearchServer::ParseQuery(bool flag, const string_view text, Query& result) const {
+	thread_local vector<string_view> tokens;
+	if (!SplitIntoValidWords(text, tokens)) {
+		throw invalid_argument("Query word is invalid");
+	}
+	// Phrases of earlier queries keep their buffers here, for the phrases of the next ones
+	thread_local vector<Phrase> spare_phrases;
+	result.plus_terms.clear();
+	result.minus_terms.clear();
+	for (; !result.phrases.empty(); result.phrases.pop_back()) {
+		spare_phrases.push_back(move(result.phrases.back()));
+	}
+	result.has_unknown_words = false;
+	// Every word is looked up once, here; segments only ever see the ids
+	shared_lock terms_lock(state_->terms_mutex);
+	// The phrase being read is the last one of the result; its length counts the stop words as well
+	Phrase* phrase = nullptr;
+	uint32_t phrase_length = 0;
+	for (auto token : tokens) {
+		if (phrase == nullptr) {
+			if (token[0] == '"') {
+				if (spare_phrases.empty()) {
+					result.phrases.emplace_back();
+				} else {
+					result.phrases.push_back(move(spare_phrases.back()));
+					spare_phrases.pop_back();
+				}
+				phrase = &result.phrases.back();
+				phrase->terms.clear();
+				phrase->offsets.clear();
+				phrase->slop = 0;
+				phrase_length = 0;
+				token.remove_prefix(1);
+			} else if (token.size() > 1 && token[0] == '-' && token[1] == '"') {
+				throw invalid_argument("Minus phrases are not supported"s);
+			} else {
+				const auto query_word = ParseQueryWord(token);
+				result.has_unknown_words |= query_word.term == TermDictionary::NO_TERM;
+				if (!query_word.is_stop) {
+					if (query_word.is_minus) {
+						result.minus_terms.push_back(query_word.term);
+					}
+					else {
+						result.plus_terms.push_back(query_word.term);
+					}
+				}
+				continue;
+			}
+		}
+
+		// A quote closes the phrase, optionally followed by ~slop
+		const size_t quote = token.find('"');
+		if (quote != string_view::npos) {
+			const string_view slop = token.substr(quote + 1);
+			if (!slop.empty()) {
+				const auto [slop_end, error] = from_chars(slop.data() + 1, slop.data() + slop.size(), phrase->slop);
+				if (slop[0] != '~' || error != errc{} || slop_end != slop.data() + slop.size()) {
+					throw invalid_argument("Phrase slop is invalid"s);
+				}
+			}
+			token = token.substr(0, quote);
+		}
+		if (!token.empty()) {
+			const auto query_word = ParseQueryWord(token);
 			if (query_word.is_minus) {
-				result.minus_words.push_back(query_word.data);
+				throw invalid_argument("Phrase word is invalid"s);
+			}
+			result.has_unknown_words |= query_word.term == TermDictionary::NO_TERM;
+			if (!query_word.is_stop) {
+				phrase->terms.push_back(query_word.term);
+				phrase->offsets.push_back(phrase_length);
+				result.plus_terms.push_back(query_word.term);
+			}
+			++phrase_length;
+		}
+		if (quote != string_view::npos) {
+			if (phrase_length == 0) {
+				throw invalid_argument("Query phrase is empty"s);
 			}
-			else {
-				result.plus_words.push_back(query_word.data);
+			// A phrase of stop words only is dropped like a stop word
+			if (phrase->terms.empty()) {
+				spare_phrases.push_back(move(result.phrases.back()));
+				result.phrases.pop_back();
 			}
+			phrase = nullptr;
 		}
 	}
-    
+	if (phrase != nullptr) {
+		throw invalid_argument("Query phrase is not closed"s);
+	}
+
+    // Queries have a handful of words, too few for parallel algorithms to pay off
     if (flag) {
-        sort(result.minus_words.begin(), result.minus_words.end());
-        auto it1 = unique(execution::par, result.minus_words.begin(), result.minus_words.end());
-        result.minus_words.erase(it1, result.minus_words.end());
-        sort(execution::par, result.plus_words.begin(), result.plus_words.end());
-        auto it2 = unique(result.plus_words.begin(), result.plus_words.end());
-        result.plus_words.erase(it2, result.plus_words.end());        
+        sort(result.minus_terms.begin(), result.minus_terms.end());
+        auto it1 = unique(result.minus_terms.begin(), result.minus_terms.end());
+        result.minus_terms.erase(it1, result.minus_terms.end());
+        sort(result.plus_terms.begin(), result.plus_terms.end());
+        auto it2 = unique(result.plus_terms.begin(), result.plus_terms.end());
+        result.plus_terms.erase(it2, result.plus_terms.end());
+        const auto phrase_key = [](const Phrase& phrase) {
+            return tie(phrase.terms, phrase.offsets, phrase.slop);
+        };
+        sort(result.phrases.begin(), result.phrases.end(), [&phrase_key](const Phrase& lhs, const Phrase& rhs) {
+            return phrase_key(lhs) < phrase_key(rhs);
+        });
+        auto it3 = unique(result.phrases.begin(), result.phrases.end(), [&phrase_key](const Phrase& lhs, const Phrase& rhs) {
+            return phrase_key(lhs) == phrase_key(rhs);
+        });
+        for (; result.phrases.end() != it3; result.phrases.pop_back()) {
+            spare_phrases.push_back(move(result.phrases.back()));
+        }
     }
-    
-	return result;
 }
 
+vector<SearchServer::SegmentQuery> SearchServer::ResolveQuery(const Snapshot& snapshot, const Query& query) {
+	vector<SegmentQuery> segment_queries;
+	ResolveQuery(snapshot, query, segment_queries);
+	return segment_queries;
+}
+
+void SearchServer::ResolveQuery(const Snapshot& snapshot, const Query& query, vector<SegmentQuery>& segment_queries) {
+	// Segment queries left out and the phrases of earlier queries keep their buffers here, for the next query of the thread
+	thread_local vector<SegmentQuery> spare;
+	thread_local vector<SegmentPhrase> spare_phrases;
+	while (segment_queries.size() > snapshot.segments.size()) {
+		spare.push_back(move(segment_queries.back()));
+		segment_queries.pop_back();
+	}
+	while (segment_queries.size() < snapshot.segments.size()) {
+		if (spare.empty()) {
+			segment_queries.emplace_back();
+		} else {
+			segment_queries.push_back(move(spare.back()));
+			spare.pop_back();
+		}
+	}
+	for (size_t i = 0; i < snapshot.segments.size(); ++i) {
+		SegmentQuery& segment_query = segment_queries[i];
+		segment_query.segment = snapshot.segments[i].segment.get();
+		segment_query.deleted = snapshot.segments[i].deleted.get();
+		segment_query.plus_terms.clear();
+		segment_query.minus_postings.clear();
+		for (; !segment_query.phrases.empty(); segment_query.phrases.pop_back()) {
+			spare_phrases.push_back(move(segment_query.phrases.back()));
+		}
+		segment_query.phrase_postings = nullptr;
+		// The buffers move between segments and the spares below, so each one is sized for
+		// the whole query rather than for what one segment has
+		segment_query.plus_terms.reserve(query.plus_terms.size());
+		segment_query.minus_postings.reserve(query.minus_terms.size());
+	}
+
+	thread_local vector<double> inverse_document_freqs;
+	inverse_document_freqs.assign(query.plus_terms.size(), 0.0);
+	for (size_t word_index = 0; word_index < query.plus_terms.size(); ++word_index) {
+		size_t document_freq = 0;
+		for (SegmentQuery& segment_query : segment_queries) {
+			const TermId term = segment_query.segment->FindTerm(query.plus_terms[word_index]);
+			if (term == TermDictionary::NO_TERM) {
+				continue;
+			}
+			const PostingList* postings = segment_query.segment->GetIndex().FindPostings(term);
+			if (postings == nullptr) {
+				continue;
+			}
+			// Only live documents count, as if the deleted ones were already purged
+			const size_t live_document_freq = postings->size()
+				- (segment_query.deleted != nullptr ? segment_query.deleted->GetDocumentFreq(term) : 0);
+			if (live_document_freq > 0) {
+				segment_query.plus_terms.push_back({ term, postings, 0.0, word_index });
+				document_freq += live_document_freq;
+			}
+		}
+		const double inverse_document_freq = log(snapshot.document_count * 1.0 / document_freq);
+		inverse_document_freqs[word_index] = inverse_document_freq;
+		for (SegmentQuery& segment_query : segment_queries) {
+			if (!segment_query.plus_terms.empty() && segment_query.plus_terms.back().word_index == word_index) {
+				segment_query.plus_terms.back().inverse_document_freq = inverse_document_freq;
+			}
+		}
+	}
+
+	for (const TermId global_term : query.minus_terms) {
+		for (SegmentQuery& segment_query : segment_queries) {
+			if (segment_query.plus_terms.empty()) {
+				continue;
+			}
+			const TermId term = segment_query.segment->FindTerm(global_term);
+			if (term == TermDictionary::NO_TERM) {
+				continue;
+			}
+			if (const PostingList* postings = segment_query.segment->GetIndex().FindPostings(term)) {
+				segment_query.minus_postings.push_back(postings);
+			}
+		}
+	}
+
+	for (SegmentQuery& segment_query : segment_queries) {
+		for (const Phrase& phrase : query.phrases) {
+			if (spare_phrases.empty()) {
+				segment_query.phrases.emplace_back();
+			} else {
+				segment_query.phrases.push_back(move(spare_phrases.back()));
+				spare_phrases.pop_back();
+			}
+			SegmentPhrase& segment_phrase = segment_query.phrases.back();
+			if (!ResolvePhrase(*segment_query.segment, phrase, segment_phrase)) {
+				segment_query.plus_terms.clear();
+				break;
+			}
+			segment_phrase.inverse_document_freq = 0.0;
+			for (const TermId global_term : phrase.terms) {
+				const auto word_index = lower_bound(query.plus_terms.begin(), query.plus_terms.end(), global_term) - query.plus_terms.begin();
+				segment_phrase.inverse_document_freq += inverse_document_freqs[word_index];
+			}
+			for (const TermId term : segment_phrase.distinct_terms) {
+				const PostingList* postings = segment_query.segment->GetIndex().FindPostings(term);
+				if (segment_query.phrase_postings == nullptr || postings->size() < segment_query.phrase_postings->size()) {
+					segment_query.phrase_postings = postings;
+				}
+			}
+		}
+		segment_query.has_every_plus_word = segment_query.plus_terms.size() == query.plus_terms.size();
+	}
+
+	size_t kept = 0;
+	for (size_t i = 0; i < segment_queries.size(); ++i) {
+		if (!segment_queries[i].plus_terms.empty()) {
+			swap(segment_queries[kept++], segment_queries[i]);
+		}
+	}
+	while (segment_queries.size() > kept) {
+		spare.push_back(move(segment_queries.back()));
+		segment_queries.pop_back();
+	}
+}
+
+bool SearchServer::ResolvePhrase(const Segment& segment, const Phrase& phrase, SegmentPhrase& result) {
+	if (segment.GetPositions() == nullptr) {
+		throw invalid_argument("Phrase queries need the positional index"s);
+	}
+	result.terms.clear();
+	for (const TermId global_term : phrase.terms) {
+		const TermId term = segment.FindTerm(global_term);
+		if (term == TermDictionary::NO_TERM || segment.GetIndex().FindPostings(term) == nullptr) {
+			return false;
+		}
+		result.terms.push_back(term);
+	}
+	result.offsets.assign(phrase.offsets.begin(), phrase.offsets.end());
+	result.slop = phrase.slop;
+	result.distinct_terms.assign(result.terms.begin(), result.terms.end());
+	sort(result.distinct_terms.begin(), result.distinct_terms.end());
+	result.distinct_terms.erase(unique(result.distinct_terms.begin(), result.distinct_terms.end()), result.distinct_terms.end());
+	result.term_slots.clear();
+	for (const TermId term : result.terms) {
+		result.term_slots.push_back(lower_bound(result.distinct_terms.begin(), result.distinct_terms.end(), term) - result.distinct_terms.begin());
+	}
+	result.inverse_document_freq = 0.0;
+	return true;
+}
+
+double SearchServer::ScorePhrase(const Segment& segment, uint32_t ordinal, const SegmentPhrase& phrase, PhraseScratch& scratch) {
+	scratch.positions.resize(phrase.distinct_terms.size());
+	segment.GetPositions()->Decode(ordinal, segment.GetTermCounts(ordinal), phrase.distinct_terms.data(), phrase.distinct_terms.size(),
+	                               scratch.positions.data());
+	scratch.word_positions.clear();
+	for (const size_t slot : phrase.term_slots) {
+		if (scratch.positions[slot].empty()) {
+			return 0.0;
+		}
+		scratch.word_positions.push_back(&scratch.positions[slot]);
+	}
+	const double occurrences = CountPhraseOccurrences(scratch.word_positions.data(), phrase.offsets.data(), phrase.terms.size(),
+	                                                  phrase.slop, scratch.cursors);
+	return occurrences / segment.GetDocumentLength(ordinal);
+}
+
+bool SearchServer::HasPhrases(const Segment& segment, uint32_t ordinal, const vector<Phrase>& phrases) {
+	PhraseScratch scratch;
+	SegmentPhrase segment_phrase;
+	for (const Phrase& phrase : phrases) {
+		if (!ResolvePhrase(segment, phrase, segment_phrase) || ScorePhrase(segment, ordinal, segment_phrase, scratch) == 0.0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void SearchServer::IntersectPostings(const SegmentQuery& query, uint32_t first_ordinal, uint32_t last_ordinal, ScoringScratch& scratch) {
+	vector<const PostingList*>& plus_postings = scratch.postings;
+	plus_postings.clear();
+	for (const QueryTerm& term : query.plus_terms) {
+		plus_postings.push_back(term.postings);
+	}
+	sort(plus_postings.begin(), plus_postings.end(), [](const PostingList* lhs, const PostingList* rhs) {
+		return lhs->size() < rhs->size();
+	});
+
+	const auto first = static_cast<int>(first_ordinal);
+	const auto last = static_cast<int>(last_ordinal);
+	// Only the range of a raw list's ids is merged
+	const auto get_range = [&](const PostingList& postings) {
+		const int* begin = lower_bound(postings.document_ids.begin(), postings.document_ids.end(), first);
+		const int* end = lower_bound(begin, postings.document_ids.end(), last);
+		return pair{ begin, static_cast<size_t>(end - begin) };
+	};
+
+	// The shortest list gives the candidates, every other one can only take some away
+	vector<int>& candidates = scratch.candidates;
+	PostingCursor& cursor = scratch.cursor;
+	const PostingList& shortest = *plus_postings.front();
+	if (shortest.compressed == nullptr) {
+		const auto [begin, size] = get_range(shortest);
+		candidates.assign(begin, begin + size);
+	} else {
+		candidates.clear();
+		cursor.Reset(shortest);
+		for (cursor.Seek(first); !cursor.AtEnd() && cursor.GetDocumentId() < last; cursor.Next()) {
+			candidates.push_back(cursor.GetDocumentId());
+		}
+	}
+
+	size_t count = candidates.size();
+	// Compressed lists are probed with a cursor, whose Seek gallops over whole blocks first
+	const auto keep_if = [&](const PostingList& postings, bool has_posting) {
+		cursor.Reset(postings);
+		size_t kept = 0;
+		for (size_t i = 0; i < count; ++i) {
+			cursor.Seek(candidates[i]);
+			if ((!cursor.AtEnd() && cursor.GetDocumentId() == candidates[i]) == has_posting) {
+				candidates[kept++] = candidates[i];
+			}
+		}
+		count = kept;
+	};
+	for (size_t i = 1; i < plus_postings.size() && count > 0; ++i) {
+		if (plus_postings[i]->compressed == nullptr) {
+			const auto [begin, size] = get_range(*plus_postings[i]);
+			count = IntersectSorted(candidates.data(), count, begin, size, candidates.data());
+		} else {
+			keep_if(*plus_postings[i], true);
+		}
+	}
+	for (size_t i = 0; i < query.minus_postings.size() && count > 0; ++i) {
+		if (query.minus_postings[i]->compressed == nullptr) {
+			const auto [begin, size] = get_range(*query.minus_postings[i]);
+			count = SubtractSorted(candidates.data(), count, begin, size, candidates.data());
+		} else {
+			keep_if(*query.minus_postings[i], false);
+		}
+	}
+	candidates.resize(count);
+}
+
+bool SearchServer::HasPosting(vector<PostingCursor>& cursors, size_t count, uint32_t ordinal) {
+	for (size_t i = 0; i < count; ++i) {
+		PostingCursor& cursor = cursors[i];
+		cursor.Seek(ordinal);
+		if (!cursor.AtEnd() && static_cast<uint32_t>(cursor.GetDocumentId()) == ordinal) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void SearchServer::ResetCursors(vector<PostingCursor>& cursors, const vector<const PostingList*>& postings, uint32_t first_ordinal) {
+	if (cursors.size() < postings.size()) {
+		cursors.resize(postings.size());
+	}
+	for (size_t i = 0; i < postings.size(); ++i) {
+		cursors[i].Reset(*postings[i]);
+		cursors[i].Seek(first_ordinal);
+	}
+}
+
+void SearchServer::ResetTops(vector<TopDocuments>& tops, size_t count, size_t max_count) {
+	if (tops.size() < count) {
+		tops.resize(count);
+	}
+	for (size_t i = 0; i < count; ++i) {
+		tops[i].Reset(max_count);
+	}
+}
 
 tuple<vector<string_view>, DocumentStatus> SearchServer::MatchDocument(const string_view &raw_query, int document_id) const {
+	const auto snapshot = GetSnapshot();
 	const auto query = ParseQuery(true, raw_query);
-	vector<string_view> matched_words;
-    matched_words.reserve(query.plus_words.size());
-    
+	const auto [segment, ordinal] = FindDocument(*snapshot, document_id);
+	if (segment == nullptr) {
+		throw std::out_of_range("Invalid document_id: such document_id isn't exists"s);
+	}
+	const DocumentStatus status = segment->GetStatus(ordinal);
+
     /* WHY SOLUTION FROM 2/3 doesn't pass the test here with message ????
     "method without explicit execution policy is too slow, student/author ratio: 1.66182802507"
     How it works????? In previous step this solution is valid, but here by transition from string to string_view it becomes slower and invalid by meaning of cheking system!!!
-    
+
 	for (const auto &word : query.plus_words) {
 		if (word_to_document_freqs_.count(word) == 0) {
 			continue;
@@ -234,17 +1347,9 @@ tuple<vector<string_view>, DocumentStatus> SearchServer::MatchDocument(const str
 	}
 	return { matched_words, documents_.at(document_id).status };
     */
-    if (any_of(execution::par, query.minus_words.begin(), query.minus_words.end(), [&, document_id](const auto &word){if(word_to_document_freqs_.count(word) > 0) {return word_to_document_freqs_.at(word).count(document_id) > 0;} return false;})) {
-       return {vector<string_view>{}, documents_.at(document_id).status}; 
-    }
-    
-    auto it = copy_if(execution::par, query.plus_words.begin(), query.plus_words.end(), matched_words.begin(), [&, document_id](const auto &word){ if(word_to_document_freqs_.count(word) > 0) {return word_to_document_freqs_.at(word).count(document_id) > 0;} return false; });
-    
-    sort(execution::par, matched_words.begin(), it);
-    auto last = unique(execution::par, matched_words.begin(), it);
-    matched_words.erase(last, matched_words.end());
-    return { matched_words, documents_.at(document_id).status };
-    
+    // Matched words are returned as the segment's views, which outlive the query text
+    return { MatchOrdinal(*segment, ordinal, query, ResolveMatchTerms(*segment, query, false)), status };
+
 }
 
 
@@ -253,27 +1358,127 @@ std::tuple<std::vector<std::string_view>, DocumentStatus> SearchServer::MatchDoc
 }
 
 std::tuple<std::vector<std::string_view>, DocumentStatus> SearchServer::MatchDocument(const std::execution::parallel_policy&, const std::string_view raw_query, int document_id) const {
-	
-    if (documents_.count(document_id) == 0) {
+
+    const auto snapshot = GetSnapshot();
+    const auto [segment, ordinal] = FindDocument(*snapshot, document_id);
+    if (segment == nullptr) {
         throw std::out_of_range("Invalid document_id: such document_id isn't exists"s);
     }
-    
+
     if (!IsValidWord(raw_query)) {
         throw std::invalid_argument("Invalid query");
-    }  
-    
-    
-	const auto query = ParseQuery(false, raw_query);
-    
-    if (any_of(execution::par, query.minus_words.begin(), query.minus_words.end(), [&, document_id](const auto &word){if(word_to_document_freqs_.count(word) > 0) {return word_to_document_freqs_.at(word).count(document_id) > 0;} return false;})) {
-       return {vector<string_view>{}, documents_.at(document_id).status}; 
     }
-    
-	vector<string_view> matched_words(query.plus_words.size());
-    auto it = copy_if(execution::par, query.plus_words.begin(), query.plus_words.end(), matched_words.begin(), [&, document_id](const auto &word){ if(word_to_document_freqs_.count(word) > 0) {return word_to_document_freqs_.at(word).count(document_id) > 0;} return false; });
-    
-    sort(execution::par, matched_words.begin(), it);
-    auto last = unique(execution::par, matched_words.begin(), it);
-    matched_words.erase(last, matched_words.end());
-    return { matched_words, documents_.at(document_id).status };
-}
\ No newline at end of file
+
+
+	const auto query = ParseQuery(false, raw_query);
+    return { MatchOrdinal(*segment, ordinal, query, ResolveMatchTerms(*segment, query, true)), segment->GetStatus(ordinal) };
+}
+
+vector<tuple<vector<string_view>, DocumentStatus>> SearchServer::MatchDocuments(const string_view raw_query, const vector<int>& document_ids) const {
+	const auto snapshot = GetSnapshot();
+	return MatchQuery(*snapshot, ParseQuery(true, raw_query), document_ids);
+}
+
+tuple<vector<string_view>, DocumentStatus> SearchServer::MatchDocument(const CompiledQuery& query, int document_id) const {
+	const auto snapshot = GetSnapshot();
+	const auto [segment, ordinal] = FindDocument(*snapshot, document_id);
+	if (segment == nullptr) {
+		throw out_of_range("Invalid document_id: such document_id isn't exists"s);
+	}
+	Query scratch;
+	const Query& current_query = GetCurrentQuery(query, *snapshot, scratch);
+	return { MatchOrdinal(*segment, ordinal, current_query, ResolveMatchTerms(*segment, current_query, false)), segment->GetStatus(ordinal) };
+}
+
+vector<tuple<vector<string_view>, DocumentStatus>> SearchServer::MatchDocuments(const CompiledQuery& query, const vector<int>& document_ids) const {
+	const auto snapshot = GetSnapshot();
+	Query scratch;
+	return MatchQuery(*snapshot, GetCurrentQuery(query, *snapshot, scratch), document_ids);
+}
+
+vector<tuple<vector<string_view>, DocumentStatus>> SearchServer::MatchQuery(const Snapshot& snapshot, const Query& query, const vector<int>& document_ids) const {
+	vector<pair<const Segment*, uint32_t>> documents;
+	documents.reserve(document_ids.size());
+	for (const int document_id : document_ids) {
+		const DocumentLocation location = FindDocument(snapshot, document_id);
+		if (location.segment == nullptr) {
+			throw out_of_range("Invalid document_id: such document_id isn't exists"s);
+		}
+		documents.push_back({ location.segment, location.ordinal });
+	}
+
+	// Every segment looks the words up once, however many of its documents are matched
+	unordered_map<const Segment*, MatchTerms> segment_terms;
+	for (const auto& [segment, ordinal] : documents) {
+		if (segment_terms.count(segment) == 0) {
+			segment_terms.emplace(segment, ResolveMatchTerms(*segment, query, false));
+		}
+	}
+	vector<tuple<vector<string_view>, DocumentStatus>> matches(documents.size());
+	const auto match = [&](size_t i) {
+		const auto [segment, ordinal] = documents[i];
+		matches[i] = { MatchOrdinal(*segment, ordinal, query, segment_terms.at(segment)), segment->GetStatus(ordinal) };
+	};
+	if (documents.size() < PARALLEL_MATCH_SIZE) {
+		for (size_t i = 0; i < documents.size(); ++i) {
+			match(i);
+		}
+	} else {
+		GetThreadPool()->ParallelFor(documents.size(), match);
+	}
+	return matches;
+}
+
+SearchServer::MatchTerms SearchServer::ResolveMatchTerms(const Segment& segment, const Query& query, bool is_parallel) {
+	const auto resolve = [&segment, is_parallel](const vector<TermId>& global_terms) {
+		vector<TermId> terms(global_terms.size());
+		const auto find_term = [&segment](TermId global_term) { return segment.FindTerm(global_term); };
+		if (is_parallel && global_terms.size() >= PARALLEL_MATCH_SIZE) {
+			transform(execution::par, global_terms.begin(), global_terms.end(), terms.begin(), find_term);
+		} else {
+			transform(global_terms.begin(), global_terms.end(), terms.begin(), find_term);
+		}
+		terms.erase(remove(terms.begin(), terms.end(), TermDictionary::NO_TERM), terms.end());
+		sort(terms.begin(), terms.end());
+		terms.erase(unique(terms.begin(), terms.end()), terms.end());
+		return terms;
+	};
+	return { resolve(query.plus_terms), resolve(query.minus_terms) };
+}
+
+vector<string_view> SearchServer::MatchOrdinal(const Segment& segment, uint32_t ordinal, const Query& query, const MatchTerms& terms) {
+	const MappedVector<TermCount> term_counts = segment.GetTermCounts(ordinal);
+	// Both sides ascend, so every lookup starts where the last one stopped; a binary search
+	// rather than a linear merge, as queries are usually far shorter than documents
+	const auto for_each_match = [&term_counts](const vector<TermId>& sorted_terms, auto on_match) {
+		const TermCount* position = term_counts.begin();
+		for (const TermId term : sorted_terms) {
+			position = lower_bound(position, term_counts.end(), term, [](const TermCount& item, TermId value) {
+				return item.term < value;
+			});
+			if (position == term_counts.end()) {
+				return;
+			}
+			if (position->term == term && !on_match(term)) {
+				return;
+			}
+		}
+	};
+
+	bool has_minus_word = false;
+	for_each_match(terms.minus_terms, [&has_minus_word](TermId) {
+		has_minus_word = true;
+		return false;
+	});
+	if (has_minus_word || !HasPhrases(segment, ordinal, query.phrases)) {
+		return {};
+	}
+	vector<string_view> matched_words;
+	matched_words.reserve(terms.plus_terms.size());
+	for_each_match(terms.plus_terms, [&](TermId term) {
+		matched_words.push_back(segment.GetTerm(term));
+		return true;
+	});
+	sort(matched_words.begin(), matched_words.end());
+	return matched_words;
+}
@@ -6,215 +6,1371 @@
 #include <set>
 #include <map>
 #include <algorithm>
+#include <condition_variable>
 #include "document.h"
 #include "string_processing.h"
 #include <stdexcept>
 #include <iterator>
 #include <execution>
 #include <string_view>
-#include "concurrent_map.h"
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include "concurrent_score_table.h"
+#include "index_file.h"
+#include "inverted_index.h"
+#include "query_result_cache.h"
+#include "segment.h"
+#include "term_dictionary.h"
+#include "thread_pool.h"
+#include "thread_scratch.h"
+#include "top_documents.h"
 
-const int MAX_RESULT_DOCUMENT_COUNT = 5;
-const double ACCURACY = 1e-6;
+// Execution mode of FindTopDocuments that splits the documents into shard_count id
+// ranges, evaluates the whole query on every range concurrently and merges their tops.
+// It can only cut latency when the pool has idle cores for the shards; with more shards
+// than cores it is slower than sequential. BenchmarkPartitioned in main.cpp measures it
+struct PartitionedExecution {
+    size_t shard_count = std::max(1u, std::thread::hardware_concurrency());
+};
+
+struct SearchOptions {
+    // How many of the best documents FindTopDocuments returns
+    size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT;
+    // Skip documents and blocks of postings that cannot reach the top (block-max WAND); results
+    // are the same as without it. It pays off on short queries when word frequencies are skewed,
+    // as in real texts (BenchmarkSkewedPruning: about 1.5 times faster). When words are about
+    // equally common or queries are long, few postings are skipped and the dense per-segment
+    // accumulators of the exhaustive loop are far faster, so it is off by default
+    bool dynamic_pruning = false;
+    // Sequential and partitioned queries score the segments built impact-ordered (SearchServer::SetImpactOrdering)
+    // from their quantised impacts, highest first, and stop once the remaining postings cannot
+    // change the top; the documents returned are then rescored exactly. This is approximate:
+    // quantisation overestimates a document's relevance by less than eps, the sum over the
+    // query words of max_term_freq * idf / ImpactIndex::MAX_LEVEL, i.e. 1/255 of the most a
+    // document could score. A document is only left out in favour of returned ones whose exact
+    // relevance is lower than its own by at most eps, and returned relevances are exact
+    bool impact_ordered = false;
+    // Only documents with every plus word match (AND); by default one is enough (OR).
+    // The postings of the plus words are intersected, shortest first, and the minus
+    // words' subtracted before any document is scored
+    bool conjunctive = false;
+    // Identifies the predicate of a FindTopDocuments call to the result cache, which only
+    // caches calls with a predicate when it is set. Equal ids must mean equal predicates
+    std::optional<uint64_t> predicate_id;
+};
+
+// Document of a batch passed to SearchServer::AddDocuments
+struct DocumentToAdd {
+    int id;
+    std::string_view text;
+    DocumentStatus status;
+    std::vector<int> ratings;
+};
 
+// Queries never block and never see a half-applied update: the corpus is an immutable
+// snapshot of segments behind an atomic pointer. Every query pins the snapshot that is
+// current when it starts; updates are serialised among themselves, build new segments
+// next to the published ones and then swap in a new snapshot.
+// Every update adds a small segment, so ingestion never rewrites the big ones; a
+// background thread merges neighbouring segments of similar size into larger ones.
 class SearchServer {
 public:
+    class DocumentIdIterator;
+    class CompiledQuery;
+
     template <typename StringContainer>
-    explicit SearchServer(const StringContainer& stop_words)
-        : stop_words_(MakeUniqueNonEmptyStrings(stop_words))  // Extract non-empty stop words
-    {
-        if (!all_of(stop_words_.begin(), stop_words_.end(), IsValidWord)) {
+    explicit SearchServer(const StringContainer& stop_words) {
+        const auto unique_stop_words = MakeUniqueNonEmptyStrings(stop_words);  // Extract non-empty stop words
+        if (!all_of(unique_stop_words.begin(), unique_stop_words.end(), IsValidWord)) {
             throw std::invalid_argument("Some of stop words are invalid");
         }
+        for (const std::string_view word : unique_stop_words) {
+            state_->terms.Intern(word);
+            stop_words_.Intern(word);
+        }
+        stop_word_count_ = state_->terms.size();
     }
 
     explicit SearchServer(const std::string& stop_words_text) : SearchServer(SplitIntoWordsView(stop_words_text)) {}
     explicit SearchServer(const std::string_view stop_words_text) : SearchServer(SplitIntoWordsView(stop_words_text)) {}
 
     void AddDocument(int document_id, const std::string_view document, DocumentStatus status, const std::vector<int>& ratings);
-    
+    // Adds a batch of documents as one segment: words are split and counted on the thread
+    // pool, and every posting list of the segment is built in a single pass. Throws
+    // invalid_argument before adding anything if an id or a word is invalid
+    void AddDocuments(const std::vector<DocumentToAdd>& documents);
+    // Indexes a text without copying it: the caller keeps the bytes (e.g. a mapped file)
+    // alive and unchanged until the document is removed or the server is destroyed
+    void AddExternalDocument(int document_id, const std::string_view document, DocumentStatus status, const std::vector<int>& ratings);
+
     // Previous ordinary FindTopDocuments without execution policy
     template <typename DocumentPredicate>
-    std::vector<Document> FindTopDocuments(const std::string_view raw_query, DocumentPredicate document_predicate) const {
-        
-        const auto query = ParseQuery(true, raw_query);
-        auto matched_documents = FindAllDocuments(query, document_predicate);
+    std::vector<Document> FindTopDocuments(const std::string_view raw_query, DocumentPredicate document_predicate, const SearchOptions& options = {}) const {
+        std::vector<Document> result;
+        FindTopDocuments(raw_query, document_predicate, options, result);
+        return result;
+    }
 
-        sort(matched_documents.begin(), matched_documents.end(),
-            [](const Document& lhs, const Document& rhs) {
-                if (std::abs(lhs.relevance - rhs.relevance) < ACCURACY) {
-                    return lhs.rating > rhs.rating;
-                }
-                else {
-                    return lhs.relevance > rhs.relevance;
-                }
-            });
-        if (matched_documents.size() > MAX_RESULT_DOCUMENT_COUNT) {
-            matched_documents.resize(MAX_RESULT_DOCUMENT_COUNT);
+
+    // Take an execution policy
+    template <typename DocumentPredicate, typename ExecPolicy, typename = std::enable_if_t<std::is_execution_policy_v<std::decay_t<ExecPolicy>>>>
+    std::vector<Document> FindTopDocuments(ExecPolicy&& policy, const std::string_view raw_query, DocumentPredicate document_predicate, const SearchOptions& options = {}) const {
+        if constexpr (std::is_same_v<std::decay_t<ExecPolicy>, std::execution::sequenced_policy>) {
+            return FindTopDocuments(raw_query, document_predicate, options);
+        } else {
+            std::vector<Document> result;
+            FindTopDocuments(std::execution::par, raw_query, document_predicate, options, result);
+            return result;
         }
+    }
 
-        return matched_documents;
+    template <typename DocumentPredicate>
+    std::vector<Document> FindTopDocuments(const PartitionedExecution& execution, const std::string_view raw_query, DocumentPredicate document_predicate, const SearchOptions& options = {}) const {
+        std::vector<Document> result;
+        FindTopDocuments(execution, raw_query, document_predicate, options, result);
+        return result;
     }
-    
-    
-    // Take an execution policy
-    template <typename DocumentPredicate, typename ExecPolicy>
-    std::vector<Document> FindTopDocuments(ExecPolicy policy, const std::string_view raw_query, DocumentPredicate document_predicate) const {
-        
-        const auto query = ParseQuery(true, raw_query);
-        auto matched_documents = FindAllDocuments(std::execution::par, query, document_predicate);
 
-        sort(std::execution::par, matched_documents.begin(), matched_documents.end(),
-            [](const Document& lhs, const Document& rhs) {
-                if (std::abs(lhs.relevance - rhs.relevance) < ACCURACY) {
-                    return lhs.rating > rhs.rating;
-                }
-                else {
-                    return lhs.relevance > rhs.relevance;
-                }
-            });
-        if (matched_documents.size() > MAX_RESULT_DOCUMENT_COUNT) {
-            matched_documents.resize(MAX_RESULT_DOCUMENT_COUNT);
-        }
-
-        return matched_documents;
-    }
-    
-    std::vector<Document> FindTopDocuments(const std::string_view raw_query, DocumentStatus status) const;
-    std::vector<Document> FindTopDocuments(const std::execution::sequenced_policy&, const std::string_view raw_query, DocumentStatus status) const;
-    std::vector<Document> FindTopDocuments(const std::execution::parallel_policy&, const std::string_view raw_query, DocumentStatus status) const noexcept;
-    
-    std::vector<Document> FindTopDocuments(const std::string_view raw_query) const;
-    std::vector<Document> FindTopDocuments(const std::execution::sequenced_policy&, const std::string_view raw_query) const;
-    std::vector<Document> FindTopDocuments(const std::execution::parallel_policy&, const std::string_view raw_query) const noexcept;
-    
-    
+    // Filtering by status tests the segments' status bitsets instead of calling a predicate
+    std::vector<Document> FindTopDocuments(const std::string_view raw_query, DocumentStatus status, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const std::execution::sequenced_policy&, const std::string_view raw_query, DocumentStatus status, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const std::execution::parallel_policy&, const std::string_view raw_query, DocumentStatus status, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const PartitionedExecution& execution, const std::string_view raw_query, DocumentStatus status, const SearchOptions& options = {}) const;
+
+    std::vector<Document> FindTopDocuments(const std::string_view raw_query, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const std::execution::sequenced_policy&, const std::string_view raw_query, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const std::execution::parallel_policy&, const std::string_view raw_query, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const PartitionedExecution& execution, const std::string_view raw_query, const SearchOptions& options = {}) const;
+
+    // The same into result, which keeps its buffer: a thread that passes the same vector to every
+    // query runs them without allocating once its buffers have grown
+    template <typename DocumentPredicate>
+    void FindTopDocuments(const std::string_view raw_query, DocumentPredicate document_predicate, const SearchOptions& options, std::vector<Document>& result) const {
+        FindTopDocumentsFiltered(raw_query, PredicateFilter<DocumentPredicate>{ document_predicate }, options, result);
+    }
+    template <typename DocumentPredicate, typename ExecPolicy, typename = std::enable_if_t<std::is_execution_policy_v<std::decay_t<ExecPolicy>>>>
+    void FindTopDocuments(ExecPolicy&&, const std::string_view raw_query, DocumentPredicate document_predicate, const SearchOptions& options, std::vector<Document>& result) const {
+        if constexpr (std::is_same_v<std::decay_t<ExecPolicy>, std::execution::sequenced_policy>) {
+            FindTopDocuments(raw_query, document_predicate, options, result);
+        } else {
+            FindTopDocumentsFiltered(std::execution::par, raw_query, PredicateFilter<DocumentPredicate>{ document_predicate }, options, result);
+        }
+    }
+    template <typename DocumentPredicate>
+    void FindTopDocuments(const PartitionedExecution& execution, const std::string_view raw_query, DocumentPredicate document_predicate, const SearchOptions& options,
+                          std::vector<Document>& result) const {
+        FindTopDocumentsFiltered(execution, raw_query, PredicateFilter<DocumentPredicate>{ document_predicate }, options, result);
+    }
+    void FindTopDocuments(const std::string_view raw_query, DocumentStatus status, const SearchOptions& options, std::vector<Document>& result) const;
+    void FindTopDocuments(const std::execution::sequenced_policy&, const std::string_view raw_query, DocumentStatus status, const SearchOptions& options, std::vector<Document>& result) const;
+    void FindTopDocuments(const std::execution::parallel_policy&, const std::string_view raw_query, DocumentStatus status, const SearchOptions& options, std::vector<Document>& result) const;
+    void FindTopDocuments(const PartitionedExecution& execution, const std::string_view raw_query, DocumentStatus status, const SearchOptions& options, std::vector<Document>& result) const;
+
+    // Parses the query and resolves its words against the current documents once, for the overloads
+    // below that take it instead of the text. Throws invalid_argument as they would
+    CompiledQuery CompileQuery(const std::string_view raw_query) const;
+    // The same into a query compiled before, reusing its buffers, e.g. a query kept per thread
+    void CompileQuery(const std::string_view raw_query, CompiledQuery& query) const;
+
+    template <typename DocumentPredicate>
+    std::vector<Document> FindTopDocuments(const CompiledQuery& query, DocumentPredicate document_predicate, const SearchOptions& options = {}) const {
+        std::vector<Document> result;
+        FindTopDocuments(query, document_predicate, options, result);
+        return result;
+    }
+    template <typename DocumentPredicate, typename ExecPolicy, typename = std::enable_if_t<std::is_execution_policy_v<std::decay_t<ExecPolicy>>>>
+    std::vector<Document> FindTopDocuments(ExecPolicy&& policy, const CompiledQuery& query, DocumentPredicate document_predicate, const SearchOptions& options = {}) const {
+        if constexpr (std::is_same_v<std::decay_t<ExecPolicy>, std::execution::sequenced_policy>) {
+            return FindTopDocuments(query, document_predicate, options);
+        } else {
+            std::vector<Document> result;
+            FindTopDocuments(std::execution::par, query, document_predicate, options, result);
+            return result;
+        }
+    }
+    template <typename DocumentPredicate>
+    std::vector<Document> FindTopDocuments(const PartitionedExecution& execution, const CompiledQuery& query, DocumentPredicate document_predicate, const SearchOptions& options = {}) const {
+        std::vector<Document> result;
+        FindTopDocuments(execution, query, document_predicate, options, result);
+        return result;
+    }
+    std::vector<Document> FindTopDocuments(const CompiledQuery& query, DocumentStatus status, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const std::execution::sequenced_policy&, const CompiledQuery& query, DocumentStatus status, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const std::execution::parallel_policy&, const CompiledQuery& query, DocumentStatus status, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const PartitionedExecution& execution, const CompiledQuery& query, DocumentStatus status, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const CompiledQuery& query, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const std::execution::sequenced_policy&, const CompiledQuery& query, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const std::execution::parallel_policy&, const CompiledQuery& query, const SearchOptions& options = {}) const;
+    std::vector<Document> FindTopDocuments(const PartitionedExecution& execution, const CompiledQuery& query, const SearchOptions& options = {}) const;
+
+    // The same into result, as with a raw query
+    template <typename DocumentPredicate>
+    void FindTopDocuments(const CompiledQuery& query, DocumentPredicate document_predicate, const SearchOptions& options, std::vector<Document>& result) const {
+        FindTopDocumentsFiltered(query, PredicateFilter<DocumentPredicate>{ document_predicate }, options, result);
+    }
+    template <typename DocumentPredicate, typename ExecPolicy, typename = std::enable_if_t<std::is_execution_policy_v<std::decay_t<ExecPolicy>>>>
+    void FindTopDocuments(ExecPolicy&&, const CompiledQuery& query, DocumentPredicate document_predicate, const SearchOptions& options, std::vector<Document>& result) const {
+        if constexpr (std::is_same_v<std::decay_t<ExecPolicy>, std::execution::sequenced_policy>) {
+            FindTopDocuments(query, document_predicate, options, result);
+        } else {
+            FindTopDocumentsFiltered(std::execution::par, query, PredicateFilter<DocumentPredicate>{ document_predicate }, options, result);
+        }
+    }
+    template <typename DocumentPredicate>
+    void FindTopDocuments(const PartitionedExecution& execution, const CompiledQuery& query, DocumentPredicate document_predicate, const SearchOptions& options,
+                          std::vector<Document>& result) const {
+        FindTopDocumentsFiltered(execution, query, PredicateFilter<DocumentPredicate>{ document_predicate }, options, result);
+    }
+    void FindTopDocuments(const CompiledQuery& query, DocumentStatus status, const SearchOptions& options, std::vector<Document>& result) const;
+    void FindTopDocuments(const std::execution::sequenced_policy&, const CompiledQuery& query, DocumentStatus status, const SearchOptions& options, std::vector<Document>& result) const;
+    void FindTopDocuments(const std::execution::parallel_policy&, const CompiledQuery& query, DocumentStatus status, const SearchOptions& options, std::vector<Document>& result) const;
+    void FindTopDocuments(const PartitionedExecution& execution, const CompiledQuery& query, DocumentStatus status, const SearchOptions& options, std::vector<Document>& result) const;
+
+
+    // Re-encodes every posting list with codec, PostingCodec::RAW undoes it. Query results
+    // do not change; segments built later by merges use the same codec. It trades time for
+    // memory: on the benchmark corpus either codec saves about a quarter of the index, yet
+    // queries over it take about 1.5 times as long as over raw lists
+    void CompressIndex(PostingCodec codec);
+    // Adds an impact-ordered copy of the postings to every segment, or drops it, for queries
+    // with SearchOptions::impact_ordered; merges keep doing the same. Small segments of recent
+    // additions have none until they are merged, so those queries score them exactly. Not saved
+    void SetImpactOrdering(bool impact_ordered);
+    // Keeps the position of every word in every document, or drops them, for queries with
+    // quoted phrases: "new york" only matches documents with the two words next to each other,
+    // "new york"~2 also those with up to 2 more words in between, and a stop word inside a
+    // phrase holds its place. Every phrase of a query must occur; closer and more frequent
+    // occurrences add more relevance. Phrase queries throw invalid_argument without positions.
+    // Segments opened from an index file saved without them cannot get them, their texts are not saved
+    void SetPositionalIndex(bool positional);
+    // Heap bytes of the positions, which GetIndexMemoryUsage leaves out
+    size_t GetPositionalIndexMemoryUsage() const;
+
+    // Serves repeated FindTopDocuments calls from a cache of about capacity results, 0 turns it
+    // off. Calls are keyed by their sorted distinct plus and minus words, their status or
+    // SearchOptions::predicate_id and the options that change results, whatever the execution
+    // policy; adding or removing documents makes all cached results stale. May be called while
+    // queries run: they finish with the cache they started with, which a new one does not inherit
+    void SetResultCacheCapacity(size_t capacity);
+    // Zeros without a cache
+    QueryResultCache::Stats GetResultCacheStats() const;
+
+    // Writes stop words and every segment's terms, postings and document metadata in the
+    // format OpenIndex reads. Document texts are not saved
+    void SaveIndex(const std::string& path) const;
+    // Maps an index file and serves queries straight from it; the mapped segments are
+    // only copied when a merge or a removal rebuilds them
+    static SearchServer OpenIndex(const std::string& path);
+
+    // Workers for parallel and partitioned queries; ProcessQueries runs on them as well.
+    // May be called while queries and merges run: they finish on the pool they started with
+    void SetThreadPool(std::shared_ptr<ThreadPool> thread_pool);
+    std::shared_ptr<ThreadPool> GetThreadPool() const;
+
     int GetDocumentCount() const;
     int GetDocumentId(int index) const;
+    size_t GetIndexMemoryUsage() const;
+    // Segments are merged in the background; this blocks until no merge is due or running
+    void WaitForMerges() const;
 
 
-    const std::map<std::string_view, double>& GetWordFrequencies(int document_id) const;
-    std::vector<int>::const_iterator begin() const;
-    std::vector<int>::const_iterator end() const;
+    std::map<std::string_view, double> GetWordFrequencies(int document_id) const;
+    // Iterates over the documents of the snapshot current at the call
+    DocumentIdIterator begin() const;
+    DocumentIdIterator end() const;
+    // Removal only marks documents as deleted; queries skip them at once, and their postings
+    // and texts go away when the segment is merged or purged. Their words stay in the
+    // server's dictionary, see State::terms. Unknown ids are ignored
     void RemoveDocument(int document_id);
     void RemoveDocument(const std::execution::sequenced_policy&, int document_id);
-    void RemoveDocument(const std::execution::parallel_policy&, int document_id);   
-    
+    void RemoveDocument(const std::execution::parallel_policy&, int document_id);
+    // Removes the documents in one update, however many there are
+    void RemoveDocuments(const std::vector<int>& document_ids);
+    // Rewrites every segment with deleted documents without them. The merge thread does the
+    // same on its own for segments where deleted documents make up a large share
+    void PurgeDeletedDocuments();
+
     // TASK 2/3 Sprint 9 Parallel MatchDocument
     std::tuple<std::vector<std::string_view>, DocumentStatus> MatchDocument(const std::string_view &raw_query, int document_id) const;
     std::tuple<std::vector<std::string_view>, DocumentStatus> MatchDocument(const std::execution::sequenced_policy&, const std::string_view &raw_query, int document_id) const;
     std::tuple<std::vector<std::string_view>, DocumentStatus> MatchDocument(const std::execution::parallel_policy&, const std::string_view raw_query, int document_id) const;
+    // MatchDocument of every document, parsing the query once; throws out_of_range before
+    // matching anything if one of the ids is unknown
+    std::vector<std::tuple<std::vector<std::string_view>, DocumentStatus>> MatchDocuments(const std::string_view raw_query, const std::vector<int>& document_ids) const;
+    std::tuple<std::vector<std::string_view>, DocumentStatus> MatchDocument(const CompiledQuery& query, int document_id) const;
+    std::vector<std::tuple<std::vector<std::string_view>, DocumentStatus>> MatchDocuments(const CompiledQuery& query, const std::vector<int>& document_ids) const;
 
 private:
-    struct DocumentData {
-        int rating;
-        DocumentStatus status;
-        std::string document_text;
+    // Postings or table slots handled by one task of a parallel query
+    static constexpr size_t PARALLEL_CHUNK_SIZE = 4096;
+    // Below this many query words (or documents of MatchDocuments) matching stays on the calling
+    // thread: a word costs one dictionary lookup, far less than handing work to the pool
+    static constexpr size_t PARALLEL_MATCH_SIZE = 512;
+    // Number of segments of one size tier that are merged into a segment of the next tier
+    static constexpr size_t MERGE_FACTOR = 8;
+    // Beyond this many segments a writer waits for the running merges before returning
+    static constexpr size_t MAX_SEGMENT_COUNT = 128;
+    // The merge thread purges a segment once this fraction of its documents is deleted
+    static constexpr double MAX_DELETED_SHARE = 0.25;
+    // Snapshot::recent_locations is not folded into Snapshot::locations below this size
+    static constexpr size_t MIN_RECENT_LOCATIONS = 256;
+
+    struct PublishedSegment {
+        std::shared_ptr<const Segment> segment;
+        // nullptr while none of the segment's documents is deleted
+        std::shared_ptr<const DeletedDocuments> deleted;
+
+        bool IsDeleted(uint32_t ordinal) const {
+            return deleted != nullptr && deleted->IsDeleted(ordinal);
+        }
+        size_t GetLiveDocumentCount() const {
+            return segment->GetDocumentCount() - (deleted != nullptr ? deleted->GetCount() : 0);
+        }
+    };
+
+    // Where a live document is. A null segment in Snapshot::recent_locations marks a document
+    // that Snapshot::locations still has but that is gone since
+    struct DocumentLocation {
+        const Segment* segment = nullptr;
+        uint32_t ordinal = 0;
     };
-    const std::set<std::string_view> stop_words_;
-    std::map<std::string_view, std::map<int, double>> word_to_document_freqs_;
-    std::map<int, DocumentData> documents_;
-    std::vector<int> document_ids_;
-    
-    std::map<int, std::map<std::string_view, double>> docs_term_freqs_;
-    std::map<std::string_view, double> empty_map_;
+    using DocumentLocations = std::unordered_map<int, DocumentLocation>;
+
+    // Segments in the order their documents were added. None of them is without live documents
+    struct Snapshot {
+        std::vector<PublishedSegment> segments;
+        // Every live document by id, so finding one costs two hash lookups at most, however many
+        // segments there are. locations is shared by many snapshots; recent_locations holds the
+        // changes since it was built and overrides it. Only recent_locations is copied by a
+        // publish, and it is folded into a new locations once it outgrows the square root of it
+        std::shared_ptr<const DocumentLocations> locations = std::make_shared<const DocumentLocations>();
+        std::shared_ptr<const DocumentLocations> recent_locations = std::make_shared<const DocumentLocations>();
+        // Live documents only
+        size_t document_count = 0;
+        // State::corpus_version when published; merges and re-encoding do not change results
+        uint64_t corpus_version = 0;
+    };
+
+    // Everything writers share with the background merge thread. It lives on the heap, so
+    // the server can be moved while a merge runs; the destructor stops the thread first
+    struct State {
+        // Read with std::atomic_load and replaced with std::atomic_store, so every call takes
+        // one copy and keeps the pool alive until it returns
+        std::shared_ptr<ThreadPool> thread_pool = ThreadPool::GetDefault();
+        // Backs the segments and stop words loaded by OpenIndex
+        std::shared_ptr<const MappedFile> mapped_file;
+        // Every word segments refer to is stored here once and never released. Its ids are the
+        // ones queries resolve words to and segments map to their own terms.
+        // Stop words are interned first, so they take ids [0, stop_word_count_).
+        // Known limitation: words that only removed documents had are kept too, as MatchDocument
+        // hands out views into them that stay valid as long as the server. A server whose
+        // vocabulary keeps changing grows by every distinct word it was ever given
+        TermDictionary terms;
+        // Queries read terms under a shared lock; writers, who already hold update_mutex,
+        // take it exclusively to intern words
+        std::shared_mutex terms_mutex;
+        PostingCodec codec = PostingCodec::RAW;
+        bool impact_ordered = false;
+        bool positional = false;
+        // Bumped by every update that can change query results
+        uint64_t corpus_version = 0;
+        // Read with std::atomic_load and replaced with std::atomic_store, so readers never wait for a writer
+        std::shared_ptr<const Snapshot> snapshot = std::make_shared<const Snapshot>();
+
+        // Serialises updates and the installation of merged segments
+        std::mutex update_mutex;
+        std::condition_variable merge_state_changed;
+        // The published segments have a merge to do
+        bool merge_requested = false;
+        bool merging = false;
+        bool stopping = false;
+        // Started with the first merge
+        std::thread merge_thread;
+
+        ~State();
+    };
+    std::unique_ptr<State> state_ = std::make_unique<State>();
+    size_t stop_word_count_ = 0;
+    // The stop words, never modified after construction. Queries tell them by their ids in
+    // the state's terms; these are what an index file keeps
+    TermDictionary stop_words_;
+    // nullptr unless SetResultCacheCapacity turned it on. Read with std::atomic_load and
+    // replaced with std::atomic_store, as snapshots are, so queries can run meanwhile
+    std::shared_ptr<QueryResultCache> result_cache_;
 
 
-    bool IsStopWord(const std::string_view word) const;
+    std::shared_ptr<const Snapshot> GetSnapshot() const;
+    // Publishes the segments as the new snapshot and wakes the merge thread if they need a merge.
+    // Segments that are not in the current snapshot get their live documents located; the ones
+    // they replace must have no live documents besides those. Documents deleted from segments
+    // that stay are passed as removed_ids. The update mutex must be held
+    static void Publish(State& state, std::vector<PublishedSegment> segments, const std::vector<int>& removed_ids = {});
+    // Publish for writers: waits for the merges while there are too many segments
+    void PublishUpdate(std::unique_lock<std::mutex>& lock, std::vector<PublishedSegment> segments,
+                       const std::vector<int>& removed_ids = {});
+    // The run of segments the merge policy wants merged or purged next; empty when there is none
+    static std::pair<size_t, size_t> FindMerge(const std::vector<PublishedSegment>& segments);
+    static void RunMerges(State& state);
+    // A null segment when the snapshot has no live document with the id
+    static DocumentLocation FindDocument(const Snapshot& snapshot, int document_id);
+    // The segment without its deleted documents
+    static std::shared_ptr<const Segment> Purge(State& state, const PublishedSegment& segment);
+
+    bool IsStopWord(TermId term) const;
     static bool IsValidWord(const std::string_view word);
 
-    std::vector<std::string_view> SplitIntoWordsNoStop(const std::string_view text) const;
+    // Non-stop words of the text with their counts; the views point into the state's terms
+    std::vector<WordCount> CountWordsNoStop(const std::string_view text);
+    void AddDocumentText(int document_id, const std::string_view document, DocumentStatus status, const std::vector<int>& ratings, bool is_external);
 
     static int ComputeAverageRating(const std::vector<int>& ratings);
 
     struct QueryWord {
-        std::string_view data;
+        // The server's id of the word, TermDictionary::NO_TERM if no document ever had it
+        TermId term;
         bool is_minus;
         bool is_stop;
     };
 
+    // The caller holds State::terms_mutex
     QueryWord ParseQueryWord(const std::string_view text) const;
 
+    // Non-stop words of a quoted phrase in order; they are plus words of the query as well
+    struct Phrase {
+        std::vector<TermId> terms;
+        // Position of every word in the phrase, stop words included
+        std::vector<uint32_t> offsets;
+        // How many more positions the words may span in a document than in the phrase
+        uint32_t slop = 0;
+    };
+
+    // Words are resolved to the server's ids once, segments map the ids to their own terms.
+    // Words no document had when the query was parsed are TermDictionary::NO_TERM, which
+    // sorts last and matches nothing
     struct Query {
-        std::vector<std::string_view> plus_words;
-        std::vector<std::string_view> minus_words;
+        std::vector<TermId> plus_terms;
+        std::vector<TermId> minus_terms;
+        std::vector<Phrase> phrases;
+        // Whether a word is TermDictionary::NO_TERM; documents added later may have it
+        bool has_unknown_words = false;
     };
 
+    // Words no document of the snapshot has are unknown, so the snapshot is taken first
     Query ParseQuery(bool flag, const std::string_view text) const;
+    // Overwrites result, reusing its buffers
+    void ParseQuery(bool flag, const std::string_view text, Query& result) const;
 
-    // Existence required
-    double ComputeWordInverseDocumentFreq(const std::string_view word) const;
+    struct QueryTerm {
+        // The segment's id of the word
+        TermId term;
+        const PostingList* postings;
+        double inverse_document_freq;
+        // Position of the word in the query; relevance is summed in this order
+        size_t word_index;
+    };
 
-    //Sequenced policy FindAllDocuments
+    struct SegmentPhrase {
+        // The segment's ids of the phrase's words
+        std::vector<TermId> terms;
+        std::vector<uint32_t> offsets;
+        uint32_t slop;
+        // terms sorted and without repeats, as positions are decoded; terms[i] is distinct_terms[term_slots[i]]
+        std::vector<TermId> distinct_terms;
+        std::vector<size_t> term_slots;
+        // Sum over the words, it weighs the phrase's occurrences
+        double inverse_document_freq;
+    };
+
+    // Buffers of phrase matching, reused from one document to the next
+    struct PhraseScratch {
+        std::vector<std::vector<uint32_t>> positions;
+        std::vector<const std::vector<uint32_t>*> word_positions;
+        std::vector<size_t> cursors;
+    };
+
+    // The part of a query one segment can answer. Inverse document frequencies are
+    // computed over the whole snapshot, so the segments score exactly like one index
+    struct SegmentQuery {
+        const Segment* segment;
+        // Postings still list deleted documents, so scoring skips them
+        const DeletedDocuments* deleted;
+        std::vector<QueryTerm> plus_terms;
+        std::vector<const PostingList*> minus_postings;
+        std::vector<SegmentPhrase> phrases;
+        // The shortest postings of a phrase word; only their documents can have every phrase
+        const PostingList* phrase_postings = nullptr;
+        // Whether the segment has every plus word, which conjunctive queries need
+        bool has_every_plus_word = false;
+
+        bool IsDeleted(uint32_t ordinal) const {
+            return deleted != nullptr && deleted->IsDeleted(ordinal);
+        }
+    };
+
+    // A posting list walked by FindTopDocumentsPruned. Cursors are reordered on every step,
+    // so they stay small and point to posting cursors kept apart
+    struct WandCursor {
+        PostingCursor* postings;
+        uint32_t ordinal;
+        // Position of the word in SegmentQuery::plus_terms, which is query word order
+        size_t term_index;
+        double inverse_document_freq;
+        double upper_bound;
+    };
+
+    // An impact block of FindTopDocumentsByImpact with its value
+    struct ImpactBlock {
+        double score;
+        // Value of the next block of the same word, 0 after its last one
+        double next_score;
+        const ImpactIndex::Block* block;
+        // Among the blocks of the query, which ties keep in order
+        size_t position;
+    };
+
+    // Buffers of the sequential scoring loops, lent per thread by ThreadScratch so that queries
+    // do not allocate once the buffers have grown. Every loop resets what it uses
+    struct ScoringScratch {
+        // A cursor keeps the decode buffer of compressed lists; vectors of them are never
+        // shrunk, so only their first cursors belong to the current query
+        PostingCursor cursor;
+        std::vector<PostingCursor> plus_cursors;
+        std::vector<PostingCursor> minus_cursors;
+        std::vector<WandCursor> wand_cursors;
+        // Indexed like SegmentQuery::plus_terms, zero but while a document is scored
+        std::vector<double> term_scores;
+        std::vector<double> relevances;
+        std::vector<bool> is_scored;
+        std::vector<uint32_t> scored_ordinals;
+        std::vector<ImpactBlock> impact_blocks;
+        std::vector<uint8_t> document_states;
+        std::vector<double> top_scores;
+        std::vector<const PostingList*> postings;
+        std::vector<int> candidates;
+        PhraseScratch phrase;
+    };
+
+    // A share of one plus word's postings that the parallel FindAllDocuments scores as one task
+    struct PostingRange {
+        size_t segment_index;
+        const PostingList* postings;
+        double inverse_document_freq;
+        size_t first_block;
+        size_t last_block;
+    };
+
+    // Buffers of the parallel and partitioned queries, lent by ThreadScratch to the thread
+    // that runs the query; the tasks on the pool take ScoringScratch of their own
+    struct ParallelScratch {
+        // Never shrunk, so only the first ones belong to the current query
+        std::vector<TopDocuments> partial_tops;
+        std::vector<ConcurrentScoreTable> score_tables;
+        std::vector<std::pair<const SegmentQuery*, uint32_t>> ordinal_ranges;
+        std::vector<PostingRange> posting_ranges;
+        std::vector<std::pair<size_t, const PostingList*>> minus_postings;
+        std::vector<std::pair<size_t, size_t>> slot_ranges;
+    };
+    // Empties the first count tops with room for max_count documents each, adding tops if there are fewer
+    static void ResetTops(std::vector<TopDocuments>& tops, size_t count, size_t max_count);
+
+    // Segments without any plus word of the query, or without the words of one of its phrases, are left out.
+    // segment_queries is overwritten; its buffers, and those of the segments left out, are reused
+    static void ResolveQuery(const Snapshot& snapshot, const Query& query, std::vector<SegmentQuery>& segment_queries);
+    static std::vector<SegmentQuery> ResolveQuery(const Snapshot& snapshot, const Query& query);
+    // Ascending ordinals in [first_ordinal, last_ordinal) of the documents with every plus word and
+    // no minus word of a conjunctive query, deleted ones included. They are left in scratch.candidates
+    static void IntersectPostings(const SegmentQuery& query, uint32_t first_ordinal, uint32_t last_ordinal, ScoringScratch& scratch);
+    // Overwrites result, reusing its buffers; false if the segment lacks one of the words.
+    // Throws invalid_argument if the segment has no positions
+    static bool ResolvePhrase(const Segment& segment, const Phrase& phrase, SegmentPhrase& result);
+    // Weighted occurrences of the phrase (see CountPhraseOccurrences) per word of the document
+    static double ScorePhrase(const Segment& segment, uint32_t ordinal, const SegmentPhrase& phrase, PhraseScratch& scratch);
+    // Whether every phrase occurs in the document
+    static bool HasPhrases(const Segment& segment, uint32_t ordinal, const std::vector<Phrase>& phrases);
+    // Whether one of the first count cursors, which only move forward, has a posting of the ordinal
+    static bool HasPosting(std::vector<PostingCursor>& cursors, size_t count, uint32_t ordinal);
+    // The first postings.size() cursors, walking the postings from first_ordinal on
+    static void ResetCursors(std::vector<PostingCursor>& cursors, const std::vector<const PostingList*>& postings, uint32_t first_ordinal);
+
+    // Words of a query as one segment's terms, sorted and without repeats; the words no
+    // document of the segment has are left out
+    struct MatchTerms {
+        std::vector<TermId> plus_terms;
+        std::vector<TermId> minus_terms;
+    };
+    static MatchTerms ResolveMatchTerms(const Segment& segment, const Query& query, bool is_parallel);
+    // MatchDocuments of a query parsed once the snapshot was taken
+    std::vector<std::tuple<std::vector<std::string_view>, DocumentStatus>> MatchQuery(const Snapshot& snapshot, const Query& query,
+                                                                                      const std::vector<int>& document_ids) const;
+    // The plus words of the document as sorted views into the segment, none if it has a minus word
+    // or lacks a phrase. The terms are merged with the document's forward index
+    static std::vector<std::string_view> MatchOrdinal(const Segment& segment, uint32_t ordinal, const Query& query, const MatchTerms& terms);
+
+    // Filters of the scoring loops: they are given a segment and a document ordinal and
+    // tell whether the document may be returned
     template <typename DocumentPredicate>
-    std::vector<Document> FindAllDocuments(const Query& query,
-        DocumentPredicate document_predicate) const {
-        std::map<int, double> document_to_relevance;
-        for (const auto word : query.plus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
+    struct PredicateFilter {
+        DocumentPredicate document_predicate;
+
+        bool operator()(const Segment& segment, uint32_t ordinal) {
+            return document_predicate(segment.GetDocumentId(ordinal), segment.GetStatus(ordinal), segment.GetRating(ordinal));
+        }
+        // Appends the filter's part of the result cache key; false when the call must not be cached
+        bool AppendCacheKey(const SearchOptions& options, std::string& key) const {
+            if (!options.predicate_id) {
+                return false;
+            }
+            key.push_back('p');
+            AppendCacheKeyNumber(*options.predicate_id, key);
+            return true;
+        }
+    };
+
+    struct StatusFilter {
+        DocumentStatus status;
+
+        bool operator()(const Segment& segment, uint32_t ordinal) const {
+            return segment.HasStatus(ordinal, status);
+        }
+        bool AppendCacheKey(const SearchOptions&, std::string& key) const {
+            key.push_back('s');
+            AppendCacheKeyNumber(static_cast<uint64_t>(status), key);
+            return true;
+        }
+    };
+
+    static void AppendCacheKeyNumber(uint64_t value, std::string& key);
+    // Appends to the filter's part of the key the words of the query and the options that change results
+    static void AppendResultCacheKey(const Query& query, const SearchOptions& options, std::string& key);
+
+public:
+    // A query parsed once and resolved against the documents current when it was compiled, see
+    // CompileQuery. It keeps their segments alive, so a long-lived query pins memory merges would
+    // free; once documents are added or removed, searches resolve its words against the current ones
+    class CompiledQuery {
+    public:
+        CompiledQuery() = default;
+        // The resolved segment queries are not worth copying
+        CompiledQuery(const CompiledQuery&) = delete;
+        CompiledQuery& operator=(const CompiledQuery&) = delete;
+        CompiledQuery(CompiledQuery&&) = default;
+        CompiledQuery& operator=(CompiledQuery&&) = default;
+
+    private:
+        friend class SearchServer;
+
+        // Parsed again once documents that may have its unknown words are added
+        std::vector<char> text_;
+        Query query_;
+        std::shared_ptr<const Snapshot> snapshot_;
+        std::vector<SegmentQuery> segment_queries_;
+    };
+
+private:
+    // The compiled query as it would parse against the snapshot: its words are resolved again
+    // if some were unknown and documents were added or removed since. scratch keeps that parse
+    const Query& GetCurrentQuery(const CompiledQuery& query, const Snapshot& snapshot, Query& scratch) const;
+
+    // search(query, segment_queries, result) unless the result cache has its result for the snapshot's
+    // corpus version. segment_queries is the query resolved against the snapshot, resolved here when null
+    template <typename DocumentFilter, typename Search>
+    void FindTopDocumentsCached(const Snapshot& snapshot, const Query& query, const std::vector<SegmentQuery>* segment_queries,
+                                const DocumentFilter& document_filter, const SearchOptions& options, std::vector<Document>& result,
+                                Search search) const {
+        const auto run_search = [&](std::vector<Document>& documents) {
+            if (segment_queries != nullptr) {
+                search(query, *segment_queries, documents);
+                return;
+            }
+            ThreadScratch<std::vector<SegmentQuery>> resolved;
+            ResolveQuery(snapshot, query, *resolved);
+            search(query, *resolved, documents);
+        };
+        const auto result_cache = std::atomic_load(&result_cache_);
+        if (result_cache == nullptr) {
+            run_search(result);
+            return;
+        }
+        ThreadScratch<std::string> key;
+        key->clear();
+        if (!document_filter.AppendCacheKey(options, *key)) {
+            run_search(result);
+            return;
+        }
+        AppendResultCacheKey(query, options, *key);
+        result_cache->GetOrCompute(*key, snapshot.corpus_version, result, run_search);
+    }
+
+    template <typename DocumentFilter, typename Search>
+    void FindTopDocumentsCached(const std::string_view raw_query, const DocumentFilter& document_filter,
+                                const SearchOptions& options, std::vector<Document>& result, Search search) const {
+        const auto snapshot = GetSnapshot();
+        ThreadScratch<Query> query;
+        ParseQuery(true, raw_query, *query);
+        FindTopDocumentsCached(*snapshot, *query, nullptr, document_filter, options, result, search);
+    }
+
+    // Searches the snapshot the query was compiled against while the corpus has not changed
+    // since; merges publish new snapshots, but with the same results
+    template <typename DocumentFilter, typename Search>
+    void FindTopDocumentsCached(const CompiledQuery& query, const DocumentFilter& document_filter,
+                                const SearchOptions& options, std::vector<Document>& result, Search search) const {
+        const auto snapshot = GetSnapshot();
+        if (query.snapshot_ != nullptr && query.snapshot_->corpus_version == snapshot->corpus_version) {
+            FindTopDocumentsCached(*query.snapshot_, query.query_, &query.segment_queries_, document_filter, options, result, search);
+            return;
+        }
+        ThreadScratch<Query> scratch;
+        FindTopDocumentsCached(*snapshot, GetCurrentQuery(query, *snapshot, *scratch), nullptr, document_filter, options, result, search);
+    }
+
+    // QueryText is a std::string_view of the raw query or a CompiledQuery; result is overwritten
+    template <typename QueryText, typename DocumentFilter>
+    void FindTopDocumentsFiltered(const QueryText& query_text, DocumentFilter document_filter, const SearchOptions& options,
+                                  std::vector<Document>& result) const {
+        FindTopDocumentsCached(query_text, document_filter, options, result,
+                               [&](const Query&, const std::vector<SegmentQuery>& query, std::vector<Document>& documents) {
+            FindTopDocumentsResolved(query, document_filter, options, documents);
+        });
+    }
+
+    template <typename DocumentFilter>
+    void FindTopDocumentsResolved(const std::vector<SegmentQuery>& query, DocumentFilter document_filter, const SearchOptions& options,
+                                  std::vector<Document>& result) const {
+        ThreadScratch<TopDocuments> top_documents;
+        top_documents->Reset(options.max_result_count);
+        for (const SegmentQuery& segment_query : query) {
+            FindSegmentDocuments(segment_query, document_filter, options, *top_documents);
+        }
+        top_documents->Release(result);
+    }
+
+    // Picks the evaluator of one segment from the query and the options, for the documents
+    // with ordinals in [first_ordinal, last_ordinal)
+    template <typename DocumentFilter>
+    void FindSegmentDocuments(const SegmentQuery& segment_query, DocumentFilter document_filter, const SearchOptions& options,
+                              TopDocuments& top_documents, uint32_t first_ordinal = 0, uint32_t last_ordinal = Segment::NO_ORDINAL) const {
+        if (options.conjunctive) {
+            FindConjunctiveDocuments(segment_query, document_filter, top_documents, first_ordinal, last_ordinal);
+        } else if (!segment_query.phrases.empty()) {
+            FindPhraseDocuments(segment_query, document_filter, top_documents, first_ordinal, last_ordinal);
+        } else if (options.impact_ordered && segment_query.segment->GetImpacts() != nullptr) {
+            FindTopDocumentsByImpact(segment_query, document_filter, top_documents, first_ordinal, last_ordinal);
+        } else if (options.dynamic_pruning) {
+            FindTopDocumentsPruned(segment_query, document_filter, top_documents, first_ordinal, last_ordinal);
+        } else {
+            FindAllDocuments(segment_query, document_filter, top_documents, first_ordinal, last_ordinal);
+        }
+    }
+
+    template <typename QueryText, typename DocumentFilter>
+    void FindTopDocumentsFiltered(const std::execution::parallel_policy&, const QueryText& query_text, DocumentFilter document_filter,
+                                  const SearchOptions& options, std::vector<Document>& result) const {
+        FindTopDocumentsCached(query_text, document_filter, options, result,
+                               [&](const Query& parsed_query, const std::vector<SegmentQuery>& query, std::vector<Document>& documents) {
+            ThreadScratch<TopDocuments> top_documents;
+            top_documents->Reset(options.max_result_count);
+            if (options.conjunctive) {
+                FindDocumentsByRange(query, *top_documents, [&](const SegmentQuery& segment_query, TopDocuments& range_top,
+                                                                uint32_t first_ordinal, uint32_t last_ordinal) {
+                    FindConjunctiveDocuments(segment_query, document_filter, range_top, first_ordinal, last_ordinal);
+                });
+            } else if (!parsed_query.phrases.empty()) {
+                FindDocumentsByRange(query, *top_documents, [&](const SegmentQuery& segment_query, TopDocuments& range_top,
+                                                                uint32_t first_ordinal, uint32_t last_ordinal) {
+                    FindPhraseDocuments(segment_query, document_filter, range_top, first_ordinal, last_ordinal);
+                });
+            } else {
+                FindAllDocuments(std::execution::par, query, document_filter, *top_documents);
+            }
+            top_documents->Release(documents);
+        });
+    }
+
+    template <typename QueryText, typename DocumentFilter>
+    void FindTopDocumentsFiltered(const PartitionedExecution& execution, const QueryText& query_text, DocumentFilter document_filter,
+                                  const SearchOptions& options, std::vector<Document>& result) const {
+        FindTopDocumentsCached(query_text, document_filter, options, result,
+                               [&](const Query&, const std::vector<SegmentQuery>& query, std::vector<Document>& documents) {
+            FindTopDocumentsResolved(execution, query, document_filter, options, documents);
+        });
+    }
+
+    template <typename DocumentFilter>
+    void FindTopDocumentsResolved(const PartitionedExecution& execution, const std::vector<SegmentQuery>& query, DocumentFilter document_filter,
+                                  const SearchOptions& options, std::vector<Document>& result) const {
+        result.clear();
+        if (query.empty()) {
+            return;
+        }
+
+        // Every shard takes the same share of every segment's ordinals, so the shards get
+        // even work however the ids are spread
+        size_t max_document_count = 0;
+        for (const SegmentQuery& segment_query : query) {
+            max_document_count = std::max(max_document_count, segment_query.segment->GetDocumentCount());
+        }
+        const size_t shard_count = std::max<size_t>(1, std::min(execution.shard_count, max_document_count));
+        ThreadScratch<ParallelScratch> scratch;
+        std::vector<TopDocuments>& shard_tops = scratch->partial_tops;
+        ResetTops(shard_tops, shard_count, options.max_result_count);
+        GetThreadPool()->ParallelFor(shard_count, [&](const size_t shard) {
+            for (const SegmentQuery& segment_query : query) {
+                const size_t document_count = segment_query.segment->GetDocumentCount();
+                const auto first_ordinal = static_cast<uint32_t>(document_count * shard / shard_count);
+                const auto last_ordinal = static_cast<uint32_t>(document_count * (shard + 1) / shard_count);
+                FindSegmentDocuments(segment_query, document_filter, options, shard_tops[shard], first_ordinal, last_ordinal);
+            }
+        });
+        for (size_t shard = 1; shard < shard_count; ++shard) {
+            shard_tops[0].Merge(shard_tops[shard]);
+        }
+        shard_tops[0].Release(result);
+    }
+
+    //Sequenced policy FindAllDocuments
+    // Only documents with ordinals in [first_ordinal, last_ordinal) are considered
+    template <typename DocumentFilter>
+    void FindAllDocuments(const SegmentQuery& query,
+        DocumentFilter document_filter, TopDocuments& top_documents,
+        uint32_t first_ordinal = 0, uint32_t last_ordinal = Segment::NO_ORDINAL) const {
+        const Segment& segment = *query.segment;
+        last_ordinal = std::min(last_ordinal, static_cast<uint32_t>(segment.GetDocumentCount()));
+        if (first_ordinal >= last_ordinal) {
+            return;
+        }
+        ThreadScratch<ScoringScratch> scratch;
+        // Accumulators are indexed by ordinal - first_ordinal; a document with relevance 0 is still a match
+        std::vector<double>& relevances = scratch->relevances;
+        std::vector<bool>& is_scored = scratch->is_scored;
+        std::vector<uint32_t>& scored_slots = scratch->scored_ordinals;
+        relevances.assign(last_ordinal - first_ordinal, 0.0);
+        is_scored.assign(last_ordinal - first_ordinal, false);
+        scored_slots.clear();
+        PostingCursor& cursor = scratch->cursor;
+        for (const QueryTerm& term : query.plus_terms) {
+            cursor.Reset(*term.postings);
+            for (cursor.Seek(first_ordinal); !cursor.AtEnd() && static_cast<uint32_t>(cursor.GetDocumentId()) < last_ordinal; cursor.Next()) {
+                const uint32_t ordinal = cursor.GetDocumentId();
+                if (!query.IsDeleted(ordinal) && document_filter(segment, ordinal)) {
+                    const uint32_t slot = ordinal - first_ordinal;
+                    if (!is_scored[slot]) {
+                        is_scored[slot] = true;
+                        scored_slots.push_back(slot);
+                    }
+                    relevances[slot] += cursor.GetTermFreq() * term.inverse_document_freq;
+                }
+            }
+        }
+
+        for (const PostingList* postings : query.minus_postings) {
+            cursor.Reset(*postings);
+            for (cursor.Seek(first_ordinal); !cursor.AtEnd() && static_cast<uint32_t>(cursor.GetDocumentId()) < last_ordinal; cursor.Next()) {
+                is_scored[cursor.GetDocumentId() - first_ordinal] = false;
+            }
+        }
+
+        for (const uint32_t slot : scored_slots) {
+            if (is_scored[slot]) {
+                const uint32_t ordinal = first_ordinal + slot;
+                top_documents.Push({ segment.GetDocumentId(ordinal), relevances[slot], segment.GetRating(ordinal) });
+            }
+        }
+    }
+
+
+    // Document-at-a-time block-max WAND: a document is scored only when the upper bounds of the
+    // words it may contain can beat the weakest document of the current top, first the bounds of
+    // whole lists, which pick the pivot, then those of the blocks the pivot is in, which skip
+    // blocks of documents at once. Relevance is summed in query word order, as FindAllDocuments
+    // does, so both paths produce the same numbers. Only documents with ordinals in
+    // [first_ordinal, last_ordinal) are considered
+    template <typename DocumentFilter>
+    void FindTopDocumentsPruned(const SegmentQuery& query, DocumentFilter document_filter, TopDocuments& top_documents,
+                                uint32_t first_ordinal = 0, uint32_t last_ordinal = Segment::NO_ORDINAL) const {
+        const auto advance = [last_ordinal](WandCursor& cursor, uint32_t ordinal) {
+            cursor.postings->Seek(ordinal);
+            cursor.ordinal = !cursor.postings->AtEnd() && static_cast<uint32_t>(cursor.postings->GetDocumentId()) < last_ordinal
+                ? cursor.postings->GetDocumentId() : Segment::NO_ORDINAL;
+        };
+
+        ThreadScratch<ScoringScratch> scratch;
+        std::vector<PostingCursor>& posting_cursors = scratch->plus_cursors;
+        if (posting_cursors.size() < query.plus_terms.size()) {
+            posting_cursors.resize(query.plus_terms.size());
+        }
+        std::vector<WandCursor>& cursors = scratch->wand_cursors;
+        cursors.clear();
+        for (size_t i = 0; i < query.plus_terms.size(); ++i) {
+            const QueryTerm& term = query.plus_terms[i];
+            posting_cursors[i].Reset(*term.postings);
+            WandCursor cursor{ &posting_cursors[i], 0, i, term.inverse_document_freq,
+                               term.postings->max_term_freq * term.inverse_document_freq };
+            advance(cursor, first_ordinal);
+            if (cursor.ordinal != Segment::NO_ORDINAL) {
+                cursors.push_back(cursor);
+            }
+        }
+        std::vector<PostingCursor>& minus_cursors = scratch->minus_cursors;
+        ResetCursors(minus_cursors, query.minus_postings, first_ordinal);
+        const size_t minus_count = query.minus_postings.size();
+        std::vector<double>& term_scores = scratch->term_scores;
+        term_scores.assign(query.plus_terms.size(), 0.0);
+
+        // Cursors are kept ordered by current document. A cursor that moved is only ever
+        // too early in the order, so one pass towards the back puts it in place
+        const auto move_back = [&cursors](size_t i) {
+            for (; i + 1 < cursors.size() && cursors[i + 1].ordinal < cursors[i].ordinal; ++i) {
+                std::swap(cursors[i], cursors[i + 1]);
+            }
+        };
+        std::sort(cursors.begin(), cursors.end(), [](const WandCursor& lhs, const WandCursor& rhs) {
+            return lhs.ordinal < rhs.ordinal;
+        });
+
+        while (!cursors.empty()) {
+            const double threshold = top_documents.GetRelevanceThreshold();
+            double bound = 0.0;
+            size_t pivot = 0;
+            for (; pivot < cursors.size(); ++pivot) {
+                bound += cursors[pivot].upper_bound;
+                if (bound > threshold) {
+                    break;
+                }
+            }
+            if (pivot == cursors.size()) {
+                break;
+            }
+
+            const uint32_t pivot_ordinal = cursors[pivot].ordinal;
+            if (cursors.front().ordinal != pivot_ordinal) {
+                // The rarest word among those behind the pivot moves up to it
+                size_t lagging = 0;
+                for (size_t i = 1; i < pivot; ++i) {
+                    if (cursors[i].ordinal < pivot_ordinal && cursors[i].inverse_document_freq > cursors[lagging].inverse_document_freq) {
+                        lagging = i;
+                    }
+                }
+                advance(cursors[lagging], pivot_ordinal);
+                move_back(lagging);
+            } else {
+                // Until the first of their blocks ends, the documents have no other word than those
+                // of the cursors on the pivot, and the blocks' bounds hold for all of them
+                size_t matched = 0;
+                double block_bound = 0.0;
+                uint32_t next_ordinal = Segment::NO_ORDINAL;
+                for (; matched < cursors.size() && cursors[matched].ordinal == pivot_ordinal; ++matched) {
+                    const PostingCursor& postings = *cursors[matched].postings;
+                    block_bound += postings.GetBlockMaxTermFreq() * cursors[matched].inverse_document_freq;
+                    next_ordinal = std::min(next_ordinal, static_cast<uint32_t>(postings.GetBlockLastDocumentId()) + 1);
+                }
+                if (matched < cursors.size()) {
+                    next_ordinal = std::min(next_ordinal, cursors[matched].ordinal);
+                }
+                if (block_bound > threshold) {
+                    next_ordinal = pivot_ordinal + 1;
+                    if (!query.IsDeleted(pivot_ordinal) && !HasPosting(minus_cursors, minus_count, pivot_ordinal)
+                        && document_filter(*query.segment, pivot_ordinal)) {
+                        for (size_t i = 0; i < matched; ++i) {
+                            term_scores[cursors[i].term_index] = cursors[i].postings->GetTermFreq() * cursors[i].inverse_document_freq;
+                        }
+                        // Adding the zeros of the other words leaves the sum exact
+                        double relevance = 0.0;
+                        for (double& term_score : term_scores) {
+                            relevance += term_score;
+                            term_score = 0.0;
+                        }
+                        top_documents.Push({ query.segment->GetDocumentId(pivot_ordinal), relevance, query.segment->GetRating(pivot_ordinal) });
+                    }
+                }
+                // The last cursor goes first, so each one moves into a tail that is in order
+                for (size_t i = matched; i-- > 0;) {
+                    advance(cursors[i], next_ordinal);
+                    move_back(i);
+                }
+            }
+            while (!cursors.empty() && cursors.back().ordinal == Segment::NO_ORDINAL) {
+                cursors.pop_back();
+            }
+        }
+    }
+
+    // Score-at-a-time over the impact blocks of the query words, see SearchOptions::impact_ordered.
+    // A block adds level * step to each of its documents, where step is the word's
+    // max_term_freq * idf / MAX_LEVEL, and blocks are taken in decreasing value of that.
+    // remaining bounds what any document can still gain: the value of every word's next block.
+    // Only documents with ordinals in [first_ordinal, last_ordinal) are considered; the blocks
+    // are not sorted by ordinal, so the postings of the others are read and skipped
+    template <typename DocumentFilter>
+    void FindTopDocumentsByImpact(const SegmentQuery& query, DocumentFilter document_filter, TopDocuments& top_documents,
+                                  uint32_t first_ordinal = 0, uint32_t last_ordinal = Segment::NO_ORDINAL) const {
+        const Segment& segment = *query.segment;
+        const ImpactIndex& impacts = *segment.GetImpacts();
+        const size_t max_count = top_documents.GetMaxCount();
+        last_ordinal = std::min(last_ordinal, static_cast<uint32_t>(segment.GetDocumentCount()));
+        if (max_count == 0 || first_ordinal >= last_ordinal) {
+            return;
+        }
+        // Per-document state is indexed by slot, ordinal - first_ordinal
+        const uint32_t slot_count = last_ordinal - first_ordinal;
+
+        ThreadScratch<ScoringScratch> scratch;
+        std::vector<ImpactBlock>& blocks = scratch->impact_blocks;
+        blocks.clear();
+        double remaining = 0.0;
+        for (const QueryTerm& term : query.plus_terms) {
+            const double step = term.postings->max_term_freq * term.inverse_document_freq / ImpactIndex::MAX_LEVEL;
+            const ImpactIndex::Block* first = impacts.GetBlocksBegin(term.term);
+            const ImpactIndex::Block* last = impacts.GetBlocksEnd(term.term);
+            for (const ImpactIndex::Block* block = first; block != last; ++block) {
+                blocks.push_back({ block->level * step, block + 1 != last ? block[1].level * step : 0.0, block, blocks.size() });
+            }
+            if (first != last) {
+                remaining += first->level * step;
+            }
+        }
+        // Levels of a word decrease, so the sort keeps its blocks in order. Unlike
+        // stable_sort, sort needs no buffer of its own
+        std::sort(blocks.begin(), blocks.end(), [](const ImpactBlock& lhs, const ImpactBlock& rhs) {
+            return lhs.score != rhs.score ? lhs.score > rhs.score : lhs.position < rhs.position;
+        });
+
+        // Whether a document may be returned is decided once: 0 not yet, 1 yes, 2 no
+        enum : uint8_t { UNKNOWN, ALLOWED, EXCLUDED };
+        std::vector<uint8_t>& document_states = scratch->document_states;
+        document_states.assign(slot_count, UNKNOWN);
+        PostingCursor& cursor = scratch->cursor;
+        for (const PostingList* postings : query.minus_postings) {
+            cursor.Reset(*postings);
+            for (cursor.Seek(first_ordinal); !cursor.AtEnd() && static_cast<uint32_t>(cursor.GetDocumentId()) < last_ordinal; cursor.Next()) {
+                document_states[cursor.GetDocumentId() - first_ordinal] = EXCLUDED;
+            }
+        }
+        std::vector<double>& scores = scratch->relevances;
+        scores.assign(slot_count, 0.0);
+        std::vector<uint32_t>& scored_slots = scratch->scored_ordinals;
+        scored_slots.clear();
+        std::vector<double>& top_scores = scratch->top_scores;
+        // Scores only grow, so a past k-th best score stays a lower bound of the current one.
+        // Documents that cannot beat the current top either need not be looked at
+        double threshold = top_documents.GetRelevanceThreshold();
+        const auto update_threshold = [&] {
+            if (scored_slots.size() < max_count) {
+                return;
+            }
+            top_scores.clear();
+            for (const uint32_t slot : scored_slots) {
+                top_scores.push_back(scores[slot]);
+            }
+            std::nth_element(top_scores.begin(), top_scores.begin() + (max_count - 1), top_scores.end(), std::greater<>());
+            threshold = std::max(threshold, top_scores[max_count - 1]);
+        };
+
+        size_t remaining_posting_count = 0;
+        for (const ImpactBlock& block : blocks) {
+            remaining_posting_count += block.block->last - block.block->first;
+        }
+        // Once nothing new can reach the threshold, only the documents already scored keep
+        // collecting their postings, and those that cannot reach it any more are dropped.
+        // The walk ends when rescoring the rest is cheaper than reading the remaining postings
+        const auto drop_hopeless = [&] {
+            scored_slots.erase(std::remove_if(scored_slots.begin(), scored_slots.end(), [&](uint32_t slot) {
+                if (scores[slot] + remaining < threshold) {
+                    document_states[slot] = EXCLUDED;
+                    return true;
+                }
+                return false;
+            }), scored_slots.end());
+        };
+        const uint32_t* ordinals = impacts.GetOrdinals();
+        size_t scored_posting_count = 0;
+        size_t next_update = 1024;
+        size_t block_index = 0;
+        for (; block_index < blocks.size(); ++block_index) {
+            const bool is_closed = remaining <= threshold;
+            if (is_closed && scored_slots.size() * query.plus_terms.size() <= remaining_posting_count) {
+                break;
+            }
+            const ImpactBlock& block = blocks[block_index];
+            for (uint32_t i = block.block->first; i < block.block->last; ++i) {
+                const uint32_t ordinal = ordinals[i];
+                const uint32_t slot = ordinal - first_ordinal;
+                if (slot >= slot_count) {
+                    continue;
+                }
+                uint8_t& state = document_states[slot];
+                if (state == UNKNOWN) {
+                    state = !is_closed && !query.IsDeleted(ordinal) && document_filter(segment, ordinal) ? ALLOWED : EXCLUDED;
+                    if (state == ALLOWED) {
+                        scored_slots.push_back(slot);
+                    }
+                }
+                if (state == ALLOWED) {
+                    scores[slot] += block.score;
+                }
+            }
+            // Kept from going below 0 by rounding, which would drop the k-th best document
+            remaining = std::max(0.0, remaining - (block.score - block.next_score));
+            const size_t block_size = block.block->last - block.block->first;
+            remaining_posting_count -= block_size;
+            scored_posting_count += block_size;
+            if (scored_posting_count >= next_update) {
+                update_threshold();
+                if (remaining <= threshold) {
+                    drop_hopeless();
+                }
+                next_update = 2 * scored_posting_count;
+            }
+        }
+        if (block_index == blocks.size()) {
+            remaining = 0.0;
+        }
+        update_threshold();
+
+        // Documents are rescored from the forward index and in query word order, so their
+        // relevance matches FindAllDocuments. Best scores go first: a score is never below
+        // the exact relevance, so once one cannot beat the top, neither can the rest
+        drop_hopeless();
+        std::sort(scored_slots.begin(), scored_slots.end(), [&scores](uint32_t lhs, uint32_t rhs) {
+            return scores[lhs] > scores[rhs];
+        });
+        for (const uint32_t slot : scored_slots) {
+            if (scores[slot] + remaining <= top_documents.GetRelevanceThreshold()) {
+                break;
+            }
+            const uint32_t ordinal = first_ordinal + slot;
+            double relevance = 0.0;
+            for (const QueryTerm& term : query.plus_terms) {
+                relevance += segment.GetTermFreq(ordinal, term.term) * term.inverse_document_freq;
+            }
+            top_documents.Push({ segment.GetDocumentId(ordinal), relevance, segment.GetRating(ordinal) });
+        }
+    }
+
+    // Queries with phrases only score the documents where every phrase occurs: the candidates come
+    // from the shortest postings of a phrase word and are checked against their positions. Relevance
+    // is summed in query word order, as FindAllDocuments does, then every phrase adds ScorePhrase
+    // times its inverse document frequency. Only documents with ordinals in [first_ordinal, last_ordinal) are considered
+    template <typename DocumentFilter>
+    void FindPhraseDocuments(const SegmentQuery& query, DocumentFilter document_filter, TopDocuments& top_documents,
+                             uint32_t first_ordinal = 0, uint32_t last_ordinal = Segment::NO_ORDINAL) const {
+        const Segment& segment = *query.segment;
+        ThreadScratch<ScoringScratch> scratch;
+        std::vector<PostingCursor>& minus_cursors = scratch->minus_cursors;
+        ResetCursors(minus_cursors, query.minus_postings, first_ordinal);
+        const size_t minus_count = query.minus_postings.size();
+        PostingCursor& cursor = scratch->cursor;
+        cursor.Reset(*query.phrase_postings);
+        for (cursor.Seek(first_ordinal); !cursor.AtEnd() && static_cast<uint32_t>(cursor.GetDocumentId()) < last_ordinal; cursor.Next()) {
+            const uint32_t ordinal = cursor.GetDocumentId();
+            if (query.IsDeleted(ordinal) || !document_filter(segment, ordinal) || HasPosting(minus_cursors, minus_count, ordinal)) {
                 continue;
             }
-            const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
-            for (const auto [document_id, term_freq] : word_to_document_freqs_.at(word)) {
-                const auto& document_data = documents_.at(document_id);
-                if (document_predicate(document_id, document_data.status, document_data.rating)) {
-                    document_to_relevance[document_id] += term_freq * inverse_document_freq;
+            double phrase_relevance = 0.0;
+            bool has_phrases = true;
+            for (const SegmentPhrase& phrase : query.phrases) {
+                const double phrase_score = ScorePhrase(segment, ordinal, phrase, scratch->phrase);
+                if (phrase_score == 0.0) {
+                    has_phrases = false;
+                    break;
                 }
+                phrase_relevance += phrase_score * phrase.inverse_document_freq;
             }
+            if (!has_phrases) {
+                continue;
+            }
+            double relevance = 0.0;
+            for (const QueryTerm& term : query.plus_terms) {
+                relevance += segment.GetTermFreq(ordinal, term.term) * term.inverse_document_freq;
+            }
+            top_documents.Push({ segment.GetDocumentId(ordinal), relevance + phrase_relevance, segment.GetRating(ordinal) });
         }
+    }
 
-        for (const auto word : query.minus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
+    // AND queries only score the documents of IntersectPostings. Relevance is summed in query word
+    // order, then phrases add their score as in FindPhraseDocuments
+    template <typename DocumentFilter>
+    void FindConjunctiveDocuments(const SegmentQuery& query, DocumentFilter document_filter, TopDocuments& top_documents,
+                                  uint32_t first_ordinal = 0, uint32_t last_ordinal = Segment::NO_ORDINAL) const {
+        if (!query.has_every_plus_word) {
+            return;
+        }
+        const Segment& segment = *query.segment;
+        ThreadScratch<ScoringScratch> scratch;
+        IntersectPostings(query, first_ordinal, last_ordinal, *scratch);
+        for (const int candidate : scratch->candidates) {
+            const auto ordinal = static_cast<uint32_t>(candidate);
+            if (query.IsDeleted(ordinal) || !document_filter(segment, ordinal)) {
+                continue;
+            }
+            double phrase_relevance = 0.0;
+            bool has_phrases = true;
+            for (const SegmentPhrase& phrase : query.phrases) {
+                const double phrase_score = ScorePhrase(segment, ordinal, phrase, scratch->phrase);
+                if (phrase_score == 0.0) {
+                    has_phrases = false;
+                    break;
+                }
+                phrase_relevance += phrase_score * phrase.inverse_document_freq;
+            }
+            if (!has_phrases) {
                 continue;
             }
-            for (const auto [document_id, _] : word_to_document_freqs_.at(word)) {
-                document_to_relevance.erase(document_id);
+            double relevance = 0.0;
+            for (const QueryTerm& term : query.plus_terms) {
+                relevance += segment.GetTermFreq(ordinal, term.term) * term.inverse_document_freq;
             }
+            top_documents.Push({ segment.GetDocumentId(ordinal), relevance + phrase_relevance, segment.GetRating(ordinal) });
         }
+    }
 
-        std::vector<Document> matched_documents;
-        for (const auto [document_id, relevance] : document_to_relevance) {
-            matched_documents.push_back(
-                { document_id, relevance, documents_.at(document_id).rating });
+    // Every segment is cut into ordinal ranges of PARALLEL_CHUNK_SIZE that select their own tops;
+    // find_in_range(segment_query, range_top, first_ordinal, last_ordinal) searches one of them
+    template <typename FindInRange>
+    void FindDocumentsByRange(const std::vector<SegmentQuery>& query, TopDocuments& top_documents, FindInRange find_in_range) const {
+        ThreadScratch<ParallelScratch> scratch;
+        auto& ranges = scratch->ordinal_ranges;
+        ranges.clear();
+        for (const SegmentQuery& segment_query : query) {
+            for (size_t first = 0; first < segment_query.segment->GetDocumentCount(); first += PARALLEL_CHUNK_SIZE) {
+                ranges.push_back({ &segment_query, static_cast<uint32_t>(first) });
+            }
+        }
+        std::vector<TopDocuments>& partial_tops = scratch->partial_tops;
+        ResetTops(partial_tops, ranges.size(), top_documents.GetMaxCount());
+        GetThreadPool()->ParallelFor(ranges.size(), [&](const size_t range_index) {
+            const auto [segment_query, first_ordinal] = ranges[range_index];
+            find_in_range(*segment_query, partial_tops[range_index], first_ordinal, first_ordinal + static_cast<uint32_t>(PARALLEL_CHUNK_SIZE));
+        });
+        for (size_t range_index = 0; range_index < ranges.size(); ++range_index) {
+            top_documents.Merge(partial_tops[range_index]);
         }
-        return matched_documents;
     }
 
-    
 // Parallel policy FindAllDocuments
-    template <typename DocumentPredicate, typename ExecPolicy>
-    std::vector<Document> FindAllDocuments(ExecPolicy policy, const Query& query, DocumentPredicate document_predicate) const noexcept {
-        ConcurrentMap<int, double> document_to_relevance(8);
-        //std::map<int, double> document_to_relevance;
-        
-        std::for_each(std::execution::par, query.plus_words.begin(), query.plus_words.end(), [&](const auto &word) {
-            if (word_to_document_freqs_.count(word) != 0) {
-                const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
-                for (const auto [document_id, term_freq] : word_to_document_freqs_.at(word)) {
-                    const auto& document_data = documents_.at(document_id);
-                    if (document_predicate(document_id, document_data.status, document_data.rating)) {
-                        document_to_relevance[document_id].ref_to_value += term_freq * inverse_document_freq;
-                    }
-                } 
-            }            
+    // Postings of all segments are cut into fixed-size ranges, so the work spreads over
+    // all cores however few words the query has and however the corpus is segmented
+    template <typename DocumentFilter, typename ExecPolicy>
+    void FindAllDocuments(ExecPolicy, const std::vector<SegmentQuery>& query, DocumentFilter document_filter, TopDocuments& top_documents) const {
+        constexpr size_t blocks_per_range = PARALLEL_CHUNK_SIZE / POSTING_BLOCK_SIZE;
+        ThreadScratch<ParallelScratch> scratch;
+        std::vector<PostingRange>& ranges = scratch->posting_ranges;
+        auto& minus_postings = scratch->minus_postings;
+        ranges.clear();
+        minus_postings.clear();
+        // Ordinals of different segments collide, so every segment gets its own table
+        std::vector<ConcurrentScoreTable>& document_to_relevance = scratch->score_tables;
+        while (document_to_relevance.size() < query.size()) {
+            document_to_relevance.emplace_back(0);
+        }
+        for (size_t segment_index = 0; segment_index < query.size(); ++segment_index) {
+            size_t posting_count = 0;
+            for (const QueryTerm& term : query[segment_index].plus_terms) {
+                const size_t block_count = term.postings->GetBlockCount();
+                for (size_t first = 0; first < block_count; first += blocks_per_range) {
+                    ranges.push_back({ segment_index, term.postings, term.inverse_document_freq, first, std::min(first + blocks_per_range, block_count) });
+                }
+                posting_count += term.postings->size();
+            }
+            for (const PostingList* postings : query[segment_index].minus_postings) {
+                minus_postings.push_back({ segment_index, postings });
+            }
+            document_to_relevance[segment_index].Reset(posting_count);
+        }
+
+        const auto thread_pool = GetThreadPool();
+        thread_pool->ParallelFor(ranges.size(), [&](const size_t range_index) {
+            const PostingRange& range = ranges[range_index];
+            const SegmentQuery& segment_query = query[range.segment_index];
+            ConcurrentScoreTable& table = document_to_relevance[range.segment_index];
+            ThreadScratch<ScoringScratch> range_scratch;
+            PostingCursor& cursor = range_scratch->cursor;
+            for (cursor.Reset(*range.postings, range.first_block, range.last_block); !cursor.AtEnd(); cursor.Next()) {
+                const uint32_t ordinal = cursor.GetDocumentId();
+                if (!segment_query.IsDeleted(ordinal) && document_filter(*segment_query.segment, ordinal)) {
+                    table.Add(ordinal, cursor.GetTermFreq() * range.inverse_document_freq);
+                }
+            }
+        });
+
+        thread_pool->ParallelFor(minus_postings.size(), [&](const size_t index){
+            const auto [segment_index, postings] = minus_postings[index];
+            ThreadScratch<ScoringScratch> minus_scratch;
+            PostingCursor& cursor = minus_scratch->cursor;
+            for (cursor.Reset(*postings); !cursor.AtEnd(); cursor.Next()) {
+                document_to_relevance[segment_index].Exclude(cursor.GetDocumentId());
+            }
         });
-        
-        std::map<int, double> document_to_relevance_ = document_to_relevance.BuildOrdinaryMap();
-        std::for_each(query.minus_words.begin(), query.minus_words.end(), [&](const auto &word){
-            if (word_to_document_freqs_.count(word) != 0) {
-                for (const auto [document_id, _] : word_to_document_freqs_.at(word)) {
-                    document_to_relevance_.erase(document_id);
-                }  
+
+        // Every slot range selects its own top, then the partial tops are merged
+        auto& slot_ranges = scratch->slot_ranges;
+        slot_ranges.clear();
+        for (size_t segment_index = 0; segment_index < query.size(); ++segment_index) {
+            const size_t slot_count = document_to_relevance[segment_index].GetSlotCount();
+            for (size_t first = 0; first < slot_count; first += PARALLEL_CHUNK_SIZE) {
+                slot_ranges.push_back({ segment_index, first });
             }
+        }
+        std::vector<TopDocuments>& partial_tops = scratch->partial_tops;
+        ResetTops(partial_tops, slot_ranges.size(), top_documents.GetMaxCount());
+        thread_pool->ParallelFor(slot_ranges.size(), [&](const size_t chunk) {
+            TopDocuments& partial_top = partial_tops[chunk];
+            const auto [segment_index, first] = slot_ranges[chunk];
+            const Segment& segment = *query[segment_index].segment;
+            const ConcurrentScoreTable& table = document_to_relevance[segment_index];
+            table.ForEachInRange(first, std::min(first + PARALLEL_CHUNK_SIZE, table.GetSlotCount()), [&](int ordinal, double relevance) {
+                partial_top.Push({ segment.GetDocumentId(ordinal), relevance, segment.GetRating(ordinal) });
+            });
         });
-        
-        
-        
-        std::vector<Document> matched_documents(document_to_relevance_.size());
-        for (const auto [document_id, relevance] : document_to_relevance_) {
-            matched_documents.push_back({ document_id, relevance, documents_.at(document_id).rating });
-        }
-        return matched_documents;
-    }   
+        for (size_t chunk = 0; chunk < slot_ranges.size(); ++chunk) {
+            top_documents.Merge(partial_tops[chunk]);
+        }
+    }
 };
 
+using CompiledQuery = SearchServer::CompiledQuery;
+
+// Forward iterator over the live document ids of one snapshot in the order they were added.
+// It keeps its snapshot alive, so updates made while iterating do not affect it
+class SearchServer::DocumentIdIterator {
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = int;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const int*;
+    using reference = const int&;
+
+    // The end iterator
+    DocumentIdIterator() = default;
+    explicit DocumentIdIterator(std::shared_ptr<const Snapshot> snapshot);
+
+    reference operator*() const {
+        return snapshot_->segments[segment_index_].segment->GetDocumentIds()[position_];
+    }
+
+    pointer operator->() const {
+        return &**this;
+    }
+
+    DocumentIdIterator& operator++();
+    DocumentIdIterator operator++(int);
+
+    bool operator==(const DocumentIdIterator& other) const;
+    bool operator!=(const DocumentIdIterator& other) const {
+        return !(*this == other);
+    }
+
+private:
+    std::shared_ptr<const Snapshot> snapshot_;
+    size_t segment_index_ = 0;
+    size_t position_ = 0;
+
+    bool AtEnd() const;
+    // Moves on to the first live document from the current position
+    void SkipDeleted();
+};
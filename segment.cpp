@@ -0,0 +1,456 @@
+#include "segment.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+#include "string_processing.h"
+
+using namespace std;
+
+namespace {
+
+struct DocumentRecord {
+    int id;
+    int rating;
+    int32_t status;
+    uint32_t term_count;
+};
+
+}  // namespace
+
+shared_ptr<Segment> Segment::Build(ThreadPool& thread_pool, const vector<SegmentDocument>& documents, PostingCodec codec,
+                                   bool positional) {
+    auto segment = make_shared<Segment>();
+    size_t text_size = 0;
+    size_t forward_size = 0;
+    vector<pair<TermId, string_view>> words;
+    for (const SegmentDocument& document : documents) {
+        if (!document.is_external) {
+            text_size += document.text.size();
+        }
+        forward_size += document.word_counts.size();
+        for (const WordCount& word_count : document.word_counts) {
+            words.push_back({ word_count.global_term, word_count.word });
+        }
+    }
+    segment->SetTerms(words);
+    // All texts of the segment fit in a single chunk
+    auto texts = make_shared<TextArena>(max<size_t>(text_size, 1));
+
+    auto& term_counts = segment->term_counts_.Mutable();
+    term_counts.reserve(forward_size);
+    for (const SegmentDocument& document : documents) {
+        for (const WordCount& word_count : document.word_counts) {
+            term_counts.push_back({ segment->FindTerm(word_count.global_term), word_count.count });
+        }
+        segment->AddDocument(document.id, document.rating, document.status,
+                             document.is_external ? document.text : texts->Store(document.text), document.is_external);
+        segment->term_count_offsets_.push_back(term_counts.size());
+    }
+
+    segment->texts_ = move(texts);
+    segment->BuildLookups();
+    segment->BuildIndex(thread_pool);
+    if (positional) {
+        vector<pair<const Segment*, uint32_t>> sources;
+        sources.reserve(documents.size());
+        for (uint32_t ordinal = 0; ordinal < documents.size(); ++ordinal) {
+            sources.push_back({ segment.get(), ordinal });
+        }
+        segment->BuildPositions(thread_pool, sources);
+    }
+    if (codec != PostingCodec::RAW) {
+        return segment->Compress(codec);
+    }
+    return segment;
+}
+
+shared_ptr<Segment> Segment::Merge(ThreadPool& thread_pool, const vector<shared_ptr<const Segment>>& segments,
+                                   const vector<const DeletedDocuments*>& deleted, PostingCodec codec, bool impact_ordered,
+                                   bool positional) {
+    const auto is_deleted = [&deleted](size_t segment_index, uint32_t ordinal) {
+        return segment_index < deleted.size() && deleted[segment_index] != nullptr && deleted[segment_index]->IsDeleted(ordinal);
+    };
+    auto merged = make_shared<Segment>();
+    size_t text_size = 0;
+    size_t forward_size = 0;
+    // Only the terms of the documents kept
+    vector<pair<TermId, string_view>> words;
+    vector<bool> is_used;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const Segment& segment = *segments[i];
+        is_used.assign(segment.GetTermCount(), false);
+        for (uint32_t ordinal = 0; ordinal < segment.document_ids_.size(); ++ordinal) {
+            if (!is_deleted(i, ordinal)) {
+                text_size += segment.is_external_[ordinal] ? 0 : segment.document_texts_[ordinal].size();
+                forward_size += segment.term_count_offsets_[ordinal + 1] - segment.term_count_offsets_[ordinal];
+                for (const TermCount& item : segment.GetTermCounts(ordinal)) {
+                    is_used[item.term] = true;
+                }
+            }
+        }
+        for (TermId term = 0; term < is_used.size(); ++term) {
+            if (is_used[term]) {
+                words.push_back({ segment.global_terms_[term], segment.GetTerm(term) });
+            }
+        }
+    }
+    merged->SetTerms(words);
+    auto texts = make_shared<TextArena>(max<size_t>(text_size, 1));
+
+    auto& term_counts = merged->term_counts_.Mutable();
+    term_counts.reserve(forward_size);
+    vector<TermId> merged_terms;
+    vector<pair<const Segment*, uint32_t>> sources;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const Segment& segment = *segments[i];
+        // Every term of a source segment is looked up once, not once per document
+        merged_terms.assign(segment.GetTermCount(), TermDictionary::NO_TERM);
+        for (uint32_t ordinal = 0; ordinal < segment.document_ids_.size(); ++ordinal) {
+            if (is_deleted(i, ordinal)) {
+                continue;
+            }
+            for (const TermCount& item : segment.GetTermCounts(ordinal)) {
+                TermId& term = merged_terms[item.term];
+                if (term == TermDictionary::NO_TERM) {
+                    term = merged->FindTerm(segment.global_terms_[item.term]);
+                }
+                term_counts.push_back({ term, item.count });
+            }
+            const string_view text = segment.document_texts_[ordinal];
+            const bool is_external = segment.is_external_[ordinal];
+            merged->AddDocument(segment.document_ids_[ordinal], segment.ratings_[ordinal], segment.statuses_[ordinal],
+                                is_external ? text : texts->Store(text), is_external);
+            merged->term_count_offsets_.push_back(term_counts.size());
+            sources.push_back({ &segment, ordinal });
+        }
+    }
+
+    merged->texts_ = move(texts);
+    merged->BuildLookups();
+    merged->BuildIndex(thread_pool);
+    if (impact_ordered) {
+        merged->impacts_ = make_shared<const ImpactIndex>(merged->index_, merged->GetTermCount());
+    }
+    if (positional) {
+        merged->BuildPositions(thread_pool, sources);
+    }
+    if (codec != PostingCodec::RAW) {
+        return merged->Compress(codec);
+    }
+    return merged;
+}
+
+shared_ptr<Segment> Segment::Compress(PostingCodec codec) const {
+    auto segment = make_shared<Segment>(*this);
+    // Postings come in ordinal order, so grouping the forward index by term lines the
+    // word counts up with them
+    vector<vector<uint32_t>> word_counts;
+    if (codec != PostingCodec::RAW) {
+        word_counts.resize(GetTermCount());
+        for (uint32_t ordinal = 0; ordinal < document_ids_.size(); ++ordinal) {
+            for (const TermCount& item : GetTermCounts(ordinal)) {
+                word_counts[item.term].push_back(item.count);
+            }
+        }
+    }
+    segment->index_.Compress(codec, word_counts, document_lengths_);
+    return segment;
+}
+
+shared_ptr<Segment> Segment::SetImpactOrdered(bool impact_ordered) const {
+    auto segment = make_shared<Segment>(*this);
+    if (!impact_ordered) {
+        segment->impacts_.reset();
+    } else if (impacts_ == nullptr) {
+        segment->impacts_ = make_shared<const ImpactIndex>(index_, GetTermCount());
+    }
+    return segment;
+}
+
+shared_ptr<Segment> Segment::SetPositional(ThreadPool& thread_pool, bool positional) const {
+    auto segment = make_shared<Segment>(*this);
+    if (!positional) {
+        segment->positions_.reset();
+    } else if (positions_ == nullptr) {
+        vector<pair<const Segment*, uint32_t>> sources;
+        sources.reserve(document_ids_.size());
+        for (uint32_t ordinal = 0; ordinal < document_ids_.size(); ++ordinal) {
+            sources.push_back({ this, ordinal });
+        }
+        segment->BuildPositions(thread_pool, sources);
+    }
+    return segment;
+}
+
+size_t Segment::GetDocumentCount() const {
+    return document_ids_.size();
+}
+
+const vector<int>& Segment::GetDocumentIds() const {
+    return document_ids_;
+}
+
+MappedVector<TermCount> Segment::GetTermCounts(uint32_t ordinal) const {
+    const uint64_t first = term_count_offsets_[ordinal];
+    return MappedVector<TermCount>::Borrow(term_counts_.data() + first, term_count_offsets_[ordinal + 1] - first);
+}
+
+double Segment::GetTermFreq(uint32_t ordinal, TermId term) const {
+    const auto term_counts = GetTermCounts(ordinal);
+    const auto it = lower_bound(term_counts.begin(), term_counts.end(), term, [](const TermCount& item, TermId term) {
+        return item.term < term;
+    });
+    if (it == term_counts.end() || it->term != term) {
+        return 0.0;
+    }
+    // Summed one word at a time, as BuildIndex does
+    const double inv_word_count = 1.0 / document_lengths_[ordinal];
+    double term_freq = 0.0;
+    for (uint32_t j = 0; j < it->count; ++j) {
+        term_freq += inv_word_count;
+    }
+    return term_freq;
+}
+
+TermId Segment::FindTerm(TermId global_term) const {
+    const auto it = lower_bound(global_terms_.begin(), global_terms_.end(), global_term);
+    if (it == global_terms_.end() || *it != global_term) {
+        return TermDictionary::NO_TERM;
+    }
+    return static_cast<TermId>(it - global_terms_.begin());
+}
+
+size_t Segment::GetTermCount() const {
+    return dictionary_->size();
+}
+
+string_view Segment::GetTerm(TermId term) const {
+    return dictionary_->GetTerm(term);
+}
+
+const InvertedIndex& Segment::GetIndex() const {
+    return index_;
+}
+
+const ImpactIndex* Segment::GetImpacts() const {
+    return impacts_.get();
+}
+
+const PositionIndex* Segment::GetPositions() const {
+    return positions_.get();
+}
+
+size_t Segment::GetMemoryUsage() const {
+    const size_t column_size = document_ids_.capacity() * sizeof(int) + ratings_.capacity() * sizeof(int)
+        + statuses_.capacity() * sizeof(DocumentStatus) + document_lengths_.capacity() * sizeof(uint32_t)
+        + document_texts_.capacity() * sizeof(string_view)
+        + (STATUS_COUNT + 1) * document_ids_.size() / 8
+        + term_counts_.GetOwnedBytes() + term_count_offsets_.capacity() * sizeof(uint64_t) + global_terms_.GetOwnedBytes();
+    return index_.GetMemoryUsage() + dictionary_->GetMemoryUsage() + column_size
+        + (texts_ != nullptr ? texts_->GetAllocatedBytes() : 0) + (impacts_ != nullptr ? impacts_->GetMemoryUsage() : 0);
+}
+
+void Segment::Save(IndexWriter& writer) const {
+    dictionary_->Save(writer);
+    writer.WriteArray(global_terms_.data(), global_terms_.size());
+    index_.Save(writer);
+
+    // Documents go in ordinal order, so ordinals and iteration order survive the round trip
+    vector<DocumentRecord> records;
+    records.reserve(document_ids_.size());
+    for (uint32_t ordinal = 0; ordinal < document_ids_.size(); ++ordinal) {
+        records.push_back({ document_ids_[ordinal], ratings_[ordinal], static_cast<int32_t>(statuses_[ordinal]),
+                            static_cast<uint32_t>(term_count_offsets_[ordinal + 1] - term_count_offsets_[ordinal]) });
+    }
+    writer.Write<uint64_t>(records.size());
+    writer.WriteArray(records.data(), records.size());
+    writer.Write<uint64_t>(term_counts_.size());
+    writer.WriteArray(term_counts_.data(), term_counts_.size());
+    writer.Write<uint8_t>(positions_ != nullptr);
+    if (positions_ != nullptr) {
+        positions_->Save(writer);
+    }
+}
+
+shared_ptr<Segment> Segment::Load(IndexReader& reader) {
+    auto segment = make_shared<Segment>();
+    auto dictionary = make_shared<TermDictionary>();
+    dictionary->Load(reader);
+    const auto* global_terms = reader.ReadArray<TermId>(dictionary->size());
+    segment->global_terms_ = MappedVector<TermId>::Borrow(global_terms, dictionary->size());
+    if (adjacent_find(global_terms, global_terms + dictionary->size(), greater_equal<TermId>()) != global_terms + dictionary->size()) {
+        throw invalid_argument("Index file has a broken term table"s);
+    }
+    segment->dictionary_ = move(dictionary);
+    segment->index_.Load(reader);
+
+    const auto document_count = reader.Read<uint64_t>();
+    const auto* records = reader.ReadArray<DocumentRecord>(document_count);
+    const auto forward_size = reader.Read<uint64_t>();
+    const auto* forward_index = reader.ReadArray<TermCount>(forward_size);
+    segment->term_counts_ = MappedVector<TermCount>::Borrow(forward_index, forward_size);
+    segment->term_count_offsets_.reserve(document_count + 1);
+    for (size_t i = 0; i < document_count; ++i) {
+        const DocumentRecord& record = records[i];
+        if (record.term_count > forward_size - segment->term_count_offsets_.back()) {
+            throw invalid_argument("Index file has a broken forward index"s);
+        }
+        segment->term_count_offsets_.push_back(segment->term_count_offsets_.back() + record.term_count);
+        segment->AddDocument(record.id, record.rating, static_cast<DocumentStatus>(record.status), string_view{}, true);
+    }
+    segment->BuildLookups();
+    if (reader.Read<uint8_t>() != 0) {
+        auto positions = make_shared<PositionIndex>();
+        positions->Load(reader, document_count);
+        segment->positions_ = move(positions);
+    }
+    // Postings are sorted, so the last one of a list has its largest ordinal
+    for (TermId term = 0; term < segment->GetTermCount(); ++term) {
+        const PostingList* postings = segment->index_.FindPostings(term);
+        if (postings != nullptr && !postings->empty() && static_cast<uint64_t>(postings->document_ids.back()) >= document_count) {
+            throw invalid_argument("Index file has a posting of an unknown document"s);
+        }
+    }
+    return segment;
+}
+
+void Segment::SetTerms(vector<pair<TermId, string_view>>& words) {
+    const auto is_less = [](const pair<TermId, string_view>& lhs, const pair<TermId, string_view>& rhs) {
+        return lhs.first < rhs.first;
+    };
+    sort(words.begin(), words.end(), is_less);
+    words.erase(unique(words.begin(), words.end(), [](const pair<TermId, string_view>& lhs, const pair<TermId, string_view>& rhs) {
+        return lhs.first == rhs.first;
+    }), words.end());
+    auto dictionary = make_shared<TermDictionary>();
+    auto& global_terms = global_terms_.Mutable();
+    global_terms.clear();
+    global_terms.reserve(words.size());
+    for (const auto& [global_term, word] : words) {
+        dictionary->InternStable(word);
+        global_terms.push_back(global_term);
+    }
+    dictionary_ = move(dictionary);
+}
+
+void Segment::AddDocument(int document_id, int rating, DocumentStatus status, string_view text, bool is_external) {
+    document_ids_.push_back(document_id);
+    ratings_.push_back(rating);
+    statuses_.push_back(status);
+    document_texts_.push_back(text);
+    is_external_.push_back(is_external);
+}
+
+void Segment::BuildLookups() {
+    document_lengths_.resize(document_ids_.size());
+    for (vector<bool>& documents : status_documents_) {
+        documents.assign(document_ids_.size(), false);
+    }
+    for (uint32_t ordinal = 0; ordinal < document_ids_.size(); ++ordinal) {
+        uint32_t length = 0;
+        for (const TermCount& item : GetTermCounts(ordinal)) {
+            length += item.count;
+        }
+        document_lengths_[ordinal] = length;
+        // Statuses come from the caller or a file, anything out of range gets no bit
+        if (const auto status = static_cast<size_t>(statuses_[ordinal]); status < STATUS_COUNT) {
+            status_documents_[status][ordinal] = true;
+        }
+    }
+}
+
+void Segment::BuildIndex(ThreadPool& thread_pool) {
+    auto& forward_index = term_counts_.Mutable();
+    vector<vector<TermFrequency>> term_freqs(document_ids_.size());
+    thread_pool.ParallelFor(document_ids_.size(), [&](size_t ordinal) {
+        const auto first = forward_index.begin() + term_count_offsets_[ordinal];
+        const auto last = forward_index.begin() + term_count_offsets_[ordinal + 1];
+        sort(first, last, [](const TermCount& lhs, const TermCount& rhs) {
+            return lhs.term < rhs.term;
+        });
+        // Summed one word at a time, exactly as a document's words are counted
+        const double inv_word_count = 1.0 / document_lengths_[ordinal];
+        auto& document_term_freqs = term_freqs[ordinal];
+        document_term_freqs.reserve(last - first);
+        for (auto it = first; it != last; ++it) {
+            double term_freq = 0.0;
+            for (uint32_t j = 0; j < it->count; ++j) {
+                term_freq += inv_word_count;
+            }
+            document_term_freqs.push_back({ it->term, term_freq });
+        }
+    });
+    vector<int> ordinals(document_ids_.size());
+    iota(ordinals.begin(), ordinals.end(), 0);
+    index_.AddDocuments(thread_pool, ordinals, term_freqs);
+}
+
+void Segment::BuildPositions(ThreadPool& thread_pool, const vector<pair<const Segment*, uint32_t>>& sources) {
+    vector<vector<uint8_t>> encoded(document_ids_.size());
+    atomic<bool> is_complete{ true };
+    thread_pool.ParallelFor(document_ids_.size(), [&](size_t ordinal) {
+        thread_local vector<pair<TermId, uint32_t>> term_positions;
+        thread_local vector<string_view> words;
+        const auto [source, source_ordinal] = sources[ordinal];
+        if (source->positions_ != nullptr) {
+            source->positions_->DecodeDocument(source_ordinal, source->GetTermCounts(source_ordinal), term_positions);
+            if (source != this) {
+                for (auto& [term, _] : term_positions) {
+                    term = FindTerm(source->global_terms_[term]);
+                }
+            }
+        } else if (!source->document_texts_[source_ordinal].empty() || source->GetTermCounts(source_ordinal).empty()) {
+            // Stop words are the words the segment has no term for
+            SplitIntoWordsView(source->document_texts_[source_ordinal], words);
+            term_positions.clear();
+            for (uint32_t position = 0; position < words.size(); ++position) {
+                if (const TermId term = dictionary_->Find(words[position]); term != TermDictionary::NO_TERM) {
+                    term_positions.push_back({ term, position });
+                }
+            }
+        } else {
+            is_complete = false;
+            return;
+        }
+        PositionIndex::EncodeDocument(term_positions, encoded[ordinal]);
+    });
+    if (!is_complete) {
+        positions_.reset();
+        return;
+    }
+    auto positions = make_shared<PositionIndex>();
+    for (const vector<uint8_t>& document : encoded) {
+        positions->AddDocument(document);
+    }
+    positions_ = move(positions);
+}
+
+DeletedDocuments::DeletedDocuments(const Segment& segment)
+    : is_deleted_(segment.GetDocumentCount(), false)
+    , document_freqs_(segment.GetTermCount(), 0) {
+}
+
+size_t DeletedDocuments::GetCount() const {
+    return count_;
+}
+
+uint32_t DeletedDocuments::GetDocumentFreq(TermId term) const {
+    return document_freqs_[term];
+}
+
+bool DeletedDocuments::Delete(const Segment& segment, uint32_t ordinal) {
+    if (is_deleted_[ordinal]) {
+        return false;
+    }
+    is_deleted_[ordinal] = true;
+    ++count_;
+    for (const TermCount& item : segment.GetTermCounts(ordinal)) {
+        ++document_freqs_[item.term];
+    }
+    return true;
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "document.h"
+#include "impact_index.h"
+#include "index_file.h"
+#include "inverted_index.h"
+#include "mapped_vector.h"
+#include "position_index.h"
+#include "posting_codec.h"
+#include "term_dictionary.h"
+#include "text_arena.h"
+#include "thread_pool.h"
+
+class DeletedDocuments;
+
+// A word of a document as it is handed to Segment::Build
+struct WordCount {
+    // The view is kept, not copied, so it must outlive the segment and everything merged from it
+    std::string_view word;
+    // The server's id of the word, the same in every segment
+    TermId global_term;
+    uint32_t count;
+};
+
+// Document as it is handed to Segment::Build
+struct SegmentDocument {
+    int id;
+    int rating;
+    DocumentStatus status;
+    // Copied into the segment unless is_external
+    std::string_view text;
+    bool is_external;
+    // Non-stop words of the document and how often each occurs
+    std::vector<WordCount> word_counts;
+};
+
+// A self-contained part of the index: its own term dictionary, postings and
+// documents. A segment is never modified once built, so queries read it without
+// locks; additions, removals and merges build new segments instead.
+// Documents are numbered by dense ordinals in the order they were added. Postings list
+// ordinals and document metadata is kept in columns indexed by ordinal, so everything a
+// query needs about a document is an array access away. Ids are looked up by the server,
+// in one hash map for all segments.
+class Segment {
+public:
+    // Past the last ordinal of any segment; ordinals fit in an int, as postings store them
+    static constexpr uint32_t NO_ORDINAL = std::numeric_limits<int>::max();
+
+    static std::shared_ptr<Segment> Build(ThreadPool& thread_pool, const std::vector<SegmentDocument>& documents,
+                                          PostingCodec codec = PostingCodec::RAW, bool positional = false);
+    // Documents of the segments in their order. deleted[i], if given and not nullptr, holds
+    // the documents of segments[i] that are left out
+    static std::shared_ptr<Segment> Merge(ThreadPool& thread_pool, const std::vector<std::shared_ptr<const Segment>>& segments,
+                                          const std::vector<const DeletedDocuments*>& deleted = {},
+                                          PostingCodec codec = PostingCodec::RAW, bool impact_ordered = false,
+                                          bool positional = false);
+    // Same documents with the postings re-encoded; the dictionary and texts are shared
+    std::shared_ptr<Segment> Compress(PostingCodec codec) const;
+    // Same documents with or without an impact-ordered copy of the postings
+    std::shared_ptr<Segment> SetImpactOrdered(bool impact_ordered) const;
+    // Same documents with or without word positions. Positions come from the document texts,
+    // so documents loaded from an index file without positions cannot get them: the segment
+    // is then left without any
+    std::shared_ptr<Segment> SetPositional(ThreadPool& thread_pool, bool positional) const;
+
+    size_t GetDocumentCount() const;
+    // Indexed by ordinal
+    const std::vector<int>& GetDocumentIds() const;
+
+    int GetDocumentId(uint32_t ordinal) const {
+        return document_ids_[ordinal];
+    }
+    int GetRating(uint32_t ordinal) const {
+        return ratings_[ordinal];
+    }
+    DocumentStatus GetStatus(uint32_t ordinal) const {
+        return statuses_[ordinal];
+    }
+    bool HasStatus(uint32_t ordinal, DocumentStatus status) const {
+        return status_documents_[static_cast<size_t>(status)][ordinal];
+    }
+    // Number of non-stop words
+    uint32_t GetDocumentLength(uint32_t ordinal) const {
+        return document_lengths_[ordinal];
+    }
+    // Word counts of the document sorted by the segment's term ids, borrowed from the segment
+    MappedVector<TermCount> GetTermCounts(uint32_t ordinal) const;
+    // Frequency of the term in the document, bit-identical to its posting; 0 when the document lacks it
+    double GetTermFreq(uint32_t ordinal, TermId term) const;
+
+    // The segment's id of the word the server numbers global_term; TermDictionary::NO_TERM
+    // when no document of the segment has it
+    TermId FindTerm(TermId global_term) const;
+    // The server's id of the segment's term
+    TermId GetGlobalTerm(TermId term) const {
+        return global_terms_[term];
+    }
+    size_t GetTermCount() const;
+    // The view lives as long as the words given to Build, not just as long as the segment
+    std::string_view GetTerm(TermId term) const;
+    // Postings are keyed by document ordinal
+    const InvertedIndex& GetIndex() const;
+    // nullptr unless the segment was built impact-ordered
+    const ImpactIndex* GetImpacts() const;
+    // nullptr unless the segment was built positional
+    const PositionIndex* GetPositions() const;
+
+    // Texts are counted, positions are not, see GetPositions
+    size_t GetMemoryUsage() const;
+
+    void Save(IndexWriter& writer) const;
+    // The reader's memory has to outlive the segment
+    static std::shared_ptr<Segment> Load(IndexReader& reader);
+
+private:
+    static constexpr size_t STATUS_COUNT = static_cast<size_t>(DocumentStatus::REMOVED) + 1;
+
+    std::shared_ptr<const TermDictionary> dictionary_;
+    // The server's id of every term. Terms are numbered in the server's order, so these ascend
+    // and a word is found by a binary search over integers
+    MappedVector<TermId> global_terms_;
+    std::shared_ptr<const TextArena> texts_;
+    InvertedIndex index_;
+    std::shared_ptr<const ImpactIndex> impacts_;
+    std::shared_ptr<const PositionIndex> positions_;
+
+    // Columns indexed by ordinal
+    std::vector<int> document_ids_;
+    std::vector<int> ratings_;
+    std::vector<DocumentStatus> statuses_;
+    // Number of non-stop words
+    std::vector<uint32_t> document_lengths_;
+    // Empty for documents loaded from an index file
+    std::vector<std::string_view> document_texts_;
+    std::vector<bool> is_external_;
+    // A bitset of the documents with each status, so a status filter is one bit test per posting
+    std::array<std::vector<bool>, STATUS_COUNT> status_documents_;
+    // Forward index of all documents back to back: document o has the word counts
+    // [term_count_offsets_[o], term_count_offsets_[o + 1])
+    MappedVector<TermCount> term_counts_;
+    std::vector<uint64_t> term_count_offsets_{ 0 };
+
+    // Numbers the words, the server's id of each with its text, in the order of the server's ids
+    void SetTerms(std::vector<std::pair<TermId, std::string_view>>& words);
+    // Appends a document to the columns, the caller adds its word counts and their end offset
+    void AddDocument(int document_id, int rating, DocumentStatus status, std::string_view text, bool is_external);
+    // Sorts the forward index by term and builds the postings from it; needs the lengths of BuildLookups
+    void BuildIndex(ThreadPool& thread_pool);
+    // Fills the id lookup, the status bitsets and the lengths from the columns
+    void BuildLookups();
+    // Positions of every document from its source, a segment and ordinal whose words are the
+    // same: the source's positions if it has them, otherwise its text
+    void BuildPositions(ThreadPool& thread_pool, const std::vector<std::pair<const Segment*, uint32_t>>& sources);
+};
+
+// Tombstones of a published segment, by ordinal: removing a document only marks it here. Queries skip
+// marked documents and leave them out of document frequencies, merges and purges drop them
+// for good. Published tombstones are never modified, further removals go into a copy
+class DeletedDocuments {
+public:
+    // None of the segment's documents is deleted
+    explicit DeletedDocuments(const Segment& segment);
+
+    bool IsDeleted(uint32_t ordinal) const {
+        return is_deleted_[ordinal];
+    }
+
+    size_t GetCount() const;
+    // How many of the deleted documents have the term
+    uint32_t GetDocumentFreq(TermId term) const;
+
+    // False if the document is already deleted
+    bool Delete(const Segment& segment, uint32_t ordinal);
+
+private:
+    std::vector<bool> is_deleted_;
+    size_t count_ = 0;
+    std::vector<uint32_t> document_freqs_;
+};
@@ -0,0 +1,127 @@
+#include "sorted_sets.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+// Below this length ratio a merge beats a binary search per element
+constexpr size_t GALLOP_RATIO = 32;
+
+// First index in [from, size) whose value is not less than value
+size_t Gallop(const int* values, size_t from, size_t size, int value) {
+    size_t lo = from;
+    size_t hi = from;
+    size_t step = 1;
+    while (hi < size && values[hi] < value) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    hi = min(hi, size);
+    return lower_bound(values + lo, values + hi, value) - values;
+}
+
+size_t IntersectGalloping(const int* lhs, size_t lhs_size, const int* rhs, size_t rhs_size, int* output) {
+    size_t count = 0;
+    size_t j = 0;
+    for (size_t i = 0; i < lhs_size && j < rhs_size; ++i) {
+        j = Gallop(rhs, j, rhs_size, lhs[i]);
+        if (j < rhs_size && rhs[j] == lhs[i]) {
+            output[count++] = lhs[i];
+        }
+    }
+    return count;
+}
+
+size_t IntersectMerging(const int* lhs, size_t lhs_size, const int* rhs, size_t rhs_size, int* output) {
+    size_t count = 0;
+    size_t i = 0;
+    size_t j = 0;
+#if defined(__SSE2__)
+    // Every element of a block of lhs is compared with all four of a block of rhs by rotating
+    // the latter. Elements are distinct, so each one of lhs matches in one block of rhs at most
+    while (i + 4 <= lhs_size && j + 4 <= rhs_size) {
+        const __m128i lhs_block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lhs + i));
+        __m128i rhs_block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rhs + j));
+        __m128i matches = _mm_cmpeq_epi32(lhs_block, rhs_block);
+        for (int rotation = 1; rotation < 4; ++rotation) {
+            rhs_block = _mm_shuffle_epi32(rhs_block, _MM_SHUFFLE(0, 3, 2, 1));
+            matches = _mm_or_si128(matches, _mm_cmpeq_epi32(lhs_block, rhs_block));
+        }
+        const int lhs_last = lhs[i + 3];
+        const int rhs_last = rhs[j + 3];
+        if (const int mask = _mm_movemask_ps(_mm_castsi128_ps(matches)); mask != 0) {
+            alignas(16) int values[4];
+            _mm_store_si128(reinterpret_cast<__m128i*>(values), lhs_block);
+            for (int k = 0; k < 4; ++k) {
+                if ((mask >> k) & 1) {
+                    output[count++] = values[k];
+                }
+            }
+        }
+        i += lhs_last <= rhs_last ? 4 : 0;
+        j += rhs_last <= lhs_last ? 4 : 0;
+    }
+#endif
+    while (i < lhs_size && j < rhs_size) {
+        if (lhs[i] < rhs[j]) {
+            ++i;
+        } else if (rhs[j] < lhs[i]) {
+            ++j;
+        } else {
+            output[count++] = lhs[i];
+            ++i;
+            ++j;
+        }
+    }
+    return count;
+}
+
+}  // namespace
+
+size_t IntersectSorted(const int* lhs, size_t lhs_size, const int* rhs, size_t rhs_size, int* output) {
+    if (lhs_size == 0 || rhs_size == 0) {
+        return 0;
+    }
+    if (rhs_size / GALLOP_RATIO >= lhs_size) {
+        return IntersectGalloping(lhs, lhs_size, rhs, rhs_size, output);
+    }
+    if (lhs_size / GALLOP_RATIO >= rhs_size) {
+        // Still writes elements of lhs, in their order, at no later index than they are read
+        size_t count = 0;
+        size_t i = 0;
+        for (size_t j = 0; j < rhs_size && i < lhs_size; ++j) {
+            i = Gallop(lhs, i, lhs_size, rhs[j]);
+            if (i < lhs_size && lhs[i] == rhs[j]) {
+                output[count++] = lhs[i++];
+            }
+        }
+        return count;
+    }
+    return IntersectMerging(lhs, lhs_size, rhs, rhs_size, output);
+}
+
+size_t SubtractSorted(const int* lhs, size_t lhs_size, const int* rhs, size_t rhs_size, int* output) {
+    size_t count = 0;
+    size_t j = 0;
+    const bool is_galloping = rhs_size / GALLOP_RATIO >= lhs_size;
+    for (size_t i = 0; i < lhs_size; ++i) {
+        if (is_galloping) {
+            j = Gallop(rhs, j, rhs_size, lhs[i]);
+        } else {
+            while (j < rhs_size && rhs[j] < lhs[i]) {
+                ++j;
+            }
+        }
+        if (j == rhs_size || rhs[j] != lhs[i]) {
+            output[count++] = lhs[i];
+        }
+    }
+    return count;
+}
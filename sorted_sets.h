@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+
+// Set operations on ascending arrays of distinct ints, such as the ordinals of posting
+// lists. Results are ascending as well. output may be lhs itself: no element is written
+// before the element of lhs at the same index has been read.
+
+// lhs and rhs in common. When one array is much longer than the other, every element of
+// the shorter one gallops through it; otherwise blocks of four are compared with SIMD
+size_t IntersectSorted(const int* lhs, size_t lhs_size, const int* rhs, size_t rhs_size, int* output);
+// lhs without the elements of rhs, galloping through rhs when it is much longer
+size_t SubtractSorted(const int* lhs, size_t lhs_size, const int* rhs, size_t rhs_size, int* output);
@@ -1,7 +1,15 @@
+#include "string_processing.h"
+
+#include <algorithm>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <string_view>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
 std::vector<std::string> SplitIntoWords(const std::string& text) {
@@ -24,16 +32,110 @@ std::vector<std::string> SplitIntoWords(const std::string& text) {
     return words;
 }
 
-vector<string_view> SplitIntoWordsView(const string_view str) {
-    vector<string_view> result;
-    int64_t pos = str.find_first_not_of(" ");
-    const int64_t pos_end = str.npos;
-    
-    while (pos != pos_end) {
-        int64_t space = str.find(' ', pos);
-        result.push_back(space == pos_end ? str.substr(pos) : str.substr(pos, space - pos));
-        pos = str.find_first_not_of(" ", space);
+namespace {
+
+// Bit i of each mask describes byte i of a block
+struct BlockMasks {
+    uint32_t spaces;
+    uint32_t controls;
+};
+
+constexpr size_t SCAN_BLOCK_SIZE = 32;
+
+BlockMasks ScanBytes(const char* data, size_t count) {
+    BlockMasks masks{ 0, 0 };
+    for (size_t i = 0; i < count; ++i) {
+        const auto c = static_cast<unsigned char>(data[i]);
+        if (c == ' ') {
+            masks.spaces |= 1u << i;
+        } else if (c < ' ') {
+            masks.controls |= 1u << i;
+        }
+    }
+    return masks;
+}
+
+#if defined(__AVX2__)
+BlockMasks ScanBlock(const char* data) {
+    const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    const __m256i spaces = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' '));
+    // Bytes below ' ' are the ones left unchanged by an unsigned min with ' ' - 1
+    const __m256i controls = _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, _mm256_set1_epi8(' ' - 1)), bytes);
+    return { static_cast<uint32_t>(_mm256_movemask_epi8(spaces)), static_cast<uint32_t>(_mm256_movemask_epi8(controls)) };
+}
+#elif defined(__SSE2__)
+BlockMasks ScanBlock(const char* data) {
+    BlockMasks masks{ 0, 0 };
+    for (size_t half = 0; half < SCAN_BLOCK_SIZE; half += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + half));
+        const __m128i spaces = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '));
+        const __m128i controls = _mm_cmpeq_epi8(_mm_min_epu8(bytes, _mm_set1_epi8(' ' - 1)), bytes);
+        masks.spaces |= static_cast<uint32_t>(_mm_movemask_epi8(spaces)) << half;
+        masks.controls |= static_cast<uint32_t>(_mm_movemask_epi8(controls)) << half;
+    }
+    return masks;
+}
+#else
+BlockMasks ScanBlock(const char* data) {
+    return ScanBytes(data, SCAN_BLOCK_SIZE);
+}
+#endif
+
+// Words start and end where a byte's "is space" bit differs from the previous byte's,
+// so each block costs one scan plus one step per word boundary
+template <bool Validate>
+bool Tokenize(const string_view str, vector<string_view>& words) {
+    words.clear();
+    constexpr size_t NO_WORD = string_view::npos;
+    size_t word_start = NO_WORD;
+    for (size_t block = 0; block < str.size(); block += SCAN_BLOCK_SIZE) {
+        const size_t count = min(SCAN_BLOCK_SIZE, str.size() - block);
+        const BlockMasks masks = count == SCAN_BLOCK_SIZE ? ScanBlock(str.data() + block) : ScanBytes(str.data() + block, count);
+        if (Validate && masks.controls != 0) {
+            return false;
+        }
+        const uint32_t valid = count == SCAN_BLOCK_SIZE ? ~0u : (1u << count) - 1;
+        const uint32_t letters = ~masks.spaces & valid;
+        uint32_t boundaries = (letters ^ (letters << 1 | (word_start != NO_WORD ? 1u : 0u))) & valid;
+        while (boundaries != 0) {
+            const size_t pos = block + __builtin_ctz(boundaries);
+            if (word_start == NO_WORD) {
+                word_start = pos;
+            } else {
+                words.push_back(str.substr(word_start, pos - word_start));
+                word_start = NO_WORD;
+            }
+            boundaries &= boundaries - 1;
+        }
     }
+    if (word_start != NO_WORD) {
+        words.push_back(str.substr(word_start));
+    }
+    return true;
+}
 
+}  // namespace
+
+vector<string_view> SplitIntoWordsView(const string_view str) {
+    vector<string_view> result;
+    SplitIntoWordsView(str, result);
     return result;
-}
\ No newline at end of file
+}
+
+void SplitIntoWordsView(const string_view str, vector<string_view>& words) {
+    Tokenize<false>(str, words);
+}
+
+bool SplitIntoValidWords(const string_view str, vector<string_view>& words) {
+    return Tokenize<true>(str, words);
+}
+
+bool HasControlCharacters(const string_view str) {
+    size_t block = 0;
+    for (; block + SCAN_BLOCK_SIZE <= str.size(); block += SCAN_BLOCK_SIZE) {
+        if (ScanBlock(str.data() + block).controls != 0) {
+            return true;
+        }
+    }
+    return ScanBytes(str.data() + block, str.size() - block).controls != 0;
+}
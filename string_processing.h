@@ -10,6 +10,13 @@ int ReadLineWithNumber();
 
 std::vector<std::string> SplitIntoWords(const std::string& text);
 std::vector<std::string_view> SplitIntoWordsView(const std::string_view str);
+// Replaces the contents of words with the words of str, so one buffer can serve many calls
+void SplitIntoWordsView(const std::string_view str, std::vector<std::string_view>& words);
+// Same, but also checks for control characters in that pass. Returns false on the first one,
+// leaving words incomplete
+bool SplitIntoValidWords(const std::string_view str, std::vector<std::string_view>& words);
+// Control characters are the bytes below ' '; words must not contain them
+bool HasControlCharacters(const std::string_view str);
 
 template <typename StringContainer>
 std::set<std::string_view> MakeUniqueNonEmptyStrings(const StringContainer& strings) {
@@ -0,0 +1,121 @@
+#include "term_dictionary.h"
+
+#include <string>
+
+using namespace std;
+
+namespace {
+
+uint64_t HashTerm(string_view term) {
+    // FNV-1a: stable across runs and platforms, unlike std::hash
+    uint64_t hash = 14695981039346656037ull;
+    for (const char c : term) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+}  // namespace
+
+TermId TermDictionary::Intern(string_view term) {
+    if (const TermId id = Find(term); id != NO_TERM) {
+        return id;
+    }
+    const auto id = static_cast<TermId>(size());
+    const string_view stored = storage_.Store(term);
+    terms_.push_back(stored);
+    ids_.emplace(stored, id);
+    return id;
+}
+
+TermId TermDictionary::InternStable(string_view term) {
+    if (const TermId id = Find(term); id != NO_TERM) {
+        return id;
+    }
+    const auto id = static_cast<TermId>(size());
+    terms_.push_back(term);
+    ids_.emplace(term, id);
+    return id;
+}
+
+TermId TermDictionary::Find(string_view term) const {
+    if (mapped_term_count_ > 0) {
+        if (const TermId id = FindMapped(term); id != NO_TERM) {
+            return id;
+        }
+    }
+    const auto it = ids_.find(term);
+    return it == ids_.end() ? NO_TERM : it->second;
+}
+
+TermId TermDictionary::FindMapped(string_view term) const {
+    for (size_t slot = HashTerm(term) & mapped_slot_mask_;; slot = (slot + 1) & mapped_slot_mask_) {
+        const TermId id = mapped_slots_[slot];
+        if (id == NO_TERM || GetTerm(id) == term) {
+            return id;
+        }
+    }
+}
+
+string_view TermDictionary::GetTerm(TermId id) const {
+    if (id < mapped_term_count_) {
+        return { mapped_bytes_ + mapped_offsets_[id], mapped_offsets_[id + 1] - mapped_offsets_[id] };
+    }
+    return terms_.at(id - mapped_term_count_);
+}
+
+size_t TermDictionary::size() const {
+    return mapped_term_count_ + terms_.size();
+}
+
+size_t TermDictionary::GetMemoryUsage() const {
+    // Hash node: next pointer + key + value + cached hash
+    constexpr size_t node_size = sizeof(void*) + sizeof(string_view) + sizeof(TermId) + sizeof(size_t);
+    return ids_.bucket_count() * sizeof(void*) + ids_.size() * node_size
+        + terms_.capacity() * sizeof(string_view) + storage_.GetAllocatedBytes();
+}
+
+void TermDictionary::Save(IndexWriter& writer) const {
+    const uint64_t term_count = size();
+    vector<uint64_t> offsets;
+    offsets.reserve(term_count + 1);
+    offsets.push_back(0);
+    string bytes;
+    for (TermId id = 0; id < term_count; ++id) {
+        bytes += GetTerm(id);
+        offsets.push_back(bytes.size());
+    }
+
+    // Open addressing with linear probing at load factor of at most 1/2
+    uint64_t slot_count = 16;
+    while (slot_count < term_count * 2) {
+        slot_count *= 2;
+    }
+    vector<TermId> slots(slot_count, NO_TERM);
+    for (TermId id = 0; id < term_count; ++id) {
+        size_t slot = HashTerm(GetTerm(id)) & (slot_count - 1);
+        while (slots[slot] != NO_TERM) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        slots[slot] = id;
+    }
+
+    writer.Write(term_count);
+    writer.WriteArray(offsets.data(), offsets.size());
+    writer.WriteArray(bytes.data(), bytes.size());
+    writer.Write(slot_count);
+    writer.WriteArray(slots.data(), slots.size());
+}
+
+void TermDictionary::Load(IndexReader& reader) {
+    const auto term_count = reader.Read<uint64_t>();
+    mapped_offsets_ = reader.ReadArray<uint64_t>(term_count + 1);
+    mapped_bytes_ = reader.ReadArray<char>(mapped_offsets_[term_count]);
+    const auto slot_count = reader.Read<uint64_t>();
+    if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0 || slot_count <= term_count) {
+        throw invalid_argument("Index file has a broken term table");
+    }
+    mapped_slots_ = reader.ReadArray<TermId>(slot_count);
+    mapped_slot_mask_ = slot_count - 1;
+    mapped_term_count_ = term_count;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "index_file.h"
+#include "text_arena.h"
+
+using TermId = uint32_t;
+
+// Interns every distinct word once and gives it a dense id, so the index and
+// query evaluation work with integers instead of comparing strings.
+// Terms loaded from an index file stay in the mapping and are found through the
+// file's own hash table; terms interned afterwards go to an in-memory table.
+class TermDictionary {
+public:
+    static constexpr TermId NO_TERM = std::numeric_limits<TermId>::max();
+
+    TermId Intern(std::string_view term);
+    // Like Intern, but keeps the view instead of copying the term, which must outlive the dictionary
+    TermId InternStable(std::string_view term);
+    // NO_TERM when the word has never been interned
+    TermId Find(std::string_view term) const;
+    std::string_view GetTerm(TermId id) const;
+
+    size_t size() const;
+    size_t GetMemoryUsage() const;
+
+    void Save(IndexWriter& writer) const;
+    // Must be called on an empty dictionary; the reader's memory has to outlive it
+    void Load(IndexReader& reader);
+
+private:
+    // Terms [0, mapped_term_count_) as stored in an index file
+    size_t mapped_term_count_ = 0;
+    const uint64_t* mapped_offsets_ = nullptr;
+    const char* mapped_bytes_ = nullptr;
+    const TermId* mapped_slots_ = nullptr;
+    size_t mapped_slot_mask_ = 0;
+
+    // Terms interned in memory, with ids starting at mapped_term_count_.
+    // They are never released, so their views into the arena stay valid
+    TextArena storage_{ 64 * 1024 };
+    std::vector<std::string_view> terms_;
+    std::unordered_map<std::string_view, TermId> ids_;
+
+    TermId FindMapped(std::string_view term) const;
+};
@@ -0,0 +1,243 @@
+// Counts the heap allocations of warmed queries. Built from the sources of the parent
+// directory except main.cpp, with -ltbb -lpthread; replaces the global operator new, so
+// it is a program of its own
+#include <atomic>
+#include <cstdlib>
+#include <execution>
+#include <functional>
+#include <future>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../search_server.h"
+#include "test_framework.h"
+
+using namespace std;
+
+// Allocations made by any thread through any form of operator new; parallel queries run
+// part of their work on the threads of the pool
+atomic<size_t> allocation_count{ 0 };
+
+void* Allocate(size_t size, size_t alignment = 0) noexcept {
+    ++allocation_count;
+    size = max<size_t>(size, 1);
+    if (alignment == 0) {
+        return malloc(size);
+    }
+    return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+void* AllocateOrThrow(size_t size, size_t alignment = 0) {
+    if (void* pointer = Allocate(size, alignment)) {
+        return pointer;
+    }
+    throw bad_alloc();
+}
+
+void* operator new(size_t size) {
+    return AllocateOrThrow(size);
+}
+void* operator new[](size_t size) {
+    return AllocateOrThrow(size);
+}
+void* operator new(size_t size, align_val_t alignment) {
+    return AllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, align_val_t alignment) {
+    return AllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    return Allocate(size);
+}
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+    return Allocate(size);
+}
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    return Allocate(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    return Allocate(size, static_cast<size_t>(alignment));
+}
+// malloc and aligned_alloc memory are both released by free
+void operator delete(void* pointer) noexcept {
+    free(pointer);
+}
+void operator delete[](void* pointer) noexcept {
+    free(pointer);
+}
+void operator delete(void* pointer, size_t) noexcept {
+    free(pointer);
+}
+void operator delete[](void* pointer, size_t) noexcept {
+    free(pointer);
+}
+void operator delete(void* pointer, align_val_t) noexcept {
+    free(pointer);
+}
+void operator delete[](void* pointer, align_val_t) noexcept {
+    free(pointer);
+}
+void operator delete(void* pointer, size_t, align_val_t) noexcept {
+    free(pointer);
+}
+void operator delete[](void* pointer, size_t, align_val_t) noexcept {
+    free(pointer);
+}
+void operator delete(void* pointer, const nothrow_t&) noexcept {
+    free(pointer);
+}
+void operator delete[](void* pointer, const nothrow_t&) noexcept {
+    free(pointer);
+}
+void operator delete(void* pointer, align_val_t, const nothrow_t&) noexcept {
+    free(pointer);
+}
+void operator delete[](void* pointer, align_val_t, const nothrow_t&) noexcept {
+    free(pointer);
+}
+
+namespace {
+
+vector<string> MakeTexts(mt19937& generator, size_t count, int max_word_count) {
+    vector<string> texts;
+    for (size_t i = 0; i < count; ++i) {
+        string text;
+        for (int j = uniform_int_distribution(1, max_word_count)(generator); j > 0; --j) {
+            text += (text.empty() ? ""s : " "s) + "w"s + to_string(uniform_int_distribution(0, 500)(generator));
+        }
+        texts.push_back(move(text));
+    }
+    return texts;
+}
+
+// The most allocations any of the queries makes once every query ran a few times before.
+// result is the caller's buffer
+template <typename Search>
+size_t CountMaxAllocations(const vector<string>& queries, Search search) {
+    vector<Document> result;
+    for (int round = 0; round < 3; ++round) {
+        for (const string& query : queries) {
+            search(query, result);
+        }
+    }
+    size_t max_allocations = 0;
+    for (const string& query : queries) {
+        const size_t before = allocation_count;
+        search(query, result);
+        max_allocations = max(max_allocations, allocation_count - before);
+    }
+    return max_allocations;
+}
+
+// Calls func once on every worker of the pool: every task waits until all have started, so no
+// worker gets two. Which worker takes which part of a parallel query varies from run to run,
+// so warming the workers by running queries in parallel would leave some buffers to chance
+void RunOnEveryWorker(ThreadPool& thread_pool, const function<void()>& func) {
+    atomic<size_t> started_count{ 0 };
+    vector<future<void>> tasks;
+    for (size_t i = 0; i < thread_pool.GetThreadCount(); ++i) {
+        tasks.push_back(thread_pool.Submit([&] {
+            ++started_count;
+            while (started_count < thread_pool.GetThreadCount()) {
+                this_thread::yield();
+            }
+            func();
+        }));
+    }
+    for (future<void>& task : tasks) {
+        task.get();
+    }
+}
+
+// Queries with a quoted phrase of two of their words
+vector<string> MakePhraseQueries(const vector<string>& queries) {
+    vector<string> phrase_queries;
+    for (const string& query : queries) {
+        const size_t space = query.find(' ');
+        if (space == string::npos) {
+            continue;
+        }
+        const size_t end = query.find(' ', space + 1);
+        phrase_queries.push_back('"' + query.substr(0, end) + "\"~3" + (end == string::npos ? ""s : query.substr(end)));
+    }
+    return phrase_queries;
+}
+
+}  // namespace
+
+// Once the buffers of the threads have grown, a query into a reused result allocates nothing,
+// whatever the execution, and a hit of the result cache neither
+void TestWarmQueriesDoNotAllocate() {
+    mt19937 generator(7);
+    SearchServer search_server("w0"s);
+    // Workers of their own, whatever the cores of the machine
+    const auto thread_pool = make_shared<ThreadPool>(4);
+    search_server.SetThreadPool(thread_pool);
+    for (const string& text : MakeTexts(generator, 3'000, 40)) {
+        search_server.AddDocument(search_server.GetDocumentCount(), text, DocumentStatus::ACTUAL, { 1, 2 });
+    }
+    search_server.WaitForMerges();
+    search_server.SetImpactOrdering(true);
+    search_server.SetPositionalIndex(true);
+    const auto queries = MakeTexts(generator, 100, 10);
+    const auto phrase_queries = MakePhraseQueries(queries);
+
+    vector<pair<string, SearchOptions>> option_sets(4);
+    option_sets[0].first = "wand"s;
+    option_sets[0].second.dynamic_pruning = true;
+    option_sets[1].first = "exhaustive"s;
+    option_sets[2].first = "impact ordered"s;
+    option_sets[2].second.impact_ordered = true;
+    option_sets[3].first = "conjunctive"s;
+    option_sets[3].second.conjunctive = true;
+    const auto is_even = [](int document_id, DocumentStatus, int) {
+        return document_id % 2 == 0;
+    };
+    const PartitionedExecution partitioned{ 4 };
+    const auto check = [&](const string& mark, const vector<string>& texts, const SearchOptions& options) {
+        ASSERT_EQUAL_HINT(CountMaxAllocations(texts, [&](const string& query, vector<Document>& result) {
+            search_server.FindTopDocuments(query, DocumentStatus::ACTUAL, options, result);
+        }), 0u, mark + " by status"s);
+        ASSERT_EQUAL_HINT(CountMaxAllocations(texts, [&](const string& query, vector<Document>& result) {
+            search_server.FindTopDocuments(query, is_even, options, result);
+        }), 0u, mark + " by predicate"s);
+        // A sequential query grows the buffers of its thread for every part of it a worker can get
+        RunOnEveryWorker(*thread_pool, [&] {
+            vector<Document> result;
+            for (const string& query : texts) {
+                search_server.FindTopDocuments(query, DocumentStatus::ACTUAL, options, result);
+            }
+        });
+        ASSERT_EQUAL_HINT(CountMaxAllocations(texts, [&](const string& query, vector<Document>& result) {
+            search_server.FindTopDocuments(execution::par, query, DocumentStatus::ACTUAL, options, result);
+        }), 0u, mark + " par by status"s);
+        ASSERT_EQUAL_HINT(CountMaxAllocations(texts, [&](const string& query, vector<Document>& result) {
+            search_server.FindTopDocuments(execution::par, query, is_even, options, result);
+        }), 0u, mark + " par by predicate"s);
+        ASSERT_EQUAL_HINT(CountMaxAllocations(texts, [&](const string& query, vector<Document>& result) {
+            search_server.FindTopDocuments(partitioned, query, DocumentStatus::ACTUAL, options, result);
+        }), 0u, mark + " partitioned by status"s);
+        ASSERT_EQUAL_HINT(CountMaxAllocations(texts, [&](const string& query, vector<Document>& result) {
+            search_server.FindTopDocuments(partitioned, query, is_even, options, result);
+        }), 0u, mark + " partitioned by predicate"s);
+    };
+    for (const auto& [mark, options] : option_sets) {
+        check(mark, queries, options);
+        check(mark + " phrase"s, phrase_queries, options);
+    }
+
+    // Every query is a hit once the warm-up rounds have cached it
+    search_server.SetResultCacheCapacity(1'000);
+    SearchOptions cached_options;
+    cached_options.predicate_id = 1;
+    check("cached"s, queries, cached_options);
+    check("cached phrase"s, phrase_queries, cached_options);
+    ASSERT(search_server.GetResultCacheStats().hits > 0);
+}
+
+int main() {
+    RUN_TEST(TestWarmQueriesDoNotAllocate);
+}
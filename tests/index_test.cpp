@@ -0,0 +1,383 @@
+// Tests of the building blocks of the index. Built from the sources of the parent
+// directory except main.cpp, with -ltbb -lpthread
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../concurrent_score_table.h"
+#include "../index_file.h"
+#include "../inverted_index.h"
+#include "../position_index.h"
+#include "../sorted_sets.h"
+#include "../string_processing.h"
+#include "../term_dictionary.h"
+#include "../text_arena.h"
+#include "../thread_pool.h"
+#include "../thread_scratch.h"
+#include "../top_documents.h"
+#include "test_framework.h"
+
+using namespace std;
+
+namespace {
+
+vector<int> MakeSortedSet(mt19937& generator, size_t size, int range) {
+    set<int> values;
+    while (values.size() < size && values.size() < static_cast<size_t>(range)) {
+        values.insert(uniform_int_distribution(0, range - 1)(generator));
+    }
+    return { values.begin(), values.end() };
+}
+
+// One posting list of documents 0, 3, 6, ... with word counts 1, 2, 3, 1, 2, 3, ... out of 7 words
+InvertedIndex MakeIndex(size_t posting_count) {
+    vector<int> document_ids;
+    vector<vector<TermFrequency>> term_freqs;
+    for (size_t i = 0; i < posting_count; ++i) {
+        document_ids.push_back(static_cast<int>(3 * i));
+        double term_freq = 0.0;
+        for (size_t j = 0; j <= i % 3; ++j) {
+            term_freq += 1.0 / 7;
+        }
+        term_freqs.push_back({ { 0, term_freq } });
+    }
+    ThreadPool thread_pool(2);
+    InvertedIndex index;
+    index.AddDocuments(thread_pool, document_ids, term_freqs);
+    return index;
+}
+
+// Compresses an index of MakeIndex with the word counts it was made from
+void CompressIndex(InvertedIndex& index, PostingCodec codec, size_t posting_count) {
+    vector<vector<uint32_t>> word_counts(1);
+    for (size_t i = 0; i < posting_count; ++i) {
+        word_counts[0].push_back(static_cast<uint32_t>(i % 3 + 1));
+    }
+    index.Compress(codec, word_counts, vector<uint32_t>(3 * posting_count, 7));
+}
+
+vector<pair<int, double>> ReadPostings(const PostingList& postings) {
+    vector<pair<int, double>> result;
+    for (PostingCursor cursor(postings); !cursor.AtEnd(); cursor.Next()) {
+        result.push_back({ cursor.GetDocumentId(), cursor.GetTermFreq() });
+    }
+    return result;
+}
+
+}  // namespace
+
+void TestSplitIntoValidWords() {
+    vector<string_view> words;
+    ASSERT(SplitIntoValidWords("  white  cat and hat ", words));
+    ASSERT((words == vector<string_view>{ "white", "cat", "and", "hat" }));
+    // Words longer than a scan block and boundaries on its edge
+    const string long_text = string(31, 'a') + " "s + string(40, 'b') + " c"s;
+    ASSERT(SplitIntoValidWords(long_text, words));
+    ASSERT((words == vector<string_view>{ string(31, 'a'), string(40, 'b'), "c" }));
+    ASSERT(!SplitIntoValidWords("white c\tt", words));
+    ASSERT(!SplitIntoValidWords(string(40, 'a') + "\x01"s, words));
+    ASSERT(HasControlCharacters(string(40, 'a') + "\x01"s));
+    ASSERT(!HasControlCharacters(long_text));
+    ASSERT(SplitIntoValidWords("", words));
+    ASSERT(words.empty());
+    ASSERT((SplitIntoWordsView("a bb  ccc"s) == vector<string_view>{ "a", "bb", "ccc" }));
+}
+
+void TestSortedSetOperations() {
+    mt19937 generator(3);
+    for (int i = 0; i < 2'000; ++i) {
+        const int range = uniform_int_distribution(1, 6'000)(generator);
+        auto lhs = MakeSortedSet(generator, uniform_int_distribution(0, 70)(generator), range);
+        // Every third pair is skewed, which takes the galloping path
+        auto rhs = MakeSortedSet(generator, uniform_int_distribution(0, i % 3 == 0 ? 5'000 : 70)(generator), range);
+        if (i % 2 == 1) {
+            swap(lhs, rhs);
+        }
+        vector<int> intersection;
+        vector<int> difference;
+        set_intersection(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), back_inserter(intersection));
+        set_difference(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), back_inserter(difference));
+
+        // In place, as the conjunctive queries use them
+        auto result = lhs;
+        result.resize(IntersectSorted(result.data(), result.size(), rhs.data(), rhs.size(), result.data()));
+        ASSERT(result == intersection);
+        result = lhs;
+        result.resize(SubtractSorted(result.data(), result.size(), rhs.data(), rhs.size(), result.data()));
+        ASSERT(result == difference);
+    }
+}
+
+void TestTermDictionary() {
+    TermDictionary dictionary;
+    ASSERT_EQUAL(dictionary.Intern("cat"), 0u);
+    ASSERT_EQUAL(dictionary.Intern("dog"), 1u);
+    ASSERT_EQUAL(dictionary.Intern("cat"), 0u);
+    ASSERT_EQUAL(dictionary.Find("dog"), 1u);
+    ASSERT_EQUAL(dictionary.Find("bird"), TermDictionary::NO_TERM);
+    ASSERT_EQUAL(dictionary.GetTerm(1), "dog"sv);
+    ASSERT_EQUAL(dictionary.size(), 2u);
+
+    // A loaded dictionary serves the saved terms from the file and interns new ones in memory
+    ostringstream output;
+    IndexWriter writer(output);
+    dictionary.Save(writer);
+    const string bytes = output.str();
+    IndexReader reader(bytes.data(), bytes.size());
+    TermDictionary loaded;
+    loaded.Load(reader);
+    ASSERT_EQUAL(loaded.Find("cat"), 0u);
+    ASSERT_EQUAL(loaded.Find("dog"), 1u);
+    ASSERT_EQUAL(loaded.Find("bird"), TermDictionary::NO_TERM);
+    ASSERT_EQUAL(loaded.Intern("bird"), 2u);
+    ASSERT_EQUAL(loaded.Find("bird"), 2u);
+    ASSERT_EQUAL(loaded.GetTerm(0), "cat"sv);
+}
+
+void TestTextArena() {
+    TextArena arena(16);
+    vector<string> texts;
+    vector<string_view> stored;
+    for (int i = 0; i < 100; ++i) {
+        texts.push_back(string(i % 20, static_cast<char>('a' + i % 26)));
+        stored.push_back(arena.Store(texts.back()));
+    }
+    // Views stay valid while more texts are stored
+    for (size_t i = 0; i < texts.size(); ++i) {
+        ASSERT_EQUAL(stored[i], string_view(texts[i]));
+    }
+    ASSERT(arena.GetAllocatedBytes() >= 950);
+}
+
+void TestTopDocuments() {
+    TopDocuments top(3);
+    ASSERT_EQUAL(top.GetRelevanceThreshold(), -numeric_limits<double>::infinity());
+    for (int id = 0; id < 10; ++id) {
+        top.Push({ id, id * 0.5, 0 });
+    }
+    ASSERT(abs(top.GetRelevanceThreshold() - (3.5 - ACCURACY)) < 1e-12);
+    const auto documents = top.Release();
+    ASSERT_EQUAL(documents.size(), 3u);
+    ASSERT_EQUAL(documents[0].id, 9);
+    ASSERT_EQUAL(documents[1].id, 8);
+    ASSERT_EQUAL(documents[2].id, 7);
+
+    // Near-equal relevances are ranked by rating, then by id
+    TopDocuments ties(3);
+    ties.Push({ 5, 1.0, 1 });
+    ties.Push({ 4, 1.0 + ACCURACY / 2, 1 });
+    ties.Push({ 3, 1.0, 2 });
+    const auto ranked = ties.Release();
+    ASSERT_EQUAL(ranked[0].id, 3);
+    ASSERT_EQUAL(ranked[1].id, 4);
+    ASSERT_EQUAL(ranked[2].id, 5);
+
+    TopDocuments empty(0);
+    empty.Push({ 1, 1.0, 1 });
+    ASSERT(empty.Release().empty());
+}
+
+void TestPostingCursor() {
+    const InvertedIndex index = MakeIndex(1'000);
+    const PostingList& postings = *index.FindPostings(0);
+    ASSERT_EQUAL(postings.size(), 1'000u);
+    ASSERT(index.FindPostings(1) == nullptr);
+    const auto expected = ReadPostings(postings);
+
+    PostingCursor cursor(postings);
+    cursor.Seek(301);
+    ASSERT_EQUAL(cursor.GetDocumentId(), 303);
+    cursor.Seek(303);
+    ASSERT_EQUAL(cursor.GetDocumentId(), 303);
+    cursor.Seek(3'000);
+    ASSERT(cursor.AtEnd());
+
+    // A range of blocks only has their postings
+    size_t count = 0;
+    for (PostingCursor range(postings, 2, 4); !range.AtEnd(); range.Next()) {
+        ASSERT(range.GetDocumentId() == expected[2 * POSTING_BLOCK_SIZE + count].first);
+        ++count;
+    }
+    ASSERT_EQUAL(count, 2 * POSTING_BLOCK_SIZE);
+}
+
+void TestPostingCodecs() {
+    const InvertedIndex raw_index = MakeIndex(1'000);
+    const auto expected = ReadPostings(*raw_index.FindPostings(0));
+    for (const PostingCodec codec : { PostingCodec::VARINT, PostingCodec::BIT_PACKED }) {
+        InvertedIndex index = MakeIndex(1'000);
+        CompressIndex(index, codec, 1'000);
+        const PostingList& postings = *index.FindPostings(0);
+        ASSERT(postings.compressed != nullptr);
+        // Frequencies come back bit-identical
+        ASSERT(ReadPostings(postings) == expected);
+
+        PostingCursor cursor(postings);
+        for (const int document_id : { 0, 1, 383, 384, 385, 1'500, 2'997 }) {
+            cursor.Seek(document_id);
+            const auto it = lower_bound(expected.begin(), expected.end(), pair{ document_id, 0.0 });
+            ASSERT(!cursor.AtEnd());
+            ASSERT_EQUAL(cursor.GetDocumentId(), it->first);
+            ASSERT_EQUAL(cursor.GetTermFreq(), it->second);
+        }
+        cursor.Seek(2'998);
+        ASSERT(cursor.AtEnd());
+    }
+}
+
+// Every bit width round-trips, values straddling the packed words and partial blocks included
+void TestBitPackedWidths() {
+    mt19937 generator(5);
+    for (uint32_t width = 1; width <= 30; ++width) {
+        const size_t size = 2 * POSTING_BLOCK_SIZE + width;
+        vector<int> document_ids;
+        vector<uint32_t> word_counts;
+        vector<uint32_t> document_lengths;
+        int document_id = -1;
+        for (size_t i = 0; i < size; ++i) {
+            document_id += 1 + static_cast<int>(uniform_int_distribution<uint32_t>(0, (1u << width) - 1)(generator) / size);
+            document_ids.push_back(document_id);
+            word_counts.push_back(uniform_int_distribution<uint32_t>(1, 4)(generator));
+            document_lengths.push_back(word_counts.back() + uniform_int_distribution<uint32_t>(0, (1u << width) - 1)(generator));
+        }
+        for (const PostingCodec codec : { PostingCodec::VARINT, PostingCodec::BIT_PACKED }) {
+            const CompressedPostings postings(codec, document_ids.data(), word_counts.data(), document_lengths.data(), size);
+            int decoded_ids[POSTING_BLOCK_SIZE];
+            double term_freqs[POSTING_BLOCK_SIZE];
+            for (size_t block = 0; block < postings.GetBlockCount(); ++block) {
+                const size_t count = postings.DecodeBlock(block, decoded_ids, term_freqs);
+                for (size_t i = 0; i < count; ++i) {
+                    const size_t posting = block * POSTING_BLOCK_SIZE + i;
+                    ASSERT_EQUAL(decoded_ids[i], document_ids[posting]);
+                    double term_freq = 0.0;
+                    for (uint32_t j = 0; j < word_counts[posting]; ++j) {
+                        term_freq += 1.0 / document_lengths[posting];
+                    }
+                    ASSERT_EQUAL(term_freqs[i], term_freq);
+                }
+            }
+        }
+    }
+}
+
+// Raw and compressed cursors see the same blocks, with the largest frequency and the last id of each
+void TestBlockMaxima() {
+    const auto expected = ReadPostings(*MakeIndex(1'000).FindPostings(0));
+    const auto check = [&expected](PostingCursor cursor, size_t first_posting) {
+        for (size_t i = first_posting; !cursor.AtEnd(); cursor.Next(), ++i) {
+            const size_t block_begin = i / POSTING_BLOCK_SIZE * POSTING_BLOCK_SIZE;
+            const size_t block_end = min(block_begin + POSTING_BLOCK_SIZE, expected.size());
+            double block_max = 0.0;
+            for (size_t j = block_begin; j < block_end; ++j) {
+                block_max = max(block_max, expected[j].second);
+            }
+            ASSERT_EQUAL(cursor.GetBlockMaxTermFreq(), block_max);
+            ASSERT_EQUAL(cursor.GetBlockLastDocumentId(), expected[block_end - 1].first);
+        }
+    };
+    for (const PostingCodec codec : { PostingCodec::RAW, PostingCodec::VARINT, PostingCodec::BIT_PACKED }) {
+        InvertedIndex index = MakeIndex(1'000);
+        CompressIndex(index, codec, 1'000);
+        const PostingList& postings = *index.FindPostings(0);
+        ASSERT_EQUAL(postings.block_max_term_freqs.size(), postings.GetBlockCount());
+        check(PostingCursor(postings), 0);
+        check(PostingCursor(postings, 2, 4), 2 * POSTING_BLOCK_SIZE);
+    }
+}
+
+void TestConcurrentScoreTable() {
+    ConcurrentScoreTable table(1'000);
+    ThreadPool thread_pool(4);
+    thread_pool.ParallelFor(4'000, [&](size_t i) {
+        table.Add(static_cast<int>(i % 1'000), 0.5);
+    });
+    table.Exclude(7);
+    size_t count = 0;
+    table.ForEachInRange(0, table.GetSlotCount(), [&](int document_id, double relevance) {
+        ASSERT(document_id != 7);
+        ASSERT_EQUAL(relevance, 2.0);
+        ++count;
+    });
+    ASSERT_EQUAL(count, 999u);
+}
+
+void TestThreadPool() {
+    ThreadPool thread_pool(4);
+    vector<atomic<int>> calls(1'000);
+    thread_pool.ParallelFor(calls.size(), [&](size_t i) {
+        ++calls[i];
+    });
+    ASSERT(all_of(calls.begin(), calls.end(), [](const atomic<int>& count) { return count == 1; }));
+
+    // Nested calls run on the same workers
+    atomic<int> nested = 0;
+    thread_pool.ParallelFor(100, [&](size_t) {
+        thread_pool.ParallelFor(50, [&](size_t) {
+            ++nested;
+        });
+    });
+    ASSERT_EQUAL(nested.load(), 5'000);
+
+    // The first exception reaches the caller and no index is started after it
+    atomic<int> started = 0;
+    ASSERT_THROWS(thread_pool.ParallelFor(10'000, [&](size_t i) {
+        ++started;
+        if (i == 10) {
+            throw runtime_error("task failed"s);
+        }
+    }), runtime_error);
+    ASSERT(started < 10'000);
+
+    ASSERT_EQUAL(thread_pool.Submit([] { return 42; }).get(), 42);
+}
+
+void TestThreadScratch() {
+    vector<int>* outer_object = nullptr;
+    {
+        ThreadScratch<vector<int>> outer;
+        outer->assign(100, 1);
+        outer_object = &*outer;
+        // A nested scope gets an object of its own
+        ThreadScratch<vector<int>> inner;
+        ASSERT(&*inner != outer_object);
+    }
+    // Later scopes reuse the object with its capacity
+    ThreadScratch<vector<int>> again;
+    ASSERT(&*again == outer_object);
+    ASSERT(again->capacity() >= 100);
+}
+
+void TestCountPhraseOccurrences() {
+    // "new york" in "new york is not new but york is new york"
+    const vector<uint32_t> new_positions{ 0, 4, 8 };
+    const vector<uint32_t> york_positions{ 1, 6, 9 };
+    const vector<uint32_t>* positions[] = { &new_positions, &york_positions };
+    const uint32_t offsets[] = { 0, 1 };
+    vector<size_t> cursors;
+    ASSERT_EQUAL(CountPhraseOccurrences(positions, offsets, 2, 0, cursors), 2.0);
+    // With slop 1, "new but york" adds 1 / (1 + 1)
+    ASSERT_EQUAL(CountPhraseOccurrences(positions, offsets, 2, 1, cursors), 2.5);
+}
+
+int main() {
+    RUN_TEST(TestSplitIntoValidWords);
+    RUN_TEST(TestSortedSetOperations);
+    RUN_TEST(TestTermDictionary);
+    RUN_TEST(TestTextArena);
+    RUN_TEST(TestTopDocuments);
+    RUN_TEST(TestPostingCursor);
+    RUN_TEST(TestPostingCodecs);
+    RUN_TEST(TestBitPackedWidths);
+    RUN_TEST(TestBlockMaxima);
+    RUN_TEST(TestConcurrentScoreTable);
+    RUN_TEST(TestThreadPool);
+    RUN_TEST(TestThreadScratch);
+    RUN_TEST(TestCountPhraseOccurrences);
+}
@@ -0,0 +1,650 @@
+// Tests of SearchServer features. Built from the sources of the parent directory
+// except main.cpp, with -ltbb -lpthread
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <execution>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../process_queries.h"
+#include "../search_server.h"
+#include "test_framework.h"
+
+using namespace std;
+
+namespace {
+
+const vector<string> ANIMAL_TEXTS = {
+    "white cat and yellow hat"s,
+    "curly cat curly tail"s,
+    "nasty dog with big eyes"s,
+    "nasty pigeon john"s,
+};
+
+// Documents 1-4 of ANIMAL_TEXTS with "and with" as stop words; document 3 has the best rating
+SearchServer MakeAnimalServer() {
+    SearchServer search_server("and with"s);
+    for (size_t i = 0; i < ANIMAL_TEXTS.size(); ++i) {
+        search_server.AddDocument(static_cast<int>(i + 1), ANIMAL_TEXTS[i], DocumentStatus::ACTUAL, { static_cast<int>(i % 3) });
+    }
+    return search_server;
+}
+
+struct Corpus {
+    vector<string> documents;
+    vector<string> queries;
+    vector<string> dictionary;
+};
+
+// Words of up to 3 letters from a small alphabet, so queries share plenty of words with
+// the documents and with each other
+Corpus MakeCorpus(size_t document_count, size_t query_count) {
+    mt19937 generator(42);
+    Corpus corpus;
+    for (int i = 0; i < 300; ++i) {
+        string word;
+        for (int j = uniform_int_distribution(1, 3)(generator); j > 0; --j) {
+            word.push_back(uniform_int_distribution('a', 'h')(generator));
+        }
+        corpus.dictionary.push_back(move(word));
+    }
+    sort(corpus.dictionary.begin(), corpus.dictionary.end());
+    corpus.dictionary.erase(unique(corpus.dictionary.begin(), corpus.dictionary.end()), corpus.dictionary.end());
+    const auto make_text = [&](int max_word_count, double minus_prob) {
+        string text;
+        for (int j = uniform_int_distribution(1, max_word_count)(generator); j > 0; --j) {
+            if (!text.empty()) {
+                text.push_back(' ');
+            }
+            if (uniform_real_distribution(0.0, 1.0)(generator) < minus_prob) {
+                text.push_back('-');
+            }
+            text += corpus.dictionary[uniform_int_distribution<size_t>(0, corpus.dictionary.size() - 1)(generator)];
+        }
+        return text;
+    };
+    for (size_t i = 0; i < document_count; ++i) {
+        corpus.documents.push_back(make_text(30, 0.0));
+    }
+    for (size_t i = 0; i < query_count; ++i) {
+        corpus.queries.push_back(make_text(8, 0.1));
+    }
+    return corpus;
+}
+
+DocumentStatus GetCorpusStatus(size_t index) {
+    return index % 5 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL;
+}
+
+vector<int> GetCorpusRatings(size_t index) {
+    return { static_cast<int>(index % 7), static_cast<int>(index % 3) };
+}
+
+// The corpus added in batches of 100, so the server has several segments to merge
+void AddCorpus(SearchServer& search_server, const Corpus& corpus) {
+    for (size_t first = 0; first < corpus.documents.size(); first += 100) {
+        vector<DocumentToAdd> batch;
+        for (size_t i = first; i < min(first + 100, corpus.documents.size()); ++i) {
+            batch.push_back({ static_cast<int>(i), corpus.documents[i], GetCorpusStatus(i), GetCorpusRatings(i) });
+        }
+        search_server.AddDocuments(batch);
+    }
+}
+
+void AssertSameDocuments(const vector<Document>& lhs, const vector<Document>& rhs, const string& hint) {
+    ASSERT_EQUAL_HINT(lhs.size(), rhs.size(), hint);
+    for (size_t i = 0; i < lhs.size(); ++i) {
+        ASSERT_EQUAL_HINT(lhs[i].id, rhs[i].id, hint);
+        ASSERT_HINT(abs(lhs[i].relevance - rhs[i].relevance) < 1e-9, hint);
+        ASSERT_EQUAL_HINT(lhs[i].rating, rhs[i].rating, hint);
+    }
+}
+
+// Every corpus query gives the same documents on both servers
+void AssertSameResults(const SearchServer& lhs, const SearchServer& rhs, const Corpus& corpus, const SearchOptions& options = {}) {
+    for (const string& query : corpus.queries) {
+        AssertSameDocuments(lhs.FindTopDocuments(query, options), rhs.FindTopDocuments(query, options), query);
+    }
+}
+
+}  // namespace
+
+void TestRanking() {
+    const SearchServer search_server = MakeAnimalServer();
+    const auto documents = search_server.FindTopDocuments("curly nasty cat"s);
+    ASSERT_EQUAL(documents.size(), 4u);
+    ASSERT_EQUAL(documents[0].id, 2);
+    ASSERT(abs(documents[0].relevance - 0.866434) < 1e-6);
+    ASSERT_EQUAL(documents[1].id, 4);
+    ASSERT(abs(documents[1].relevance - 0.231049) < 1e-6);
+    // Equal relevances are ranked by rating
+    ASSERT_EQUAL(documents[2].id, 3);
+    ASSERT_EQUAL(documents[3].id, 1);
+    ASSERT(abs(documents[2].relevance - 0.173287) < 1e-6);
+    ASSERT(abs(documents[3].relevance - 0.173287) < 1e-6);
+    ASSERT_EQUAL(documents[2].rating, 2);
+
+    SearchOptions options;
+    options.max_result_count = 2;
+    ASSERT_EQUAL(search_server.FindTopDocuments("curly nasty cat"s, options).size(), 2u);
+    ASSERT(search_server.FindTopDocuments("parrot"s).empty());
+}
+
+void TestStopAndMinusWords() {
+    const SearchServer search_server = MakeAnimalServer();
+    ASSERT(search_server.FindTopDocuments("and with"s).empty());
+    const auto documents = search_server.FindTopDocuments("curly nasty cat -tail"s);
+    ASSERT_EQUAL(documents.size(), 3u);
+    ASSERT(none_of(documents.begin(), documents.end(), [](const Document& document) { return document.id == 2; }));
+    // A minus stop word excludes nothing
+    ASSERT_EQUAL(search_server.FindTopDocuments("cat -and"s).size(), 2u);
+
+    const auto frequencies = search_server.GetWordFrequencies(2);
+    ASSERT_EQUAL(frequencies.size(), 3u);
+    // Word counts, as the server always returned them
+    ASSERT_EQUAL(frequencies.at("curly"sv), 2.0);
+    ASSERT_EQUAL(frequencies.at("tail"sv), 1.0);
+    ASSERT(search_server.GetWordFrequencies(1).count("and"sv) == 0);
+    ASSERT(search_server.GetWordFrequencies(100).empty());
+}
+
+void TestInvalidInput() {
+    ASSERT_THROWS(SearchServer("and w\x01th"s), invalid_argument);
+    SearchServer search_server = MakeAnimalServer();
+    ASSERT_THROWS(search_server.AddDocument(1, "duplicate"s, DocumentStatus::ACTUAL, {}), invalid_argument);
+    ASSERT_THROWS(search_server.AddDocument(-1, "negative"s, DocumentStatus::ACTUAL, {}), invalid_argument);
+    ASSERT_THROWS(search_server.AddDocument(5, "bad w\x02rd"s, DocumentStatus::ACTUAL, {}), invalid_argument);
+    // A batch with one bad document adds none of them
+    ASSERT_THROWS(search_server.AddDocuments({ { 5, "good"sv, DocumentStatus::ACTUAL, {} }, { 5, "again"sv, DocumentStatus::ACTUAL, {} } }),
+                  invalid_argument);
+    ASSERT_THROWS(search_server.AddDocuments({ { 5, "good"sv, DocumentStatus::ACTUAL, {} }, { 6, "b\x03"sv, DocumentStatus::ACTUAL, {} } }),
+                  invalid_argument);
+    ASSERT_EQUAL(search_server.GetDocumentCount(), 4);
+
+    for (const string& query : { "cat --dog"s, "cat -"s, "c\x01t"s }) {
+        ASSERT_THROWS(search_server.FindTopDocuments(query), invalid_argument);
+        ASSERT_THROWS(search_server.FindTopDocuments(execution::par, query), invalid_argument);
+        ASSERT_THROWS(search_server.MatchDocument(query, 1), invalid_argument);
+    }
+    ASSERT_THROWS(search_server.MatchDocument("cat"s, 100), out_of_range);
+    ASSERT_THROWS(search_server.GetDocumentId(100), out_of_range);
+}
+
+void TestFilters() {
+    SearchServer search_server("and with"s);
+    search_server.AddDocument(1, "white cat"s, DocumentStatus::ACTUAL, { 1 });
+    search_server.AddDocument(2, "black cat"s, DocumentStatus::BANNED, { 2 });
+    search_server.AddDocument(3, "grey cat"s, DocumentStatus::IRRELEVANT, { 3 });
+    search_server.AddDocument(4, "ginger cat"s, DocumentStatus::ACTUAL, { 4 });
+
+    const auto actual = search_server.FindTopDocuments("cat"s);
+    ASSERT_EQUAL(actual.size(), 2u);
+    ASSERT_EQUAL(actual[0].id, 4);
+    ASSERT_EQUAL(actual[1].id, 1);
+    const auto banned = search_server.FindTopDocuments(execution::par, "cat"s, DocumentStatus::BANNED);
+    ASSERT_EQUAL(banned.size(), 1u);
+    ASSERT_EQUAL(banned[0].id, 2);
+    const auto even = search_server.FindTopDocuments(PartitionedExecution{ 3 }, "cat"s, [](int document_id, DocumentStatus, int) {
+        return document_id % 2 == 0;
+    });
+    ASSERT_EQUAL(even.size(), 2u);
+    ASSERT_EQUAL(even[0].id, 4);
+    ASSERT_EQUAL(even[1].id, 2);
+}
+
+void TestExecutionPoliciesAgree() {
+    const Corpus corpus = MakeCorpus(2'000, 200);
+    SearchServer search_server("a"s);
+    AddCorpus(search_server, corpus);
+    search_server.WaitForMerges();
+    const auto is_rated = [](int, DocumentStatus, int rating) { return rating > 2; };
+    for (const string& query : corpus.queries) {
+        const auto expected = search_server.FindTopDocuments(query);
+        AssertSameDocuments(search_server.FindTopDocuments(execution::par, query), expected, query);
+        AssertSameDocuments(search_server.FindTopDocuments(PartitionedExecution{ 4 }, query), expected, query);
+        const auto expected_rated = search_server.FindTopDocuments(query, is_rated);
+        AssertSameDocuments(search_server.FindTopDocuments(execution::par, query, is_rated), expected_rated, query);
+        AssertSameDocuments(search_server.FindTopDocuments(PartitionedExecution{ 3 }, query, is_rated), expected_rated, query);
+    }
+}
+
+void TestDynamicPruning() {
+    const Corpus corpus = MakeCorpus(2'000, 200);
+    SearchServer search_server("a"s);
+    AddCorpus(search_server, corpus);
+    search_server.WaitForMerges();
+    for (const size_t max_result_count : { 1, 5, 50 }) {
+        SearchOptions exhaustive;
+        exhaustive.max_result_count = max_result_count;
+        SearchOptions pruned = exhaustive;
+        pruned.dynamic_pruning = true;
+        for (const string& query : corpus.queries) {
+            AssertSameDocuments(search_server.FindTopDocuments(query, pruned), search_server.FindTopDocuments(query, exhaustive), query);
+            AssertSameDocuments(search_server.FindTopDocuments(query, DocumentStatus::BANNED, pruned),
+                                search_server.FindTopDocuments(query, DocumentStatus::BANNED, exhaustive), query);
+        }
+    }
+}
+
+void TestImpactOrdering() {
+    const Corpus corpus = MakeCorpus(2'000, 200);
+    SearchServer search_server("a"s);
+    AddCorpus(search_server, corpus);
+    search_server.WaitForMerges();
+    search_server.SetImpactOrdering(true);
+    SearchOptions impact_ordered;
+    impact_ordered.impact_ordered = true;
+    SearchOptions all;
+    all.max_result_count = corpus.documents.size();
+    for (const string& query : corpus.queries) {
+        map<int, double> exact;
+        for (const Document& document : search_server.FindTopDocuments(query, all)) {
+            exact[document.id] = document.relevance;
+        }
+        const auto expected = search_server.FindTopDocuments(query);
+        const auto documents = search_server.FindTopDocuments(query, impact_ordered);
+        ASSERT_EQUAL_HINT(documents.size(), expected.size(), query);
+        // Returned relevances are exact, and only a little lower than the best ones
+        for (size_t i = 0; i < documents.size(); ++i) {
+            ASSERT_HINT(abs(exact.at(documents[i].id) - documents[i].relevance) < 1e-9, query);
+            ASSERT_HINT(documents[i].relevance > expected[i].relevance - 0.01 * expected[0].relevance, query);
+        }
+    }
+}
+
+void TestRemoveDocuments() {
+    SearchServer search_server = MakeAnimalServer();
+    search_server.RemoveDocument(2);
+    search_server.RemoveDocument(execution::par, 100);
+    ASSERT_EQUAL(search_server.GetDocumentCount(), 3);
+    ASSERT((vector<int>(search_server.begin(), search_server.end()) == vector<int>{ 1, 3, 4 }));
+    ASSERT(search_server.FindTopDocuments("curly"s).empty());
+    ASSERT_THROWS(search_server.MatchDocument("curly"s, 2), out_of_range);
+    ASSERT(search_server.GetWordFrequencies(2).empty());
+
+    search_server.RemoveDocuments({ 1, 3 });
+    search_server.PurgeDeletedDocuments();
+    ASSERT_EQUAL(search_server.GetDocumentCount(), 1);
+    ASSERT_EQUAL(search_server.FindTopDocuments("nasty cat"s).size(), 1u);
+    // A removed id can be added again
+    search_server.AddDocument(2, "curly dog"s, DocumentStatus::ACTUAL, { 5 });
+    const auto documents = search_server.FindTopDocuments("curly"s);
+    ASSERT_EQUAL(documents.size(), 1u);
+    ASSERT_EQUAL(documents[0].rating, 5);
+}
+
+void TestBatchMatchesOneByOne() {
+    const Corpus corpus = MakeCorpus(1'000, 100);
+    SearchServer batched("a"s);
+    AddCorpus(batched, corpus);
+    SearchServer one_by_one("a"s);
+    for (size_t i = 0; i < corpus.documents.size(); ++i) {
+        one_by_one.AddDocument(static_cast<int>(i), corpus.documents[i], GetCorpusStatus(i), GetCorpusRatings(i));
+    }
+    // Background merges do not change results either
+    AssertSameResults(batched, one_by_one, corpus);
+    one_by_one.WaitForMerges();
+    ASSERT_EQUAL(one_by_one.GetDocumentCount(), 1'000);
+    AssertSameResults(batched, one_by_one, corpus);
+    for (int id : { 0, 17, 999 }) {
+        ASSERT(batched.GetWordFrequencies(id) == one_by_one.GetWordFrequencies(id));
+    }
+}
+
+void TestMergesWithRemovals() {
+    const Corpus corpus = MakeCorpus(1'000, 100);
+    SearchServer search_server("a"s);
+    SearchServer expected("a"s);
+    for (size_t i = 0; i < corpus.documents.size(); ++i) {
+        search_server.AddDocument(static_cast<int>(i), corpus.documents[i], GetCorpusStatus(i), GetCorpusRatings(i));
+        if (i % 3 == 0) {
+            search_server.RemoveDocument(static_cast<int>(i));
+        } else {
+            expected.AddDocument(static_cast<int>(i), corpus.documents[i], GetCorpusStatus(i), GetCorpusRatings(i));
+        }
+    }
+    search_server.WaitForMerges();
+    AssertSameResults(search_server, expected, corpus);
+    search_server.PurgeDeletedDocuments();
+    AssertSameResults(search_server, expected, corpus);
+    ASSERT(vector<int>(search_server.begin(), search_server.end()) == vector<int>(expected.begin(), expected.end()));
+
+    // Documents are found by id wherever merges moved them, removed ones until they are added again
+    for (size_t i = 0; i < corpus.documents.size(); i += 3) {
+        search_server.AddDocument(static_cast<int>(i), corpus.documents[i], GetCorpusStatus(i), GetCorpusRatings(i));
+    }
+    search_server.WaitForMerges();
+    for (size_t i = 0; i < corpus.documents.size(); ++i) {
+        // Throws out_of_range for a document it cannot find
+        const auto [words, status] = search_server.MatchDocument(corpus.documents[i], static_cast<int>(i));
+        ASSERT(words.size() == search_server.GetWordFrequencies(static_cast<int>(i)).size());
+        ASSERT(status == GetCorpusStatus(i));
+    }
+    ASSERT_EQUAL(search_server.GetDocumentCount(), 1'000);
+}
+
+// Removed documents' texts and postings are released once their segments are purged
+void TestPurgeReleasesMemory() {
+    SearchServer search_server("a"s);
+    // Long texts of a few words, so the texts outweigh the rest of the index
+    string text;
+    for (int i = 0; i < 100; ++i) {
+        text += "b c d e f g h "s;
+    }
+    vector<int> removed_ids;
+    for (int document_id = 0; document_id < 1'000; ++document_id) {
+        search_server.AddDocument(document_id, text, DocumentStatus::ACTUAL, {});
+        if (document_id % 10 != 0) {
+            removed_ids.push_back(document_id);
+        }
+    }
+    search_server.WaitForMerges();
+    const size_t full_memory = search_server.GetIndexMemoryUsage();
+    search_server.RemoveDocuments(removed_ids);
+    search_server.PurgeDeletedDocuments();
+    search_server.WaitForMerges();
+    ASSERT_EQUAL(search_server.GetDocumentCount(), 100);
+    ASSERT(search_server.GetIndexMemoryUsage() < full_memory / 4);
+}
+
+void TestPostingCodecs() {
+    const Corpus corpus = MakeCorpus(2'000, 100);
+    SearchServer raw("a"s);
+    AddCorpus(raw, corpus);
+    raw.WaitForMerges();
+    SearchServer compressed("a"s);
+    AddCorpus(compressed, corpus);
+    SearchOptions pruned;
+    pruned.dynamic_pruning = true;
+    for (const PostingCodec codec : { PostingCodec::VARINT, PostingCodec::BIT_PACKED }) {
+        compressed.CompressIndex(codec);
+        AssertSameResults(compressed, raw, corpus);
+        AssertSameResults(compressed, raw, corpus, pruned);
+        // Segments added and merged later use the codec as well
+        compressed.AddDocument(10'000, "abc"s, DocumentStatus::ACTUAL, {});
+        compressed.RemoveDocument(10'000);
+        compressed.WaitForMerges();
+        AssertSameResults(compressed, raw, corpus);
+    }
+    compressed.CompressIndex(PostingCodec::RAW);
+    AssertSameResults(compressed, raw, corpus);
+}
+
+void TestSaveAndOpenIndex() {
+    const Corpus corpus = MakeCorpus(1'000, 100);
+    SearchServer search_server("a b"s);
+    AddCorpus(search_server, corpus);
+    search_server.RemoveDocument(7);
+    const string path = (filesystem::temp_directory_path() / "search_server_test_index.bin"s).string();
+    search_server.SaveIndex(path);
+    {
+        SearchServer opened = SearchServer::OpenIndex(path);
+        ASSERT_EQUAL(opened.GetDocumentCount(), search_server.GetDocumentCount());
+        AssertSameResults(opened, search_server, corpus);
+        ASSERT(opened.GetWordFrequencies(3) == search_server.GetWordFrequencies(3));
+        // Stop words are saved with the index
+        ASSERT(opened.FindTopDocuments("a b"s).empty());
+        // An opened index takes updates like any other
+        opened.AddDocument(5'000, "abc abc"s, DocumentStatus::ACTUAL, { 9 });
+        opened.RemoveDocument(0);
+        search_server.AddDocument(5'000, "abc abc"s, DocumentStatus::ACTUAL, { 9 });
+        search_server.RemoveDocument(0);
+        opened.WaitForMerges();
+        AssertSameResults(opened, search_server, corpus);
+    }
+    filesystem::remove(path);
+    ASSERT_THROWS(SearchServer::OpenIndex(path), exception);
+}
+
+void TestResultCache() {
+    SearchServer search_server = MakeAnimalServer();
+    search_server.SetResultCacheCapacity(16);
+    const auto first = search_server.FindTopDocuments("curly nasty cat"s);
+    // The same words in another order and with a repeat are the same query
+    AssertSameDocuments(search_server.FindTopDocuments("cat nasty curly cat"s), first, "cached"s);
+    auto stats = search_server.GetResultCacheStats();
+    ASSERT_EQUAL(stats.hits, 1u);
+    ASSERT_EQUAL(stats.misses, 1u);
+    // Other options and filters are other queries
+    ASSERT(search_server.FindTopDocuments("curly nasty cat"s, DocumentStatus::BANNED).empty());
+    SearchOptions options;
+    options.max_result_count = 1;
+    ASSERT_EQUAL(search_server.FindTopDocuments("curly nasty cat"s, options).size(), 1u);
+    ASSERT_EQUAL(search_server.GetResultCacheStats().hits, 1u);
+
+    // An update makes cached results stale
+    search_server.AddDocument(5, "curly curly curly"s, DocumentStatus::ACTUAL, {});
+    ASSERT_EQUAL(search_server.FindTopDocuments("curly nasty cat"s)[0].id, 5);
+    search_server.RemoveDocument(5);
+    AssertSameDocuments(search_server.FindTopDocuments("curly nasty cat"s), first, "after removal"s);
+
+    search_server.SetResultCacheCapacity(0);
+    stats = search_server.GetResultCacheStats();
+    ASSERT_EQUAL(stats.hits + stats.misses, 0u);
+}
+
+void TestPhrases() {
+    SearchServer search_server("the"s);
+    search_server.AddDocument(1, "new york is big"s, DocumentStatus::ACTUAL, {});
+    search_server.AddDocument(2, "york is new"s, DocumentStatus::ACTUAL, {});
+    search_server.AddDocument(3, "new big york"s, DocumentStatus::ACTUAL, {});
+    search_server.AddDocument(4, "new the york"s, DocumentStatus::ACTUAL, {});
+    ASSERT_THROWS(search_server.FindTopDocuments("\"new york\""s), invalid_argument);
+    search_server.SetPositionalIndex(true);
+    ASSERT(search_server.GetPositionalIndexMemoryUsage() > 0);
+
+    const auto exact = search_server.FindTopDocuments("\"new york\""s);
+    ASSERT_EQUAL(exact.size(), 1u);
+    ASSERT_EQUAL(exact[0].id, 1);
+    // Up to one more word in between
+    const auto near = search_server.FindTopDocuments("\"new york\"~1"s);
+    ASSERT_EQUAL(near.size(), 3u);
+    ASSERT_EQUAL(near[0].id, 1);
+    // A stop word holds its place, whatever word fills it
+    auto stop = search_server.FindTopDocuments("\"new the york\""s);
+    ASSERT_EQUAL(stop.size(), 2u);
+    ASSERT(min(stop[0].id, stop[1].id) == 3 && max(stop[0].id, stop[1].id) == 4);
+    // The phrase and the other words of the query both have to hold
+    ASSERT(search_server.FindTopDocuments("\"new york\" -big"s).empty());
+
+    // Documents added later have positions as well
+    search_server.AddDocument(5, "old new york"s, DocumentStatus::ACTUAL, {});
+    ASSERT_EQUAL(search_server.FindTopDocuments(execution::par, "\"new york\""s).size(), 2u);
+    for (const string& query : { "\"new york"s, "-\"new york\""s, "\"new york\"~x"s }) {
+        ASSERT_THROWS(search_server.FindTopDocuments(query), invalid_argument);
+    }
+}
+
+void TestConjunctive() {
+    const SearchServer search_server = MakeAnimalServer();
+    SearchOptions options;
+    options.conjunctive = true;
+    const auto documents = search_server.FindTopDocuments("curly cat"s, options);
+    ASSERT_EQUAL(documents.size(), 1u);
+    ASSERT_EQUAL(documents[0].id, 2);
+    ASSERT(search_server.FindTopDocuments("curly cat -tail"s, options).empty());
+    ASSERT(search_server.FindTopDocuments("curly parrot"s, options).empty());
+    ASSERT_EQUAL(search_server.FindTopDocuments(execution::par, "nasty"s, options).size(), 2u);
+
+    // The same documents as OR queries filtered to the ones with every word
+    const Corpus corpus = MakeCorpus(2'000, 200);
+    SearchServer corpus_server("a"s);
+    AddCorpus(corpus_server, corpus);
+    SearchOptions all;
+    all.max_result_count = corpus.documents.size();
+    for (const string& query : corpus.queries) {
+        vector<Document> expected;
+        for (const Document& document : corpus_server.FindTopDocuments(query, all)) {
+            const auto [words, status] = corpus_server.MatchDocument(query, document.id);
+            vector<string_view> plus_words;
+            for (const string_view word : SplitIntoWordsView(query)) {
+                if (word[0] != '-' && word != "a"sv) {
+                    plus_words.push_back(word);
+                }
+            }
+            sort(plus_words.begin(), plus_words.end());
+            plus_words.erase(unique(plus_words.begin(), plus_words.end()), plus_words.end());
+            if (words.size() == plus_words.size() && expected.size() < MAX_RESULT_DOCUMENT_COUNT) {
+                expected.push_back(document);
+            }
+        }
+        AssertSameDocuments(corpus_server.FindTopDocuments(query, options), expected, query);
+    }
+}
+
+void TestMatchDocument() {
+    const SearchServer search_server = MakeAnimalServer();
+    for (const bool is_parallel : { false, true }) {
+        const auto match = [&](const string& query, int document_id) {
+            return is_parallel ? search_server.MatchDocument(execution::par, query, document_id)
+                               : search_server.MatchDocument(query, document_id);
+        };
+        auto [words, status] = match("curly tail cat dog"s, 2);
+        sort(words.begin(), words.end());
+        ASSERT((words == vector<string_view>{ "cat", "curly", "tail" }));
+        ASSERT(status == DocumentStatus::ACTUAL);
+        ASSERT(get<0>(match("curly cat -tail"s, 2)).empty());
+        ASSERT(get<0>(match("and"s, 1)).empty());
+    }
+
+    const auto matches = search_server.MatchDocuments("nasty cat -eyes"s, { 1, 3, 4 });
+    ASSERT_EQUAL(matches.size(), 3u);
+    ASSERT((get<0>(matches[0]) == vector<string_view>{ "cat" }));
+    ASSERT(get<0>(matches[1]).empty());
+    ASSERT((get<0>(matches[2]) == vector<string_view>{ "nasty" }));
+    ASSERT_THROWS(search_server.MatchDocuments("cat"s, { 1, 100 }), out_of_range);
+}
+
+void TestCompiledQueries() {
+    const Corpus corpus = MakeCorpus(1'000, 100);
+    SearchServer search_server("a"s);
+    AddCorpus(search_server, corpus);
+    CompiledQuery compiled;
+    for (const string& query : corpus.queries) {
+        search_server.CompileQuery(query, compiled);
+        AssertSameDocuments(search_server.FindTopDocuments(compiled), search_server.FindTopDocuments(query), query);
+        AssertSameDocuments(search_server.FindTopDocuments(execution::par, compiled, DocumentStatus::BANNED),
+                            search_server.FindTopDocuments(query, DocumentStatus::BANNED), query);
+        ASSERT(search_server.MatchDocument(compiled, 3) == search_server.MatchDocument(query, 3));
+    }
+    // A compiled query sees the documents added after it was compiled
+    const CompiledQuery fresh = search_server.CompileQuery("zzz"s);
+    ASSERT(search_server.FindTopDocuments(fresh).empty());
+    search_server.AddDocument(5'000, "zzz"s, DocumentStatus::ACTUAL, {});
+    ASSERT_EQUAL(search_server.FindTopDocuments(fresh).size(), 1u);
+    ASSERT(get<0>(search_server.MatchDocument(fresh, 5'000)) == vector<string_view>{ "zzz"sv });
+    ASSERT_THROWS(search_server.CompileQuery("--zzz"s), invalid_argument);
+}
+
+void TestProcessQueries() {
+    const Corpus corpus = MakeCorpus(1'000, 100);
+    SearchServer search_server("a"s);
+    AddCorpus(search_server, corpus);
+    const auto results = ProcessQueries(search_server, corpus.queries);
+    ASSERT_EQUAL(results.size(), corpus.queries.size());
+    vector<Document> joined;
+    for (size_t i = 0; i < corpus.queries.size(); ++i) {
+        AssertSameDocuments(results[i], search_server.FindTopDocuments(corpus.queries[i]), corpus.queries[i]);
+        joined.insert(joined.end(), results[i].begin(), results[i].end());
+    }
+    AssertSameDocuments(ProcessQueriesJoined(search_server, corpus.queries), joined, "joined"s);
+
+    for (const bool ordered : { true, false }) {
+        StreamOptions options;
+        options.max_in_flight = 8;
+        options.ordered = ordered;
+        vector<optional<vector<Document>>> streamed(corpus.queries.size());
+        size_t next_position = 0;
+        ProcessQueriesStream(search_server, corpus.queries.begin(), corpus.queries.end(), [&](size_t position, vector<Document> documents) {
+            ASSERT(!ordered || position == next_position);
+            ++next_position;
+            ASSERT(!streamed.at(position));
+            streamed[position] = move(documents);
+        }, options);
+        ASSERT_EQUAL(next_position, corpus.queries.size());
+        for (size_t i = 0; i < corpus.queries.size(); ++i) {
+            AssertSameDocuments(*streamed[i], results[i], corpus.queries[i]);
+        }
+    }
+}
+
+void TestConcurrentUpdates() {
+    SearchServer search_server = MakeAnimalServer();
+    // Every update adds two documents with the word or removes the two added before,
+    // so a query that sees half an update finds an odd number of them
+    atomic_bool stop = false;
+    atomic<int> update_count = 0;
+    thread writer([&] {
+        for (int id = 100; !stop; id += 2) {
+            search_server.AddDocuments({ { id, "word"sv, DocumentStatus::ACTUAL, {} }, { id + 1, "word"sv, DocumentStatus::ACTUAL, {} } });
+            if (id > 100) {
+                search_server.RemoveDocuments({ id - 2, id - 1 });
+            }
+            ++update_count;
+        }
+    });
+    size_t query_count = 0;
+    while (query_count < 2'000 || update_count < 100) {
+        const size_t found = (query_count % 2 == 0 ? search_server.FindTopDocuments("word"s)
+                                                   : search_server.FindTopDocuments(execution::par, "word"s)).size();
+        ASSERT(found == 0 || found == 2 || found == 4);
+        ++query_count;
+    }
+    stop = true;
+    writer.join();
+    search_server.WaitForMerges();
+    ASSERT_EQUAL(search_server.FindTopDocuments("word"s).size(), 2u);
+}
+
+void TestThreadPoolSwap() {
+    const Corpus corpus = MakeCorpus(1'000, 100);
+    SearchServer search_server("a"s);
+    AddCorpus(search_server, corpus);
+    const auto expected = ProcessQueries(search_server, corpus.queries);
+    atomic_bool stop = false;
+    thread swapper([&] {
+        for (size_t thread_count = 1; !stop; thread_count = thread_count % 3 + 1) {
+            search_server.SetThreadPool(make_shared<ThreadPool>(thread_count));
+        }
+    });
+    for (int i = 0; i < 5; ++i) {
+        const auto results = ProcessQueries(search_server, corpus.queries);
+        for (size_t j = 0; j < results.size(); ++j) {
+            AssertSameDocuments(results[j], expected[j], corpus.queries[j]);
+        }
+    }
+    stop = true;
+    swapper.join();
+}
+
+int main() {
+    RUN_TEST(TestRanking);
+    RUN_TEST(TestStopAndMinusWords);
+    RUN_TEST(TestInvalidInput);
+    RUN_TEST(TestFilters);
+    RUN_TEST(TestExecutionPoliciesAgree);
+    RUN_TEST(TestDynamicPruning);
+    RUN_TEST(TestImpactOrdering);
+    RUN_TEST(TestRemoveDocuments);
+    RUN_TEST(TestBatchMatchesOneByOne);
+    RUN_TEST(TestMergesWithRemovals);
+    RUN_TEST(TestPurgeReleasesMemory);
+    RUN_TEST(TestPostingCodecs);
+    RUN_TEST(TestSaveAndOpenIndex);
+    RUN_TEST(TestResultCache);
+    RUN_TEST(TestPhrases);
+    RUN_TEST(TestConjunctive);
+    RUN_TEST(TestMatchDocument);
+    RUN_TEST(TestCompiledQueries);
+    RUN_TEST(TestProcessQueries);
+    RUN_TEST(TestConcurrentUpdates);
+    RUN_TEST(TestThreadPoolSwap);
+}
@@ -0,0 +1,34 @@
+#include "text_arena.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+using namespace std;
+
+TextArena::TextArena(size_t chunk_size)
+    : chunk_size_(chunk_size) {
+}
+
+string_view TextArena::Store(string_view text) {
+    if (text.empty()) {
+        return {};
+    }
+    if (chunks_.empty() || chunks_.back().capacity - chunks_.back().used < text.size()) {
+        Chunk chunk;
+        chunk.capacity = max(chunk_size_, text.size());
+        chunk.data = make_unique<char[]>(chunk.capacity);
+        allocated_bytes_ += chunk.capacity;
+        chunks_.push_back(move(chunk));
+    }
+
+    Chunk& chunk = chunks_.back();
+    char* destination = chunk.data.get() + chunk.used;
+    memcpy(destination, text.data(), text.size());
+    chunk.used += text.size();
+    return { destination, text.size() };
+}
+
+size_t TextArena::GetAllocatedBytes() const {
+    return allocated_bytes_;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Append-only storage that packs texts one after another into large chunks,
+// so storing a text costs a memcpy instead of an allocation. Texts live as long
+// as the arena; segments are immutable, and merges copy the live texts of the
+// segments they replace into a new arena instead of compacting an old one.
+class TextArena {
+public:
+    static constexpr size_t DEFAULT_CHUNK_SIZE = 1 << 20;
+
+    explicit TextArena(size_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+    // The returned view stays valid as long as the arena
+    std::string_view Store(std::string_view text);
+
+    size_t GetAllocatedBytes() const;
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t capacity = 0;
+        size_t used = 0;
+    };
+
+    size_t chunk_size_;
+    std::vector<Chunk> chunks_;
+    size_t allocated_bytes_ = 0;
+};
@@ -0,0 +1,195 @@
+#include "thread_pool.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+// Worker identity of the current thread; nullptr outside of any pool
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local size_t current_worker = 0;
+
+void PinCurrentThread([[maybe_unused]] int cpu) {
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+#endif
+}
+
+}  // namespace
+
+ThreadPool::ThreadPool(size_t thread_count, const vector<int>& cpu_affinity) {
+    thread_count = max<size_t>(thread_count, 1);
+    for (size_t i = 0; i < thread_count; ++i) {
+        queues_.push_back(make_unique<WorkerQueue>());
+    }
+    workers_.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; ++i) {
+        const int cpu = cpu_affinity.empty() ? -1 : cpu_affinity[i % cpu_affinity.size()];
+        workers_.emplace_back([this, i, cpu] {
+            if (cpu >= 0) {
+                PinCurrentThread(cpu);
+            }
+            RunWorker(i);
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard lock(sleep_mutex_);
+        stopping_ = true;
+    }
+    wake_up_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+shared_ptr<ThreadPool> ThreadPool::GetDefault() {
+    static const auto pool = make_shared<ThreadPool>();
+    return pool;
+}
+
+size_t ThreadPool::GetThreadCount() const {
+    return workers_.size();
+}
+
+void ThreadPool::WorkerQueue::PushBack(Task task) {
+    if (size == tasks.size()) {
+        // Unrolled into a larger buffer, so the tasks start at its front
+        vector<Task> grown(max<size_t>(2 * tasks.size(), 16));
+        for (size_t i = 0; i < size; ++i) {
+            grown[i] = move(tasks[(first + i) % tasks.size()]);
+        }
+        tasks = move(grown);
+        first = 0;
+    }
+    tasks[(first + size++) % tasks.size()] = move(task);
+}
+
+ThreadPool::Task ThreadPool::WorkerQueue::PopBack() {
+    return move(tasks[(first + --size) % tasks.size()]);
+}
+
+ThreadPool::Task ThreadPool::WorkerQueue::PopFront() {
+    Task task = move(tasks[first]);
+    first = (first + 1) % tasks.size();
+    --size;
+    return task;
+}
+
+ThreadPool::ParallelForJob* ThreadPool::AcquireJob() {
+    lock_guard lock(jobs_mutex_);
+    if (free_jobs_.empty()) {
+        jobs_.push_back(make_unique<ParallelForJob>());
+        free_jobs_.reserve(jobs_.size());
+        return jobs_.back().get();
+    }
+    ParallelForJob* job = free_jobs_.back();
+    free_jobs_.pop_back();
+    return job;
+}
+
+void ThreadPool::ReleaseJob(ParallelForJob* job) {
+    lock_guard lock(jobs_mutex_);
+    free_jobs_.push_back(job);
+}
+
+void ThreadPool::HelpJob(ParallelForJob& job, uint64_t generation) {
+    {
+        lock_guard lock(job.mutex);
+        if (job.generation != generation) {
+            return;
+        }
+        ++job.running_helpers;
+    }
+    RunJob(job);
+    lock_guard lock(job.mutex);
+    if (--job.running_helpers == 0) {
+        job.done.notify_all();
+    }
+}
+
+void ThreadPool::RunJob(ParallelForJob& job) {
+    const auto finish = [&job](size_t finished_count) {
+        if (job.remaining.fetch_sub(finished_count) == finished_count) {
+            lock_guard lock(job.mutex);
+            job.done.notify_all();
+        }
+    };
+    for (size_t i = job.next_index++; i < job.count; i = job.next_index++) {
+        try {
+            job.call(job.func, i);
+        } catch (...) {
+            {
+                lock_guard lock(job.mutex);
+                if (!job.error) {
+                    job.error = current_exception();
+                }
+            }
+            // Indices nobody has taken yet will never run, so they count as finished
+            const size_t next_index = job.next_index.exchange(job.count);
+            finish(1 + job.count - min(next_index, job.count));
+            return;
+        }
+        finish(1);
+    }
+}
+
+void ThreadPool::Push(Task task) {
+    // Workers keep their own tasks local; other threads spread them round-robin
+    const size_t index = current_pool == this ? current_worker : next_queue_++ % queues_.size();
+    {
+        lock_guard lock(sleep_mutex_);
+        ++queued_task_count_;
+    }
+    {
+        lock_guard lock(queues_[index]->mutex);
+        queues_[index]->PushBack(move(task));
+    }
+    wake_up_.notify_one();
+}
+
+bool ThreadPool::TryRunTask() {
+    if (queued_task_count_ == 0) {
+        return false;
+    }
+    const size_t own = current_pool == this ? current_worker : 0;
+    Task task;
+    for (size_t i = 0; i < queues_.size() && !task; ++i) {
+        WorkerQueue& queue = *queues_[(own + i) % queues_.size()];
+        lock_guard lock(queue.mutex);
+        if (queue.size == 0) {
+            continue;
+        }
+        task = i == 0 && current_pool == this ? queue.PopBack() : queue.PopFront();
+    }
+    if (!task) {
+        return false;
+    }
+    --queued_task_count_;
+    task();
+    return true;
+}
+
+void ThreadPool::RunWorker(size_t index) {
+    current_pool = this;
+    current_worker = index;
+    while (true) {
+        if (TryRunTask()) {
+            continue;
+        }
+        unique_lock lock(sleep_mutex_);
+        wake_up_.wait(lock, [this] { return stopping_ || queued_task_count_ > 0; });
+        if (stopping_ && queued_task_count_ == 0) {
+            return;
+        }
+    }
+}
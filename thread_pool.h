@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed set of worker threads, each with its own task queue. A worker takes tasks
+// from the back of its own queue and steals from the front of the others when it
+// runs dry. ParallelFor called from a worker queues the parts on that worker and
+// keeps executing tasks while it waits, so nested parallelism reuses the same
+// threads instead of creating new ones. Once the queues and the pool of jobs have
+// grown, ParallelFor allocates nothing.
+class ThreadPool {
+public:
+    // cpu_affinity[i % size] is the CPU worker i is pinned to; empty means no pinning
+    explicit ThreadPool(size_t thread_count = std::max(1u, std::thread::hardware_concurrency()),
+                        const std::vector<int>& cpu_affinity = {});
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Pool shared by search servers that were not given their own
+    static std::shared_ptr<ThreadPool> GetDefault();
+
+    size_t GetThreadCount() const;
+
+    // Calls func(i) for every i in [0, count) and returns when all calls are done.
+    // The calling thread takes part in the work. Once a call throws, no new index is
+    // started; the calls already running finish and the first exception is rethrown
+    template <typename Func>
+    void ParallelFor(size_t count, const Func& func);
+
+    template <typename Func>
+    std::future<std::invoke_result_t<Func>> Submit(Func func);
+
+private:
+    using Task = std::function<void()>;
+
+    // A ring buffer of tasks, which only allocates when it grows
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::vector<Task> tasks;
+        size_t first = 0;
+        size_t size = 0;
+
+        void PushBack(Task task);
+        Task PopBack();
+        Task PopFront();
+    };
+
+    // A ParallelFor call. Helpers may still be queued after the last index is done; the job
+    // goes back to the pool then, and a helper whose generation has passed does nothing
+    struct ParallelForJob {
+        // Calls the func of the ParallelFor call, which func points to, with an index
+        void (*call)(const void* func, size_t index) = nullptr;
+        const void* func = nullptr;
+        size_t count = 0;
+        std::atomic<size_t> next_index{0};
+        std::atomic<size_t> remaining{0};
+        std::mutex mutex;
+        std::condition_variable done;
+        // Guarded by mutex: the call the job serves, the helpers running it and the first
+        // exception thrown by func
+        uint64_t generation = 0;
+        size_t running_helpers = 0;
+        std::exception_ptr error;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<size_t> queued_task_count_{0};
+    std::atomic<size_t> next_queue_{0};
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_up_;
+    bool stopping_ = false;
+    std::mutex jobs_mutex_;
+    std::vector<std::unique_ptr<ParallelForJob>> jobs_;
+    // Has room for every job, so returning one never allocates
+    std::vector<ParallelForJob*> free_jobs_;
+
+    ParallelForJob* AcquireJob();
+    void ReleaseJob(ParallelForJob* job);
+    // Runs indices of the job until none is left; never throws, helpers run as pool tasks
+    static void RunJob(ParallelForJob& job);
+    // RunJob as a helper, unless the call of that generation is over
+    static void HelpJob(ParallelForJob& job, uint64_t generation);
+    void Push(Task task);
+    // Runs one queued task, preferring the current worker's own queue
+    bool TryRunTask();
+    void RunWorker(size_t index);
+};
+
+template <typename Func>
+void ThreadPool::ParallelFor(size_t count, const Func& func) {
+    if (count == 0) {
+        return;
+    }
+    if (count == 1) {
+        func(0);
+        return;
+    }
+
+    ParallelForJob* job = AcquireJob();
+    job->call = [](const void* func, size_t index) {
+        (*static_cast<const Func*>(func))(index);
+    };
+    job->func = &func;
+    job->count = count;
+    job->next_index = 0;
+    job->remaining = count;
+    job->error = nullptr;
+
+    // The caller must not leave while helpers use func, so it waits for every index to finish.
+    // While tasks wait in the queues, more helpers would only wait behind them and grow the queues
+    const size_t queued_count = std::min<size_t>(queued_task_count_, workers_.size());
+    const size_t helper_count = std::min(count - 1, workers_.size() - queued_count);
+    uint64_t generation;
+    {
+        std::lock_guard lock(job->mutex);
+        generation = job->generation;
+    }
+    for (size_t i = 0; i < helper_count; ++i) {
+        Push([job, generation] {
+            HelpJob(*job, generation);
+        });
+    }
+    RunJob(*job);
+
+    // Every index is taken by now; help with other work until the running ones finish
+    while (job->remaining > 0) {
+        if (!TryRunTask()) {
+            std::unique_lock lock(job->mutex);
+            job->done.wait(lock, [job] { return job->remaining == 0; });
+        }
+    }
+    std::exception_ptr error;
+    {
+        // Helpers that joined leave without touching func; those still queued will find the call over
+        std::unique_lock lock(job->mutex);
+        job->done.wait(lock, [job] { return job->running_helpers == 0; });
+        ++job->generation;
+        error = std::move(job->error);
+    }
+    ReleaseJob(job);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+template <typename Func>
+std::future<std::invoke_result_t<Func>> ThreadPool::Submit(Func func) {
+    auto task = std::make_shared<std::packaged_task<std::invoke_result_t<Func>()>>(std::move(func));
+    auto result = task->get_future();
+    Push([task] { (*task)(); });
+    return result;
+}
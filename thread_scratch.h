@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Lends the calling thread an object of type T for the scope of the ThreadScratch, for
+// buffers that should keep their capacity from one query to the next instead of being
+// allocated by every one. A thread keeps a stack of objects per type: a scope nested in
+// another on the same thread, e.g. a pool task the thread runs while it waits in
+// ParallelFor, gets an object of its own. Objects are created on first use only
+template <typename T>
+class ThreadScratch {
+public:
+    ThreadScratch()
+        : stack_(GetStack()) {
+        if (stack_.depth == stack_.objects.size()) {
+            stack_.objects.push_back(std::make_unique<T>());
+        }
+        object_ = stack_.objects[stack_.depth++].get();
+    }
+
+    ~ThreadScratch() {
+        --stack_.depth;
+    }
+
+    ThreadScratch(const ThreadScratch&) = delete;
+    ThreadScratch& operator=(const ThreadScratch&) = delete;
+
+    T& operator*() const {
+        return *object_;
+    }
+
+    T* operator->() const {
+        return object_;
+    }
+
+private:
+    struct Stack {
+        std::vector<std::unique_ptr<T>> objects;
+        size_t depth = 0;
+    };
+
+    static Stack& GetStack() {
+        thread_local Stack stack;
+        return stack;
+    }
+
+    Stack& stack_;
+    T* object_;
+};
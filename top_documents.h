@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "document.h"
+
+const int MAX_RESULT_DOCUMENT_COUNT = 5;
+const double ACCURACY = 1e-6;
+
+// Ranking order of search results: by relevance, ratings break near-ties and ids break
+// the remaining ones, so the result does not depend on the order documents are scored in
+inline bool IsMoreRelevant(const Document& lhs, const Document& rhs) {
+    if (std::abs(lhs.relevance - rhs.relevance) < ACCURACY) {
+        if (lhs.rating != rhs.rating) {
+            return lhs.rating > rhs.rating;
+        }
+        return lhs.id < rhs.id;
+    }
+    return lhs.relevance > rhs.relevance;
+}
+
+// Keeps the best max_count documents seen so far in a heap whose front is the
+// weakest one, so every candidate costs O(log max_count) and nothing else is stored
+class TopDocuments {
+public:
+    explicit TopDocuments(size_t max_count = 0)
+        : max_count_(max_count) {
+        heap_.reserve(max_count);
+    }
+
+    // Starts over empty, keeping the buffer
+    void Reset(size_t max_count) {
+        max_count_ = max_count;
+        heap_.clear();
+        heap_.reserve(max_count);
+    }
+
+    void Push(const Document& document) {
+        if (heap_.size() < max_count_) {
+            heap_.push_back(document);
+            std::push_heap(heap_.begin(), heap_.end(), IsMoreRelevant);
+        } else if (max_count_ > 0 && IsMoreRelevant(document, heap_.front())) {
+            std::pop_heap(heap_.begin(), heap_.end(), IsMoreRelevant);
+            heap_.back() = document;
+            std::push_heap(heap_.begin(), heap_.end(), IsMoreRelevant);
+        }
+    }
+
+    size_t GetMaxCount() const {
+        return max_count_;
+    }
+
+    // A document whose relevance does not exceed this value cannot get into the top
+    double GetRelevanceThreshold() const {
+        if (max_count_ == 0) {
+            return std::numeric_limits<double>::infinity();
+        }
+        if (heap_.size() < max_count_) {
+            return -std::numeric_limits<double>::infinity();
+        }
+        return heap_.front().relevance - ACCURACY;
+    }
+
+    void Merge(const TopDocuments& other) {
+        for (const Document& document : other.heap_) {
+            Push(document);
+        }
+    }
+
+    // Best document first
+    std::vector<Document> Release() {
+        std::sort_heap(heap_.begin(), heap_.end(), IsMoreRelevant);
+        return std::move(heap_);
+    }
+
+    // The same into result, which keeps its buffer as this keeps its own
+    void Release(std::vector<Document>& result) {
+        std::sort_heap(heap_.begin(), heap_.end(), IsMoreRelevant);
+        result.assign(heap_.begin(), heap_.end());
+        heap_.clear();
+    }
+
+private:
+    size_t max_count_;
+    std::vector<Document> heap_;
+};